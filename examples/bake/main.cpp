@@ -0,0 +1,229 @@
+// Batch-bakes a directory of serialized TF presets (files written
+// with TFEditor::serialize(), extension .tfe) into LUT files and PNG
+// thumbnails. Presets are processed in parallel, one preset per task,
+// so memory use is bounded by the number of threads rather than by the
+// size of the library.
+//
+// Preset <name> is written to <name>_<size>.<format> for each LUT and
+// to <name>.thumb.png for its thumbnail; the suffixes keep thumbnails
+// from colliding with PNG LUTs of presets named like <name>_<size>.
+//
+//   bake <input dir> <output dir> [options]
+//     --sizes 256,1024           LUT resolutions
+//     --formats rgba8,rgba32f    any of rgba8, rgba32f, csv, png
+//     --thumbnail 128x64         thumbnail size (0x0 disables them)
+//     --threads N                number of threads
+
+#include <tfe/TFEditor.h>
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION 1
+#include "stb/stb_image_write.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+
+#include <dirent.h>
+
+using namespace tfe;
+
+struct Options
+{
+  std::string inputDir, outputDir;
+  std::vector<unsigned> sizes{256};
+  std::vector<std::string> formats{"rgba8"};
+  unsigned thumbnailWidth{128}, thumbnailHeight{64};
+};
+
+static std::vector<std::string> split(const std::string &str, char sep)
+{
+  std::vector<std::string> res;
+  std::stringstream ss(str);
+  std::string item;
+  while (std::getline(ss, item, sep)) {
+    if (!item.empty()) res.push_back(item);
+  }
+  return res;
+}
+
+static bool endsWith(const std::string &str, const std::string &suffix)
+{
+  return str.size() >= suffix.size()
+      && str.compare(str.size()-suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool readFile(const std::string &fileName, std::vector<uint8_t> &bytes)
+{
+  FILE *file = fopen(fileName.c_str(), "rb");
+  if (!file)
+    return false;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  bytes.resize(size > 0 ? size_t(size) : 0);
+  bool ok = size >= 0 && fread(bytes.data(), 1, bytes.size(), file) == bytes.size();
+  fclose(file);
+  return ok;
+}
+
+static bool writeFile(const std::string &fileName, const void *data, size_t size)
+{
+  FILE *file = fopen(fileName.c_str(), "wb");
+  if (!file)
+    return false;
+  bool ok = fwrite(data, 1, size, file) == size;
+  return fclose(file) == 0 && ok;
+}
+
+// write the LUT in the given format; returns the number of bytes
+// written, or 0 on failure
+static size_t writeLUT(const std::string &baseName, const std::string &format,
+                       const std::vector<vec4f> &rgba)
+{
+  unsigned n = unsigned(rgba.size());
+  std::vector<uint32_t> rgba8(n);
+  cvt_uint32(rgba.data(), rgba8.data(), n);
+
+  if (format == "rgba8") {
+    size_t size = n*sizeof(uint32_t);
+    return writeFile(baseName+".rgba8", rgba8.data(), size) ? size : 0;
+  } else if (format == "rgba32f") {
+    size_t size = n*sizeof(vec4f);
+    return writeFile(baseName+".rgba32f", rgba.data(), size) ? size : 0;
+  } else if (format == "csv") {
+    std::stringstream ss;
+    ss << "x,r,g,b,a\n";
+    for (unsigned i=0; i<n; ++i) {
+      ss << i/float(n-1) << ',' << rgba[i].x << ',' << rgba[i].y << ','
+         << rgba[i].z << ',' << rgba[i].w << '\n';
+    }
+    std::string str = ss.str();
+    return writeFile(baseName+".csv", str.data(), str.size()) ? str.size() : 0;
+  } else if (format == "png") {
+    std::string fileName = baseName+".png";
+    if (!stbi_write_png(fileName.c_str(), n, 1, 4, rgba8.data(), n*4))
+      return 0;
+    return n*sizeof(uint32_t);
+  }
+  return 0;
+}
+
+static bool parseArgs(int argc, char **argv, Options &opts)
+{
+  std::vector<std::string> positional;
+  for (int i=1; i<argc; ++i) {
+    std::string arg = argv[i];
+    bool hasValue = i+1 < argc;
+    if (arg == "--sizes" && hasValue) {
+      opts.sizes.clear();
+      for (auto &s : split(argv[++i], ',')) opts.sizes.push_back(std::max(atoi(s.c_str()), 2));
+    } else if (arg == "--formats" && hasValue) {
+      opts.formats = split(argv[++i], ',');
+    } else if (arg == "--thumbnail" && hasValue) {
+      if (sscanf(argv[++i], "%ux%u", &opts.thumbnailWidth, &opts.thumbnailHeight) != 2)
+        return false;
+    } else if (arg == "--threads" && hasValue) {
+      parallel::setNumThreads(unsigned(atoi(argv[++i])));
+    } else if (arg.compare(0, 2, "--") == 0) {
+      return false;
+    } else {
+      positional.push_back(arg);
+    }
+  }
+
+  if (positional.size() != 2)
+    return false;
+  opts.inputDir = positional[0];
+  opts.outputDir = positional[1];
+
+  for (auto &f : opts.formats) {
+    if (f != "rgba8" && f != "rgba32f" && f != "csv" && f != "png") {
+      std::cerr << "unknown format: " << f << '\n';
+      return false;
+    }
+  }
+  return !opts.sizes.empty();
+}
+
+int main(int argc, char **argv) {
+  Options opts;
+  if (!parseArgs(argc, argv, opts)) {
+    std::cerr << "usage: " << argv[0] << " <input dir> <output dir> [--sizes 256,1024]"
+              << " [--formats rgba8,rgba32f,csv,png] [--thumbnail 128x64] [--threads N]\n";
+    return 1;
+  }
+
+  std::vector<std::string> names;
+  if (DIR *dir = opendir(opts.inputDir.c_str())) {
+    while (dirent *ent = readdir(dir)) {
+      std::string name = ent->d_name;
+      if (endsWith(name, ".tfe"))
+        names.push_back(name.substr(0, name.size()-4));
+    }
+    closedir(dir);
+  } else {
+    std::cerr << "can't open directory " << opts.inputDir << '\n';
+    return 1;
+  }
+  std::sort(names.begin(), names.end());
+
+  std::atomic<size_t> bytesWritten(0), numFailed(0);
+  std::mutex logMutex;
+  auto start = std::chrono::steady_clock::now();
+
+  // one preset per chunk; bakes inside a chunk run serially, so each
+  // thread only ever holds one preset's tables
+  parallel::forEachChunk(names.size(), [&](size_t i) {
+    auto fail = [&](const char *what) {
+      std::lock_guard<std::mutex> lock(logMutex);
+      std::cerr << names[i] << ": " << what << '\n';
+      ++numFailed;
+    };
+
+    std::vector<uint8_t> state;
+    TFEditor editor;
+    if (!readFile(opts.inputDir+"/"+names[i]+".tfe", state)) {
+      fail("can't read preset");
+      return;
+    } else if (!editor.deserialize(state.data(), state.size())) {
+      fail("not a valid preset");
+      return;
+    }
+
+    for (unsigned size : opts.sizes) {
+      std::vector<vec4f> rgba = editor.getRGBA(size);
+      std::string baseName = opts.outputDir+"/"+names[i]+"_"+std::to_string(size);
+      for (auto &format : opts.formats) {
+        size_t bytes = writeLUT(baseName, format, rgba);
+        if (bytes == 0) {
+          fail("can't write LUT");
+          return;
+        }
+        bytesWritten += bytes;
+      }
+    }
+
+    if (opts.thumbnailWidth > 0 && opts.thumbnailHeight > 0) {
+      editor.setBackground(std::make_shared<Checkers>(8,vec3f(0.8f),vec3f(1.f)));
+      Texture tex = editor.rasterize(opts.thumbnailWidth, opts.thumbnailHeight);
+      tex.setOrigin(Texture::TopLeft);
+      std::string fileName = opts.outputDir+"/"+names[i]+".thumb.png";
+      if (!stbi_write_png(fileName.c_str(),tex.width,tex.height,4,tex.data.data(),tex.width*4)) {
+        fail("can't write thumbnail");
+        return;
+      }
+      bytesWritten += tex.data.size()*sizeof(uint32_t);
+    }
+  });
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  size_t numBaked = names.size()-numFailed;
+  std::cout << "baked " << numBaked << " of " << names.size() << " presets in "
+            << seconds << " s with " << parallel::getNumThreads() << " threads ("
+            << (seconds > 0.0 ? numBaked/seconds : 0.0) << " presets/s, "
+            << (seconds > 0.0 ? bytesWritten/seconds/(1<<20) : 0.0) << " MiB/s)\n";
+  return numFailed > 0 ? 1 : 0;
+}
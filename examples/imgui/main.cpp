@@ -53,12 +53,8 @@ int main() {
         glViewport(0, 0, newWidth, newHeight);
       });
 
-  glfwSetCursorPosCallback(glfwWindow, [](GLFWwindow *, double x, double y) {
-    //ImGuiIO &io = ImGui::GetIO();
-    //if (!io.WantCaptureMouse) {
-      //activeWindow->motion(int2{int(x), int(y)});
-    //}
-  });
+  // no cursor callback: ImGui polls the cursor once per frame, and
+  // TFEditorImGui::draw() consumes the result as a single edit
 
   glfwSetKeyCallback(
       glfwWindow, [](GLFWwindow *, int key, int, int action, int) {
@@ -75,15 +71,29 @@ int main() {
   TFEditorImGui editor;
   editor.setBackground(std::make_shared<Checkers>(16,vec3f(0.8f),vec3f(1.f)));
 
+  vec2f CPs[] =  {
+    {0.0f,0.1f},
+    {0.3f,0.6f},
+    {0.6f,0.2f},
+    {1.0f,0.4f}, };
+  auto pl = std::make_shared<PiecewiseLinear>(CPs,4);
+  editor.addFunction(pl);
+
   auto tn = std::make_shared<Tent>();
   editor.addFunction(tn);
 
+  auto fh = std::make_shared<FreeHand>(256-16);
+  editor.addFunction(fh);
+  bool freeHandMode = false;
+
   // main loop:
   while (true) {
     ImGui_ImplGlfwGL3_NewFrame();
     ImGuiWindowFlags flags = ImGuiWindowFlags_AlwaysAutoResize;
     ImGui::Begin(
         "Transfer Function Editor", nullptr, flags);
+    if (ImGui::Checkbox("Draw free-hand", &freeHandMode))
+      editor.setDrawTarget(freeHandMode ? fh : nullptr);
     editor.draw(256, 128);
     ImGui::End();
 
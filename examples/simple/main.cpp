@@ -4,7 +4,10 @@
 #include "stb/stb_image.h"
 #include "stb/stb_image_write.h"
 
-int main() {
+#include <cstring>
+#include <thread>
+
+int main(int argc, char **argv) {
   using namespace tfe;
   TFEditor editor;
 
@@ -20,7 +23,17 @@ int main() {
   auto tn = std::make_shared<Tent>();
   editor.addFunction(tn);
 
+  if (argc > 1 && strcmp(argv[1], "--verify-determinism") == 0) {
+    unsigned maxThreads = std::max(std::thread::hardware_concurrency(), 8u);
+    bool ok = editor.verifyDeterminism(maxThreads);
+    std::cout << "results with 1.." << maxThreads << " threads are "
+              << (ok ? "bitwise identical" : "NOT identical") << '\n';
+    return ok ? 0 : 1;
+  }
+
   Texture tex = editor.rasterize(256, 128);
+  // PNG rows go top to bottom
+  tex.setOrigin(Texture::TopLeft);
   stbi_write_png("simple.png",tex.width,tex.height,4,tex.data.data(),tex.width*4);
 }
 
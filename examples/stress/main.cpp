@@ -0,0 +1,193 @@
+// Scalability stress test: times the editor's code paths while the
+// number of functions on the stack, and the number of control points
+// of a single function, grow by orders of magnitude, and reports how
+// each path scales (the slope of time over size on a log-log scale; 1
+// is linear, below 1 sublinear).
+//
+//   stress [options]
+//     --max-functions N        largest function stack (default 100000)
+//     --max-control-points N   largest control point count (default 1048576)
+//     --threads N              number of threads
+
+#include <tfe/TFEditor.h>
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iomanip>
+
+using namespace tfe;
+
+// pseudo-random numbers, identical on all machines
+static float random01(uint32_t &state)
+{
+  state = state*1664525u + 1013904223u;
+  return (state >> 8)/float(1<<24);
+}
+
+// microseconds per call; repeats func until at least 20 ms passed
+static double timeCall(const std::function<void()> &func)
+{
+  using clock = std::chrono::steady_clock;
+  size_t calls = 0;
+  auto start = clock::now();
+  double elapsed = 0.0;
+  do {
+    func();
+    ++calls;
+    elapsed = std::chrono::duration<double, std::micro>(clock::now()-start).count();
+  } while (elapsed < 20000.0);
+  return elapsed/calls;
+}
+
+// least-squares slope of log(time) over log(size)
+static double slope(const std::vector<double> &sizes, const std::vector<double> &times)
+{
+  double n = sizes.size(), sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+  for (size_t i=0; i<sizes.size(); ++i) {
+    double x = log(sizes[i]), y = log(std::max(times[i], 1e-3));
+    sx += x; sy += y; sxx += x*x; sxy += x*y;
+  }
+  double d = n*sxx - sx*sx;
+  return d > 0.0 ? (n*sxy - sx*sy)/d : 0.0;
+}
+
+struct Series
+{
+  std::vector<std::string> paths;
+  std::vector<double> sizes;
+  // times[path][size], in microseconds
+  std::vector<std::vector<double>> times;
+
+  explicit Series(const std::vector<std::string> &paths)
+    : paths(paths), times(paths.size())
+  {}
+
+  void print(const char *sizeName) const
+  {
+    std::cout << std::setw(10) << sizeName;
+    for (auto &p : paths) std::cout << std::setw(14) << p;
+    std::cout << "   (us per call)\n" << std::fixed << std::setprecision(2);
+    for (size_t i=0; i<sizes.size(); ++i) {
+      std::cout << std::setw(10) << size_t(sizes[i]);
+      for (auto &t : times) std::cout << std::setw(14) << t[i];
+      std::cout << '\n';
+    }
+    std::cout << std::setw(10) << "slope";
+    for (auto &t : times) std::cout << std::setw(14) << slope(sizes, t);
+    std::cout << "\n\n" << std::defaultfloat;
+  }
+};
+
+// narrow boxes at random positions, like the labels of a segmentation;
+// paths that only visit the functions overlapping x scale sublinearly
+static void functionCount(size_t maxFunctions)
+{
+  Series series({"add", "eval", "select", "bake 4k", "raster", "edit", "raise"});
+  for (size_t n=100; n<=maxFunctions; n*=10) {
+    uint32_t state = 1;
+    TFEditor editor;
+    std::vector<Function::SP> funcs(n);
+    for (size_t i=0; i<n; ++i) {
+      float x = random01(state);
+      funcs[i] = std::make_shared<Box>(box1f(x, x+1.f/n), 0.2f+0.8f*random01(state));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (auto &f : funcs) editor.addFunction(f);
+    double add = std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now()-start).count()/n;
+
+    std::vector<float> xs(1000);
+    for (auto &x : xs) x = random01(state);
+    editor.updateTexture(1024, 256);
+
+    size_t next = 0;
+    series.sizes.push_back(n);
+    series.times[0].push_back(add);
+    series.times[1].push_back(timeCall([&]() {
+      for (float x : xs) editor.eval(x);
+    })/xs.size());
+    series.times[2].push_back(timeCall([&]() {
+      for (float x : xs) editor.select(vec2f(x, 0.1f));
+    })/xs.size());
+    series.times[3].push_back(timeCall([&]() { editor.getAlpha(4096); }));
+    series.times[4].push_back(timeCall([&]() { editor.rasterize(1024, 256); }));
+    // drag the top function's height, and update the texture
+    series.times[5].push_back(timeCall([&]() {
+      const Function::SP &f = editor.getFunctions().back();
+      vec2f cp = f->getControlPoint(0);
+      editor.moveControlPoint(f, 0, vec2f(cp.x, 1.f-cp.y));
+      editor.updateTexture(1024, 256);
+    }));
+    // raise a function (reorders the stack), and update the texture
+    series.times[6].push_back(timeCall([&]() {
+      editor.moveToTop(funcs[next++ % n]);
+      editor.updateTexture(1024, 256);
+    }));
+  }
+
+  std::cout << "function count (boxes of width 1/n)\n";
+  series.print("functions");
+}
+
+// one function with many control points
+template <typename Spline>
+static void controlPointCount(const char *name, size_t maxControlPoints)
+{
+  Series series({"eval", "bake 4k", "edit"});
+  for (size_t n=16; n<=maxControlPoints; n*=4) {
+    uint32_t state = 1;
+    std::vector<vec2f> cps(n);
+    for (size_t i=0; i<n; ++i) {
+      cps[i] = vec2f(i/float(n-1), random01(state));
+    }
+
+    TFEditor editor;
+    auto f = std::make_shared<Spline>(cps.data(), unsigned(n));
+    editor.addFunction(f);
+    editor.updateTexture(1024, 256);
+
+    std::vector<float> xs(1000);
+    for (auto &x : xs) x = random01(state);
+
+    series.sizes.push_back(n);
+    series.times[0].push_back(timeCall([&]() {
+      for (float x : xs) editor.eval(x);
+    })/xs.size());
+    series.times[1].push_back(timeCall([&]() { editor.getAlpha(4096); }));
+    series.times[2].push_back(timeCall([&]() {
+      vec2f cp = f->getControlPoint(n/2);
+      editor.moveControlPoint(f, n/2, vec2f(cp.x, 1.f-cp.y));
+      editor.updateTexture(1024, 256);
+    }));
+  }
+
+  std::cout << "control point count (" << name << ")\n";
+  series.print("points");
+}
+
+int main(int argc, char **argv) {
+  size_t maxFunctions = 100000, maxControlPoints = 1<<20;
+  for (int i=1; i<argc; ++i) {
+    std::string arg = argv[i];
+    bool hasValue = i+1 < argc;
+    if (arg == "--max-functions" && hasValue) {
+      maxFunctions = size_t(atol(argv[++i]));
+    } else if (arg == "--max-control-points" && hasValue) {
+      maxControlPoints = size_t(atol(argv[++i]));
+    } else if (arg == "--threads" && hasValue) {
+      parallel::setNumThreads(unsigned(atoi(argv[++i])));
+    } else {
+      std::cerr << "usage: " << argv[0] << " [--max-functions N]"
+                << " [--max-control-points N] [--threads N]\n";
+      return 1;
+    }
+  }
+
+  std::cout << "threads: " << parallel::getNumThreads() << "\n\n";
+  functionCount(maxFunctions);
+  controlPointCount<PiecewiseLinear>("piecewise linear", maxControlPoints);
+  controlPointCount<MonotoneCubic>("monotone cubic", maxControlPoints);
+  return 0;
+}
@@ -0,0 +1,753 @@
+// Regression tests; each test is a function that reports failed
+// checks, main() runs them all and returns non-zero if any failed.
+
+#include <tfe/TFEditor.h>
+#include <tfe/animation.h>
+#include <tfe/gradient.h>
+#include <tfe/histogramcache.h>
+#include <tfe/presetlibrary.h>
+#include <tfe/suggest.h>
+#include <tfe/trace.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+using namespace tfe;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      ++failures;                                                       \
+    }                                                                   \
+  } while (0)
+
+static bool near(float a, float b, float eps = 1e-5f)
+{
+  return fabsf(a-b) <= eps;
+}
+
+// clamp with lo > 0 turns zeros into non-zeros, so the node must not
+// be skipped outside its child's support
+static void testClampSupport()
+{
+  using namespace compose;
+  auto e = clamp(leaf(std::make_shared<Tent>(vec2f(0.5f, 1.f), 0.f, 0.1f)), 0.3f, 1.f);
+  CHECK(e->support().lower <= 0.f && e->support().upper >= 1.f);
+
+  TFEditor editor;
+  editor.addFunction(e);
+  CHECK(near(e->eval(0.05f), 0.3f));
+  CHECK(near(editor.eval(0.05f), e->eval(0.05f)));
+  CHECK(near(editor.getAlpha(101)[5], e->eval(0.05f)));
+}
+
+// posing must not clamp control points against their values in the
+// previous pose
+static void testAnimationPose()
+{
+  TFEditor editor;
+  auto tent = std::make_shared<Tent>(vec2f(0.5f, 1.f), 0.1f, 0.2f);
+  editor.addFunction(tent);
+
+  TFAnimation anim(editor);
+  anim.addKeyframe(0.f);
+  vec2f wide[3] = { {0.5f, 1.f}, {0.7f, 1.f}, {0.8f, 0.f} };
+  editor.setControlPoints(tent, wide, 3);
+  CHECK(near(tent->getControlPoint(1).x, 0.7f));
+  CHECK(near(tent->getControlPoint(2).x, 0.8f));
+  anim.addKeyframe(1.f);
+
+  anim.bake(0.001f);
+  anim.bake(0.999f);
+  CHECK(near(tent->getControlPoint(1).x, 0.55f + 0.999f*0.15f));
+  CHECK(near(tent->getControlPoint(2).x, 0.6f + 0.999f*0.2f));
+
+  // the posed LUT matches a fresh bake of the same pose
+  const std::vector<vec4f> &lut = anim.bake(0.5f);
+  std::vector<vec4f> fresh = editor.getRGBA(256);
+  bool same = lut.size() == fresh.size();
+  for (size_t i=0; same && i<lut.size(); ++i) {
+    same = lut[i].w == fresh[i].w;
+  }
+  CHECK(same);
+}
+
+static std::vector<uint8_t> freeHandState(const std::vector<float> &samples,
+                                           const std::vector<vec2f> &cps)
+{
+  StateWriter out;
+  out.write(uint32_t(FunctionType::FreeHand));
+  out.write(box1f(0.f, 1.f));
+  out.write(1.f);
+  out.write(1e-3f);
+  out.writeArray(samples.data(), samples.size());
+  out.writeArray(cps.data(), cps.size());
+  return out.bytes;
+}
+
+static Function::SP readFunction(const std::vector<uint8_t> &bytes)
+{
+  StateReader in(bytes.data(), bytes.size());
+  return deserializeFunction(in);
+}
+
+// free-hand curves that drawing can't continue on are rejected
+static void testFreeHandMalformed()
+{
+  std::vector<float> samples(256, 0.f);
+  CHECK(!readFunction(freeHandState(samples, { {0.5f, 0.f} })));
+  CHECK(!readFunction(freeHandState(samples, { {0.f, 0.f}, {0.5f, 0.f} })));
+  CHECK(!readFunction(freeHandState(samples, { {0.f, 0.f}, {0.7f, 0.f}, {0.3f, 0.f}, {1.f, 0.f} })));
+  CHECK(!readFunction(freeHandState(samples, { {0.f, 0.f}, {NAN, 0.f}, {1.f, 0.f} })));
+  CHECK(!readFunction(freeHandState(samples, { {0.f, 0.f}, {1.f, NAN} })));
+  std::vector<float> nans(256, NAN);
+  CHECK(!readFunction(freeHandState(nans, { {0.f, 0.f}, {1.f, 0.f} })));
+
+  auto f = std::dynamic_pointer_cast<FreeHand>(
+      readFunction(freeHandState(samples, { {0.f, 0.f}, {1.f, 0.f} })));
+  CHECK(f != nullptr);
+  if (f) {
+    f->beginStroke(vec2f(0.1f, 0.5f));
+    f->continueStroke(vec2f(0.3f, 0.5f));
+    CHECK(near(f->eval(0.2f), 0.5f, 1e-2f));
+  }
+}
+
+// names are read in place, so an index entry whose name isn't
+// terminated must be rejected when opening
+static void testPresetLibraryNames()
+{
+  const char *fileName = "tfe_tests_presets.tfel";
+  TFEditor editor;
+  editor.addFunction(std::make_shared<Tent>());
+  PresetLibraryWriter writer;
+  writer.add("tent", editor);
+  CHECK(writer.write(fileName));
+
+  PresetLibrary lib;
+  CHECK(lib.open(fileName) && lib.numPresets() == 1 && lib.find("tent") == 0);
+  lib.close();
+
+  // fill the name of the first entry, including its terminator
+  FILE *file = fopen(fileName, "r+b");
+  CHECK(file != nullptr);
+  if (file) {
+    char name[preset::MaxNameLength+1];
+    memset(name, 'x', sizeof(name));
+    fseek(file, long(sizeof(preset::LibraryHeader)), SEEK_SET);
+    fwrite(name, 1, sizeof(name), file);
+    fclose(file);
+    CHECK(lib.open(fileName));
+    CHECK(lib.getName(0) == nullptr && lib.find("tent") < 0);
+    CHECK(lib.getLUT(0) != nullptr);
+  }
+  lib.close();
+  remove(fileName);
+}
+
+// the compiled program maps data values like the editor's tables
+static void testProgramDomainMapping()
+{
+  TFEditor editor;
+  vec2f ramp[] = { {0.f, 0.f}, {0.5f, 0.2f}, {1.f, 1.f} };
+  editor.addFunction(std::make_shared<PiecewiseLinear>(ramp, 3));
+  editor.addFunction(std::make_shared<Tent>(vec2f(0.3f, 0.8f), 0.05f, 0.2f));
+
+  uint64_t counts[8] = { 100, 5, 0, 30, 7, 1000, 3, 3 };
+  DomainMapping::SP mappings[] = {
+    nullptr,
+    std::make_shared<LogMapping>(box1f(1.f, 1e6f)),
+    std::make_shared<SymLogMapping>(box1f(-100.f, 1e4f)),
+    std::make_shared<HistogramEqualizedMapping>(counts, 8),
+  };
+  for (auto &m : mappings) {
+    CHECK(editor.setDomainMapping(m));
+    std::vector<float> alpha = editor.getAlpha(101);
+    TFProgram prog = editor.compile();
+    float maxDiff = 0.f;
+    for (unsigned i=0; i<101; ++i) {
+      maxDiff = fmaxf(maxDiff, fabsf(prog.eval(i/100.f)-alpha[i]));
+    }
+    CHECK(maxDiff < 1e-3f);
+  }
+
+  // log axes need positive data
+  auto bad = std::make_shared<LogMapping>(box1f(-2.f, -1.f));
+  CHECK(!bad->valid());
+  CHECK(!editor.setDomainMapping(bad));
+  CHECK(editor.getDomainMapping() == mappings[3]);
+  CHECK(bad->unmap(0.5f) == 0.5f && bad->map(0.5f) == 0.5f);
+}
+
+// after the stack was reordered, const evaluation from several
+// threads at once sees a consistent support index (and doesn't
+// rebuild it; run under ThreadSanitizer to check)
+// the index is updated in place on raises, removals and edits; picks
+// and evaluation must agree with an index built from scratch and with
+// a linear search over all control points
+static void testIncrementalIndex()
+{
+  TFEditor editor;
+  editor.setPickRadius(vec2f(0.01f, 0.02f));
+  unsigned seed = 1;
+  auto rnd = [&seed]() { seed = seed*1664525u + 1013904223u; return (seed >> 8)/float(1 << 24); };
+  for (int i=0; i<300; ++i)
+    editor.addFunction(std::make_shared<Tent>(vec2f(rnd(), rnd()), 0.02f*rnd(), 0.05f+0.3f*rnd()));
+
+  bool picksAgree = true, evalAgrees = true;
+  for (int step=0; step<400; ++step) {
+    const auto &funcs = editor.getFunctions();
+    Function::SP f = funcs[size_t(rnd()*funcs.size()) % funcs.size()];
+    float r = rnd();
+    if (r < 0.4f)
+      editor.moveToTop(f);
+    else if (r < 0.5f && funcs.size() > 50)
+      editor.removeFunction(f);
+    else if (r < 0.8f)
+      editor.moveControlPoint(f, size_t(rnd()*3) % 3, vec2f(rnd(), rnd()));
+    else
+      editor.addFunction(std::make_shared<Tent>(vec2f(rnd(), rnd()), 0.f, 0.2f*rnd()));
+
+    vec2f p(rnd(), rnd());
+    int cp = -1, expectedCp = -1;
+    Function::SP expected;
+    for (auto it = funcs.rbegin(); it != funcs.rend() && !expected; ++it) {
+      for (size_t j=0; j<(*it)->numControlPoints(); ++j) {
+        vec2f d = ((*it)->getControlPoint(j)-p) / vec2f(0.01f, 0.02f);
+        if (dot(d,d) <= 1.f) { expected = *it; expectedCp = int(j); break; }
+      }
+    }
+    if (!expected)
+      expected = editor.select(p);
+    picksAgree = picksAgree && editor.pickFunction(p, &cp) == expected && cp == expectedCp;
+
+    if (step % 50 == 0) {
+      TFEditor rebuilt;
+      std::vector<uint8_t> state = editor.serialize();
+      rebuilt.deserialize(state.data(), state.size());
+      for (int i=0; i<=200; ++i)
+        evalAgrees = evalAgrees && editor.eval(i/200.f) == rebuilt.eval(i/200.f);
+    }
+  }
+  CHECK(picksAgree);
+  CHECK(evalAgrees);
+}
+
+static void testConcurrentEvalAfterReorder()
+{
+  TFEditor editor;
+  std::vector<Function::SP> funcs;
+  for (int i=0; i<32; ++i) {
+    funcs.push_back(std::make_shared<Tent>(vec2f(i/31.f, 1.f-i/64.f), 0.f, 0.1f));
+    editor.addFunction(funcs.back());
+  }
+  editor.moveToTop(funcs[3]);
+  editor.removeFunction(funcs[7]);
+  editor.removeFunction(funcs[20]);
+
+  std::vector<float> expected(1001);
+  for (size_t i=0; i<expected.size(); ++i) {
+    float x = i/1000.f, y = 0.f;
+    for (auto &f : editor.getFunctions()) y = fmaxf(y, f->weight*f->eval(x));
+    expected[i] = y;
+  }
+
+  editor.moveToTop(funcs[10]);
+  std::vector<std::vector<float>> results(4, std::vector<float>(expected.size()));
+  std::vector<std::thread> threads;
+  for (auto &r : results) {
+    threads.emplace_back([&editor, &r]() {
+      for (size_t i=0; i<r.size(); ++i) r[i] = editor.eval(i/1000.f);
+    });
+  }
+  for (auto &t : threads) t.join();
+  for (auto &r : results) CHECK(r == expected);
+}
+
+static bool near(vec4f a, vec4f b, float eps = 1e-5f)
+{
+  return near(a.x, b.x, eps) && near(a.y, b.y, eps) && near(a.z, b.z, eps) && near(a.w, b.w, eps);
+}
+
+// outside of [0:1], averages extend the TF by its edge values, like
+// sample() does
+static void testPrefilteredBoundaries()
+{
+  TFEditor editor;
+  vec2f opaque[] = { {0.f, 1.f}, {1.f, 1.f} };
+  editor.addFunction(std::make_shared<PiecewiseLinear>(opaque, 2));
+  PrefilteredTF pre(256);
+  pre.update(editor);
+  CHECK(near(pre.average(-1.f, 1.f).w, 1.f));
+  CHECK(near(pre.average(0.5f, 3.f).w, 1.f));
+  CHECK(near(pre.average(-2.f, -1.f).w, 1.f));
+
+  TFEditor ramp;
+  vec2f cps[] = { {0.f, 0.f}, {1.f, 1.f} };
+  ramp.addFunction(std::make_shared<PiecewiseLinear>(cps, 2));
+  pre = PrefilteredTF(256);
+  pre.update(ramp);
+  // 1 below 0 at alpha 0, then the ramp over [0:1] averaging 1/2
+  CHECK(near(pre.average(-1.f, 1.f).w, 0.25f, 1e-4f));
+  // the ramp, then 1 above 1 at alpha 1
+  CHECK(near(pre.average(0.f, 2.f).w, 0.75f, 1e-4f));
+  CHECK(near(pre.average(1.5f, 2.f), pre.sample(1.f)));
+  CHECK(near(pre.average(-0.5f, -0.25f), pre.sample(0.f)));
+}
+
+// handles survive reordering and removal of other functions, and go
+// stale with their own function
+static void testFunctionHandles()
+{
+  TFEditor editor;
+  auto a = std::make_shared<Tent>(), b = std::make_shared<Tent>(), c = std::make_shared<Tent>();
+  FunctionHandle ha = editor.addFunction(a);
+  FunctionHandle hb = editor.addFunction(b);
+  FunctionHandle hc = editor.addFunction(c);
+
+  editor.moveToTop(ha);
+  CHECK(editor.getFunctions().back() == a);
+  editor.removeFunction(hb);
+  CHECK(editor.getFunction(hb) == nullptr);
+  CHECK(editor.getFunction(ha) == a && editor.getFunction(hc) == c);
+  CHECK(editor.getHandle(c) == hc);
+
+  editor.moveToTop(hc);
+  CHECK(editor.getFunctions().size() == 2 && editor.getFunctions().back() == c);
+  editor.moveControlPoint(ha, 0, vec2f(0.25f, 0.5f));
+  CHECK(near(a->getControlPoint(0).x, 0.25f));
+
+  // a stale handle doesn't refer to a function added later
+  FunctionHandle hd = editor.addFunction(std::make_shared<Tent>());
+  CHECK(hd != hb && editor.getFunction(hb) == nullptr);
+  editor.removeFunction(hb);
+  CHECK(editor.getFunctions().size() == 3);
+
+  // removing from the bottom shifts the positions of all others
+  editor.removeFunction(editor.getHandle(editor.getFunctions().front()));
+  CHECK(editor.getFunction(hd) == editor.getFunctions().back());
+  CHECK(editor.getHandle(editor.getFunction(hd)) == hd);
+}
+
+// a replayed trace ends in the same state as the recorded session,
+// including the setters and free-hand drawing
+static void testTraceSetters()
+{
+  TFEditor editor;
+  editor.addFunction(std::make_shared<Tent>());
+  InteractionTrace trace;
+  editor.startRecording(trace);
+
+  auto fh = std::make_shared<FreeHand>();
+  editor.addFunction(fh);
+  editor.setDrawTarget(fh);
+  editor.pointerDown(vec2f(0.1f, 0.5f));
+  editor.pointerMove(vec2f(0.4f, 0.7f));
+  editor.applyPointerInput();
+  editor.pointerUp();
+  editor.applyPointerInput();
+  editor.updateTexture(64, 32);
+  editor.setDrawTarget(nullptr);
+
+  editor.setWeight(fh, 0.5f);
+  editor.setCombineOp(CombineOp::Over);
+  vec3f cols[] = { {1.f, 0.f, 0.f}, {0.f, 0.f, 1.f} };
+  float positions[] = { 0.f, 1.f };
+  editor.setColorMap(std::make_shared<ColorMap>(positions, cols, 2));
+  editor.setColor(fh, std::make_shared<ColorMap>(vec3f(0.f, 1.f, 0.f)));
+  editor.setDomainMapping(std::make_shared<LogMapping>(box1f(1.f, 1000.f)));
+  editor.updateTexture(64, 32);
+  editor.stopRecording();
+
+  std::vector<uint8_t> bytes = trace.serialize();
+  InteractionTrace loaded;
+  CHECK(loaded.deserialize(bytes.data(), bytes.size()));
+
+  TFEditor replayed;
+  TraceReplayer replayer;
+  TraceReplayer::Result result;
+  CHECK(replayer.replay(loaded, replayed, result));
+  CHECK(result.numFrames == 2);
+  CHECK(replayed.serialize() == editor.serialize());
+}
+
+// clicking a control point leaves it where it is; dragging moves it
+// by the pointer's offset
+static void testClickWithoutDrag()
+{
+  TFEditor editor;
+  editor.setPickRadius(vec2f(0.05f));
+  vec2f cps[] = { {0.f, 0.2f}, {0.5f, 0.6f}, {1.f, 0.2f} };
+  auto func = std::make_shared<PiecewiseLinear>(cps, 3);
+  editor.addFunction(func);
+
+  editor.pointerDown(vec2f(0.52f, 0.63f));
+  editor.pointerUp();
+  editor.applyPointerInput();
+  CHECK(func->getControlPoint(1).x == 0.5f && func->getControlPoint(1).y == 0.6f);
+
+  editor.pointerDown(vec2f(0.52f, 0.63f));
+  editor.applyPointerInput();
+  CHECK(func->getControlPoint(1).x == 0.5f && func->getControlPoint(1).y == 0.6f);
+  editor.pointerMove(vec2f(0.42f, 0.73f));
+  editor.applyPointerInput();
+  CHECK(near(func->getControlPoint(1).x, 0.4f) && near(func->getControlPoint(1).y, 0.7f));
+  editor.pointerUp();
+  editor.applyPointerInput();
+}
+
+// replays pick with the recorded pick radius, which differs from the
+// default, so they hit the same control points
+static void testTracePickRadius()
+{
+  TFEditor editor;
+  vec2f lowCps[] = { {0.f, 0.2f}, {1.f, 0.2f} };
+  vec2f highCps[] = { {0.f, 0.6f}, {0.5f, 0.6f}, {1.f, 0.6f} };
+  editor.addFunction(std::make_shared<PiecewiseLinear>(lowCps, 2));
+  editor.addFunction(std::make_shared<PiecewiseLinear>(highCps, 3));
+  editor.setPickRadius(vec2f(0.1f));
+  InteractionTrace trace;
+  editor.startRecording(trace);
+
+  // only a radius this large hits the low function's first point
+  editor.setPickRadius(vec2f(0.2f));
+  editor.pointerDown(vec2f(0.15f, 0.3f));
+  editor.pointerMove(vec2f(0.15f, 0.05f));
+  editor.applyPointerInput();
+  editor.pointerUp();
+  editor.applyPointerInput();
+  editor.updateTexture(64, 32);
+  editor.stopRecording();
+  CHECK(editor.getFunctions().back()->numControlPoints() == 2);
+
+  std::vector<uint8_t> bytes = trace.serialize();
+  InteractionTrace loaded;
+  CHECK(loaded.deserialize(bytes.data(), bytes.size()));
+  TFEditor replayed;
+  TraceReplayer replayer;
+  TraceReplayer::Result result;
+  CHECK(replayer.replay(loaded, replayed, result));
+  CHECK(replayed.serialize() == editor.serialize());
+  CHECK(replayed.getPickRadius().x == 0.2f);
+}
+
+// every opcode runs over whole batches, matching a scalar reference,
+// also when several threads evaluate the same formula at once
+static void testFormulaOps()
+{
+  Formula f("clamp(-x/(x+1) + 0.3*pow(x,1.5) + exp(-x)*mix(sin(x),cos(x),0.25)"
+            " + abs(x-0.5) + sqrt(x)*step(0.3,x) - log(x+1) + smoothstep(0.2,0.8,x), 0, 1)");
+  CHECK(f.valid());
+
+  const size_t n = 1000;
+  std::vector<float> xs(n), ys(n);
+  for (size_t i=0; i<n; ++i) xs[i] = i/float(n-1);
+  f.evalBatch(xs.data(), ys.data(), n);
+
+  bool same = true;
+  for (size_t i=0; i<n; ++i) {
+    float x = xs[i];
+    float t = clamp((x-0.2f)/(0.8f-0.2f), 0.f, 1.f);
+    float sm = sinf(x), cm = cosf(x);
+    float ref = -x/(x+1.f) + 0.3f*powf(x, 1.5f) + expf(-x)*(sm + 0.25f*(cm-sm))
+        + fabsf(x-0.5f) + sqrtf(x)*(x < 0.3f ? 0.f : 1.f) - logf(x+1.f) + t*t*(3.f-2.f*t);
+    same = same && near(ys[i], clamp(ref, 0.f, 1.f), 1e-5f);
+  }
+  CHECK(same);
+
+  std::vector<std::vector<float>> results(4, std::vector<float>(n));
+  std::vector<std::thread> threads;
+  for (auto &r : results)
+    threads.emplace_back([&]() {
+      for (int k=0; k<50; ++k) f.evalBatch(xs.data(), r.data(), n);
+    });
+  for (auto &t : threads) t.join();
+  for (auto &r : results) CHECK(r == ys);
+}
+
+// color maps blend their stops in linear light, and baked LUTs and
+// prefiltered averages follow suit
+static void testLinearColorInterpolation()
+{
+  ColorMap cm;
+  float mid = linearToSRGB(0.5f);
+  CHECK(near(cm.eval(0.5f).x, mid));
+  CHECK(near(cm.evalLinear(0.5f).x, 0.5f));
+  CHECK(cm.eval(0.f).x == 0.f && cm.eval(1.f).x == 1.f);
+
+  TFEditor editor;
+  vec2f opaque[] = { {0.f, 1.f}, {1.f, 1.f} };
+  editor.addFunction(std::make_shared<PiecewiseLinear>(opaque, 2));
+  editor.setColorMap(std::make_shared<ColorMap>());
+  std::vector<vec4f> lut = editor.getRGBA(3);
+  CHECK(near(lut[1].x, mid));
+
+  // black and white in equal parts average to half the light
+  PrefilteredTF pre(1025);
+  pre.update(editor);
+  CHECK(near(pre.average(0.f, 1.f).x, 0.5f, 1e-3f));
+  CHECK(near(pre.sample(0.5f).x, 0.5f, 1e-3f));
+}
+
+// large inputs with many bins: exact counts, and weights that don't
+// depend on the number of threads
+static void testHistogramPartitions()
+{
+  const size_t n = size_t(1) << 22;
+  const unsigned numBins = 1 << 16;
+  std::vector<float> values(n), weights(n);
+  for (size_t i=0; i<n; ++i) {
+    values[i] = float(i % numBins)/numBins;
+    weights[i] = 1.f/float(1 + i % 7);
+  }
+
+  Histogram hist(numBins);
+  hist.add(values.data(), n);
+  bool exact = true;
+  for (uint64_t c : hist.getCounts()) exact = exact && c == n/numBins;
+  CHECK(exact);
+
+  unsigned threads = parallel::getNumThreads();
+  parallel::setNumThreads(1);
+  WeightedHistogram serial(numBins);
+  serial.add(values.data(), weights.data(), n);
+  parallel::setNumThreads(8);
+  WeightedHistogram threaded(numBins);
+  threaded.add(values.data(), weights.data(), n);
+  parallel::setNumThreads(threads);
+  CHECK(serial.getWeights() == threaded.getWeights());
+}
+
+// picking for deletion leaves an in-progress drag alone
+static void testPickWithoutPointerState()
+{
+  TFEditor editor;
+  editor.setPickRadius(vec2f(0.02f));
+  vec2f lowCps[] = { {0.f, 0.2f}, {1.f, 0.2f} };
+  vec2f highCps[] = { {0.f, 0.6f}, {0.5f, 0.6f}, {1.f, 0.6f} };
+  auto low = std::make_shared<PiecewiseLinear>(lowCps, 2);
+  auto high = std::make_shared<PiecewiseLinear>(highCps, 3);
+  editor.addFunction(low);
+  editor.addFunction(high);
+
+  editor.pointerDown(vec2f(0.5f, 0.6f));
+  editor.applyPointerInput();
+  CHECK(editor.getSelected() == high && editor.getActiveControlPoint() == 1);
+
+  int cp = -1;
+  CHECK(editor.pickFunction(vec2f(0.f, 0.2f), &cp) == low && cp == 0);
+  CHECK(editor.pickFunction(vec2f(0.3f, 0.1f), &cp) == high && cp == -1);
+  editor.removeFunction(low);
+
+  editor.pointerMove(vec2f(0.5f, 0.8f));
+  editor.applyPointerInput();
+  CHECK(editor.getSelected() == high && editor.getActiveControlPoint() == 1);
+  CHECK(near(high->getControlPoint(1).y, 0.8f));
+}
+
+// the gradient of a linear ramp is constant in the interior, and it
+// doesn't matter how the slices are split into slabs
+static void testGradientRamp()
+{
+  vec3i dims(9, 7, 13);
+  vec3f slope(0.5f, -1.f, 2.f), spacing(1.f, 2.f, 0.5f);
+  std::vector<float> volume(size_t(dims.x)*dims.y*dims.z);
+  for (int z=0; z<dims.z; ++z)
+    for (int y=0; y<dims.y; ++y)
+      for (int x=0; x<dims.x; ++x)
+        volume[x+dims.x*(y+size_t(dims.y)*z)]
+            = slope.x*x*spacing.x + slope.y*y*spacing.y + slope.z*z*spacing.z;
+  float expected = sqrtf(dot(slope, slope));
+
+  for (GradientOperator op : {GradientOperator::CentralDifferences, GradientOperator::Sobel}) {
+    std::vector<float> reference(volume.size());
+    computeGradientMagnitude(dims, volume.data(), reference.data(), op, spacing, unsigned(dims.z));
+
+    bool interior = true;
+    for (int z=1; z+1<dims.z; ++z)
+      for (int y=1; y+1<dims.y; ++y)
+        for (int x=1; x+1<dims.x; ++x)
+          interior = interior && near(reference[x+dims.x*(y+size_t(dims.y)*z)], expected, 1e-4f);
+    CHECK(interior);
+
+    // 13 slices in slabs of 1, 3, 5 and 16
+    for (unsigned slab : {1u, 3u, 5u, 16u}) {
+      std::vector<float> grad(volume.size(), -1.f);
+      computeGradientMagnitude(dims, volume.data(), grad.data(), op, spacing, slab);
+      CHECK(grad == reference);
+    }
+  }
+
+  Histogram2D joint(vec2ui(16, 16), box1f(-20.f, 40.f), box1f(0.f, 4.f));
+  size_t sliceSize = size_t(dims.x)*dims.y;
+  computeJointHistogram(dims, [&](unsigned first, unsigned num, float *dst) {
+    std::copy(volume.data()+first*sliceSize, volume.data()+(first+num)*sliceSize, dst);
+  }, joint, GradientOperator::CentralDifferences, spacing, 4);
+  uint64_t total = 0;
+  for (uint64_t c : joint.getCounts()) total += c;
+  CHECK(total == volume.size());
+}
+
+// polls cond for up to five seconds
+template <typename Cond>
+static bool eventually(const Cond &cond)
+{
+  for (int i=0; i<5000 && !cond(); ++i)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  return cond();
+}
+
+// get() answers while a build is running, and the least recently used
+// histogram outside the prefetch window is evicted first
+static void testHistogramCache()
+{
+  std::atomic<bool> started(false), release(false);
+  {
+    HistogramCache cache(10, [&](unsigned t) {
+      started = true;
+      while (!release) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      return std::make_shared<Histogram>(4u + t);
+    }, 3, 0, 1);
+    cache.setTimestep(5);
+    CHECK(eventually([&]() { return bool(started); }));
+    CHECK(cache.get(5) == nullptr && !cache.isCached(5));
+    CHECK(cache.getCurrent() == nullptr);
+    release = true;
+    CHECK(eventually([&]() { return cache.get(5) != nullptr; }));
+  }
+
+  HistogramCache cache(10, [](unsigned t) { return std::make_shared<Histogram>(4u + t); }, 3, 0, 1);
+  for (unsigned t=0; t<3; ++t) {
+    cache.setTimestep(t);
+    CHECK(eventually([&]() { return cache.isCached(t); }));
+  }
+  // 0 becomes the most recently used one, so 1 is evicted for 3
+  CHECK(cache.get(0) != nullptr);
+  cache.setTimestep(3);
+  CHECK(eventually([&]() { return cache.isCached(3); }));
+  CHECK(cache.size() == 3);
+  CHECK(cache.isCached(0) && !cache.isCached(1) && cache.isCached(2));
+  CHECK(cache.getCurrent()->getCounts().size() == 7);
+}
+
+// all three detectors find both materials of a two-peak histogram
+static void testSuggestTwoPeaks()
+{
+  unsigned seed = 7;
+  auto rnd = [&seed]() { seed = seed*1664525u + 1013904223u; return ((seed >> 8)+0.5f)/float(1 << 24); };
+  std::vector<float> values;
+  for (int i=0; i<100000; ++i) {
+    float g = sqrtf(-2.f*logf(rnd()))*cosf(6.2831853f*rnd());
+    values.push_back(i%2 ? 0.3f + 0.03f*g : 0.7f + 0.03f*g);
+  }
+  Histogram hist(256);
+  hist.add(values.data(), values.size());
+
+  TFSuggester suggester;
+  suggester.setHistogram(hist);
+  SuggestOptions opts;
+  opts.maxFeatures = 2;
+  for (auto method : {SuggestOptions::Peaks, SuggestOptions::Otsu, SuggestOptions::KMeans}) {
+    opts.method = method;
+    opts.sensitivity = method == SuggestOptions::Peaks ? 0.5f : 0.f;
+    Suggestion sug = suggester.suggest(opts);
+    CHECK(sug.features.size() == 2 && sug.functions.size() == 2);
+    if (sug.features.size() != 2)
+      continue;
+    CHECK(near(sug.features[0].center, 0.3f, 0.01f));
+    CHECK(near(sug.features[1].center, 0.7f, 0.01f));
+    // Peaks and k-means look at the counts on a log scale, which
+    // widens the features
+    CHECK(sug.features[0].sigma > 0.015f && sug.features[0].sigma < 0.1f);
+    CHECK(sug.features[1].sigma > 0.015f && sug.features[1].sigma < 0.1f);
+  }
+}
+
+// batch and scalar spline evaluation pick the same segment at knots,
+// so they agree bitwise everywhere
+static void testSplineKnots()
+{
+  vec2f cps[] = { {0.f, 0.1f}, {0.13f, 0.7f}, {0.37f, 0.33f}, {0.61f, 0.9f}, {0.8f, 0.2f}, {1.f, 0.6f} };
+  Function::SP splines[] = {
+    std::make_shared<MonotoneCubic>(cps, 6),
+    std::make_shared<CatmullRom>(cps, 6),
+  };
+  std::vector<float> xs;
+  for (const vec2f &cp : cps) xs.push_back(cp.x);
+  for (int i=0; i<=100; ++i) xs.push_back(i/100.f);
+  std::sort(xs.begin(), xs.end());
+  for (auto &s : splines) {
+    std::vector<float> ys(xs.size());
+    s->evalBatch(xs.data(), ys.data(), xs.size());
+    bool same = true;
+    for (size_t i=0; i<xs.size(); ++i) same = same && ys[i] == s->eval(xs[i]);
+    CHECK(same);
+  }
+}
+
+// Oklab blends decode through the sRGB tables and match the powf
+// conversion to within half an 8-bit step
+static void testMorphOklab()
+{
+  vec2f opaque[] = { {0.f, 1.f}, {1.f, 1.f} };
+  TFEditor from, to;
+  from.addFunction(std::make_shared<PiecewiseLinear>(opaque, 2));
+  from.setColorMap(std::make_shared<ColorMap>());
+  to.addFunction(std::make_shared<PiecewiseLinear>(opaque, 2));
+  to.setColorMap(std::make_shared<ColorMap>(vec3f(1.f, 0.5f, 0.1f)));
+
+  TFMorph morph(64, BlendSpace::Oklab);
+  morph.update(from, to);
+  std::vector<vec4f> a = from.getRGBA(64), b = to.getRGBA(64);
+  for (float t : {0.f, 0.3f, 1.f}) {
+    std::vector<vec4f> rgba = morph.blend(t);
+    bool close = true;
+    for (size_t i=0; i<rgba.size(); ++i) {
+      vec3f la = linearToOklab(vec3f(srgbToLinear(a[i].x), srgbToLinear(a[i].y), srgbToLinear(a[i].z)));
+      vec3f lb = linearToOklab(vec3f(srgbToLinear(b[i].x), srgbToLinear(b[i].y), srgbToLinear(b[i].z)));
+      vec3f c = oklabToLinear(la + t*(lb-la));
+      close = close && near(rgba[i].x, linearToSRGB(c.x), 0.6f/255.f)
+          && near(rgba[i].y, linearToSRGB(c.y), 0.6f/255.f)
+          && near(rgba[i].z, linearToSRGB(c.z), 0.6f/255.f)
+          && near(rgba[i].w, 1.f);
+    }
+    CHECK(close);
+  }
+}
+
+int main()
+{
+  testClampSupport();
+  testAnimationPose();
+  testFreeHandMalformed();
+  testPresetLibraryNames();
+  testProgramDomainMapping();
+  testIncrementalIndex();
+  testConcurrentEvalAfterReorder();
+  testPrefilteredBoundaries();
+  testFunctionHandles();
+  testTraceSetters();
+  testTracePickRadius();
+  testFormulaOps();
+  testLinearColorInterpolation();
+  testHistogramPartitions();
+  testPickWithoutPointerState();
+  testClickWithoutDrag();
+  testGradientRamp();
+  testHistogramCache();
+  testSuggestTwoPeaks();
+  testSplineKnots();
+  testMorphOklab();
+
+  if (failures) {
+    std::fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  std::printf("all tests passed\n");
+  return 0;
+}
@@ -17,11 +17,22 @@
     in imgui to compile with your projects; this option automatically
     enables the option TFE_ENABLE_OPENGL
 
+  TFE_DISABLE_SIMD (default: undefined)
+    if defined, the batch evaluators use scalar code even when SSE2
+    is available
+
   TFE_INCLUDE_GLAD_HEADER (default: undefined)
     instruct TFE to include the glad header which will bring in OpenGL
     functions; the headers ship with this project and are found in the
     folders glad and KHR; the file glad.c must be compiled along with
     the project
+
+  Parallel code paths use std::thread (see parallel.h), so link with
+  the platform's threads library. Their results don't depend on the
+  number of threads, as long as floating point contraction is
+  disabled (-ffp-contract=off); the CMake target tfe sets this flag,
+  together with the include path and the threads library, for the
+  targets that link against it
  */
 
 #ifdef TFE_ENABLE_IMGUI
@@ -33,11 +44,25 @@
 // std
 #include <cmath>
 #include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <cfloat>
+#include <climits>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <string>
+#include <type_traits>
 #include <vector>
 //ours
 #include "math.h"
+#include "parallel.h"
+#include "program.h"
+#include "simd.h"
+#include "slotmap.h"
 
 // GLAD
 #ifdef TFE_INCLUDE_GLAD_HEADER
@@ -57,7 +82,7 @@ namespace tfe {
   // color conversion functions:
   inline uint32_t cvt_uint32(const float &f)
   {
-    return static_cast<uint32_t>(255.f * clamp(f, 0.f, 1.f));
+    return static_cast<uint32_t>(255.f * clamp(f, 0.f, 1.f) + 0.5f);
   }
   
   inline uint32_t cvt_uint32(const vec4f &v)
@@ -79,298 +104,5116 @@ namespace tfe {
                  cvt_float32((u >> 24) & 0xff));
   }
 
+  // bulk versions of the above, for whole LUTs and images; the
+  // results are the same as converting one value at a time
+
+  inline void cvt_uint32(const vec4f *in, uint32_t *out, size_t n)
+  {
+    static_assert(sizeof(vec4f) == 4*sizeof(float), "vec4f must be tightly packed");
+    simd::packUnorm8(&in->x, (uint8_t *)out, 4*n);
+  }
+
+  inline void cvt_rgba32f(const uint32_t *in, vec4f *out, size_t n)
+  {
+    simd::unpackUnorm8((const uint8_t *)in, &out->x, 4*n);
+  }
+
+  /*! single channel, e.g., alpha tables */
+  inline void cvt_uint8(const float *in, uint8_t *out, size_t n)
+  {
+    simd::packUnorm8(in, out, n);
+  }
+
+  // Color space conversions; colors in the editor (color maps, baked
+  // TFs, textures) are sRGB encoded, alpha is linear
+
+  inline float srgbToLinear(float c)
+  {
+    return c <= 0.04045f ? c/12.92f : powf((c+0.055f)/1.055f, 2.4f);
+  }
+
+  inline float linearToSRGB(float c)
+  {
+    c = clamp(c, 0.f, 1.f);
+    return c <= 0.0031308f ? c*12.92f : 1.055f*powf(c, 1.f/2.4f)-0.055f;
+  }
+
+  namespace detail {
+
+    /*! tables for converting between 8-bit sRGB and linear floats
+      without calling powf() per pixel. Encoding looks up the byte at
+      the start of a 12-bit bin of the linear value, and then rounds
+      up if the value reaches the next byte's threshold; the bins are
+      narrower than the distance between thresholds, so this gives
+      the same bytes as rounding linearToSRGB() */
+    struct SRGBTables
+    {
+      enum { EncodeBits = 12, EncodeSize = 1<<EncodeBits };
+
+      float decode[256];
+      // smallest linear value that encodes to byte b; [256] is a sentinel
+      float threshold[257];
+      uint8_t encode[EncodeSize];
+
+      SRGBTables()
+      {
+        for (unsigned b=0; b<256; ++b) {
+          decode[b] = srgbToLinear(b/255.f);
+          threshold[b] = b == 0 ? 0.f : srgbToLinear((b-0.5f)/255.f);
+        }
+        threshold[256] = FLT_MAX;
+
+        unsigned b = 0;
+        for (unsigned i=0; i<EncodeSize; ++i) {
+          float c = i/float(EncodeSize-1);
+          while (c >= threshold[b+1]) ++b;
+          encode[i] = uint8_t(b);
+        }
+      }
+    };
+
+    inline const SRGBTables &srgbTables()
+    {
+      static const SRGBTables tables;
+      return tables;
+    }
+
+  } // detail
+
+  /*! 8-bit sRGB to linear */
+  inline float srgb8ToLinear(uint32_t c)
+  {
+    return detail::srgbTables().decode[c & 0xff];
+  }
+
+  /*! linear to 8-bit sRGB, rounded to nearest */
+  inline uint32_t linearToSRGB8(float c)
+  {
+    const detail::SRGBTables &t = detail::srgbTables();
+    // also maps NaNs to 0
+    c = c > 0.f ? fminf(c, 1.f) : 0.f;
+    uint32_t b = t.encode[unsigned(c*(detail::SRGBTables::EncodeSize-1))];
+    return c >= t.threshold[b+1] ? b+1 : b;
+  }
+
+  /*! RGBA8 pixel (sRGB encoded color) to linear color, premultiplied
+    with alpha; this is the space to composite in */
+  inline vec4f cvt_rgba32f_linear(uint32_t u)
+  {
+    float a = cvt_float32(u >> 24);
+    return vec4f(srgb8ToLinear(u)*a, srgb8ToLinear(u >> 8)*a, srgb8ToLinear(u >> 16)*a, a);
+  }
+
+  /*! inverse of cvt_rgba32f_linear() */
+  inline uint32_t cvt_uint32_linear(const vec4f &premultiplied)
+  {
+    float a = premultiplied.w;
+    float inv = a > 0.f ? 1.f/a : 0.f;
+    return linearToSRGB8(premultiplied.x*inv) | (linearToSRGB8(premultiplied.y*inv) << 8)
+        | (linearToSRGB8(premultiplied.z*inv) << 16) | (cvt_uint32(a) << 24);
+  }
+
   inline vec4f over(const vec4f &A, const vec4f &B)
   {
     return A + (1.f-A.w)*B;
   }
 
   /*! texture class used by the functions, and by the TFEditor
-    that over-composites the textures of all functions */
+    that over-composites the textures of all functions. Rasterizers
+    write rows bottom to top (row 0 is y=0), which is the order
+    glTexImage2D() expects, so textures can be uploaded as is;
+    consumers that expect rows top to bottom (like image files) call
+    setOrigin(TopLeft) once instead of flipping every access */
   struct Texture
   {
+    enum Origin { BottomLeft, TopLeft };
+
     Texture() : width(0), height(0) {}
     Texture(unsigned w, unsigned h) : width(w), height(h), data(w*size_t(h),0u) {}
     unsigned width, height;
     std::vector<uint32_t> data;
+    // row order of data
+    Origin origin{BottomLeft};
 
     size_t linearIndex(unsigned x, unsigned y) const
     { return x+size_t(width)*y; }
 
-    unsigned flip(unsigned y) const
-    { return height-y-1; }
-
+    /*! pixels are addressed by row as stored, i.e., y points up as
+      long as the origin is BottomLeft */
     void set(unsigned x, unsigned y, uint32_t val)
-    { data[linearIndex(x,flip(y))] = val; }
+    { data[linearIndex(x,y)] = val; }
 
     uint32_t get(unsigned x, unsigned y) const
-    { return data[linearIndex(x,flip(y))]; }
+    { return data[linearIndex(x,y)]; }
+
+    uint32_t *row(unsigned y)
+    { return data.data()+size_t(width)*y; }
+
+    const uint32_t *row(unsigned y) const
+    { return data.data()+size_t(width)*y; }
+
+    /*! reorder the rows (in a single pass of row swaps) if the
+      texture's origin is not o */
+    void setOrigin(Origin o)
+    {
+      if (o == origin)
+        return;
+      for (unsigned y=0; y<height/2; ++y) {
+        std::swap_ranges(row(y), row(y)+width, row(height-y-1));
+      }
+      origin = o;
+    }
   };
 
-  /*! Layer, can be drawn on top of each other */
-  struct Layer
+  /*! compiled TF, see program.h; the bytes can be copied to wherever
+    the TF is needed and evaluated with program::eval() */
+  struct TFProgram
   {
-    typedef std::shared_ptr<Layer> SP;
-    virtual Texture rasterize(unsigned width, unsigned height) const = 0;
+    std::vector<uint8_t> bytes;
+
+    const program::ProgramHeader *header() const
+    { return (const program::ProgramHeader *)bytes.data(); }
+
+    size_t sizeInBytes() const
+    { return bytes.size(); }
+
+    float eval(float x) const
+    { return program::eval(header(), x); }
   };
-  
-  /*! 1D alpha function ayer, defined over a valueRange in X, and can be
-    evaluated at position x; alpha is in [0:1] */
-  struct Function : public Layer
+
+  /*! collects the primitive records of the functions, see
+    Function::compile() */
+  class ProgramBuilder
   {
-    typedef std::shared_ptr<Function> SP;
-    box1f valueRange{0.f, 1.f};
+   public:
+    void addLinear(box1f valueRange, float weight, const vec2f *points, size_t n)
+    {
+      addRecord(program::Linear, valueRange, weight, n);
+      for (size_t i=0; i<n; ++i) {
+        data.push_back(points[i].x);
+        data.push_back(points[i].y);
+      }
+    }
 
-    virtual ~Function() {}
+    void addCubic(box1f valueRange, float weight, const float *knots, size_t n,
+                  const float *c0, const float *c1, const float *c2, const float *c3)
+    {
+      addRecord(program::Cubic, valueRange, weight, n);
+      data.insert(data.end(), knots, knots+n);
+      for (size_t k=0; k+1<n; ++k) {
+        data.push_back(c0[k]);
+        data.push_back(c1[k]);
+        data.push_back(c2[k]);
+        data.push_back(c3[k]);
+      }
+    }
 
-    virtual float eval(float x) const = 0;
+    void addTable(box1f valueRange, float weight, const float *samples, size_t n)
+    {
+      addRecord(program::Table, valueRange, weight, n);
+      data.insert(data.end(), samples, samples+n);
+    }
 
-    Texture rasterize(unsigned width, unsigned height) const
+    /*! the domain mapping, see DomainMapping::compile() */
+    void setDomain(program::DomainType type, const float *params, size_t numParams)
     {
-      Texture tex(width, height);
-      for (unsigned x=0; x<width; ++x) {
-        float yf = eval(x/float(width-1));
-        unsigned yval = yf * height;
-        for (unsigned y=0; y<yval; ++y) {
-          tex.set(x, y, cvt_uint32(vec4f(0.6f, 0.6f, 0.6f, 0.95f)));
+      domainType = type;
+      std::fill(domainParams, domainParams+5, 0.f);
+      std::copy(params, params+std::min(numParams, size_t(5)), domainParams);
+    }
+
+    void setDomainTable(const float *samples, size_t n)
+    {
+      domainType = program::DomainTable;
+      domainCount = uint32_t(n);
+      domainOffset = uint32_t(data.size());
+      data.insert(data.end(), samples, samples+n);
+    }
+
+    TFProgram finalize(CombineOp op) const
+    {
+      program::ProgramHeader header = {};
+      header.magic = program::Magic;
+      header.version = program::Version;
+      header.combineOp = uint32_t(op);
+      header.numPrimitives = uint32_t(records.size());
+      header.domainType = domainType;
+      header.domainCount = domainCount;
+      header.domainOffset = domainOffset;
+      std::copy(domainParams, domainParams+5, header.domainParams);
+
+      size_t recordBytes = records.size()*sizeof(program::PrimitiveRecord);
+      size_t dataBytes = data.size()*sizeof(float);
+      header.sizeInBytes = uint32_t(sizeof(header)+recordBytes+dataBytes);
+
+      TFProgram prog;
+      prog.bytes.resize(header.sizeInBytes);
+      uint8_t *dst = prog.bytes.data();
+      memcpy(dst, &header, sizeof(header));
+      if (recordBytes > 0)
+        memcpy(dst+sizeof(header), records.data(), recordBytes);
+      if (dataBytes > 0)
+        memcpy(dst+sizeof(header)+recordBytes, data.data(), dataBytes);
+      return prog;
+    }
+
+   private:
+    void addRecord(program::PrimitiveType type, box1f valueRange, float weight, size_t count)
+    {
+      program::PrimitiveRecord rec = {};
+      rec.type = type;
+      rec.count = uint32_t(count);
+      rec.offset = uint32_t(data.size());
+      rec.weight = weight;
+      rec.lower = valueRange.lower;
+      rec.upper = valueRange.upper;
+      records.push_back(rec);
+    }
+
+    std::vector<program::PrimitiveRecord> records;
+    std::vector<float> data;
+    uint32_t domainType{program::DomainLinear};
+    uint32_t domainCount{0}, domainOffset{0};
+    float domainParams[5]{};
+  };
+
+  /*! tags of the serialized function types, see Function::serialize() */
+  enum class FunctionType : uint32_t
+  {
+    Sampled = 0, // any function, stored as samples; loads as PiecewiseLinear
+    PiecewiseLinear = 1,
+    Tent = 2,
+    FreeHand = 3,
+    MonotoneCubic = 4,
+    CatmullRom = 5,
+    Formula = 6,
+    Box = 7,
+    Gaussian = 8,
+  };
+
+  /*! tag of serialized functions that carry a color, or'ed into their
+    FunctionType */
+  enum : uint32_t { FunctionTypeHasColor = 0x80000000u };
+
+  /*! appends plain values to a byte buffer; the encoding is the host's
+    (little endian on all supported platforms) */
+  class StateWriter
+  {
+   public:
+    template <typename T>
+    void write(const T &value)
+    {
+      const uint8_t *p = (const uint8_t *)&value;
+      bytes.insert(bytes.end(), p, p+sizeof(T));
+    }
+
+    /*! count, followed by the elements */
+    template <typename T>
+    void writeArray(const T *values, size_t n)
+    {
+      write(uint32_t(n));
+      const uint8_t *p = (const uint8_t *)values;
+      bytes.insert(bytes.end(), p, p+n*sizeof(T));
+    }
+
+    void writeString(const std::string &str)
+    {
+      writeArray(str.data(), str.size());
+    }
+
+    std::vector<uint8_t> bytes;
+  };
+
+  /*! reads what StateWriter wrote; reads past the end (e.g., from a
+    truncated file) fail and make good() return false, and all
+    subsequent reads fail too */
+  class StateReader
+  {
+   public:
+    StateReader(const uint8_t *data, size_t size) : ptr(data), end(data+size)
+    {}
+
+    template <typename T>
+    bool read(T &value)
+    {
+      if (!ok || size_t(end-ptr) < sizeof(T))
+        return ok = false;
+      memcpy(&value, ptr, sizeof(T));
+      ptr += sizeof(T);
+      return true;
+    }
+
+    template <typename T>
+    bool readArray(std::vector<T> &values)
+    {
+      uint32_t n = 0;
+      if (!read(n) || size_t(end-ptr)/sizeof(T) < n)
+        return ok = false;
+      values.resize(n);
+      if (n > 0)
+        memcpy(values.data(), ptr, n*sizeof(T));
+      ptr += n*sizeof(T);
+      return true;
+    }
+
+    bool readString(std::string &str)
+    {
+      std::vector<char> chars;
+      if (!readArray(chars))
+        return false;
+      str.assign(chars.begin(), chars.end());
+      return true;
+    }
+
+    bool good() const
+    {
+      return ok;
+    }
+
+   private:
+    const uint8_t *ptr, *end;
+    bool ok{true};
+  };
+
+  /*! RGB color map, interpolated between color stops; assigns colors
+    to the alpha functions' domain when baking RGBA TFs. The stops are
+    sRGB encoded, but interpolated in linear light, so that blends
+    between them don't come out too dark */
+  class ColorMap
+  {
+   public:
+    typedef std::shared_ptr<ColorMap> SP;
+
+    ColorMap() : positions{0.f, 1.f}, colors{vec3f(0.f), vec3f(1.f)}
+    { decodeStops(); }
+
+    /*! constant color */
+    explicit ColorMap(vec3f color) : positions{0.f}, colors{color}
+    { decodeStops(); }
+
+    ColorMap(const float *pos, const vec3f *cols, unsigned numStops)
+    {
+      std::vector<unsigned> order(numStops);
+      for (unsigned i=0; i<numStops; ++i) order[i] = i;
+      std::sort(order.begin(), order.end(),
+        [pos](unsigned a, unsigned b) { return pos[a]<pos[b]; });
+
+      for (unsigned i : order) {
+        positions.push_back(pos[i]);
+        colors.push_back(cols[i]);
+      }
+      decodeStops();
+    }
+
+    /*! sRGB encoded color at x */
+    vec3f eval(float x) const
+    {
+      if (positions.empty())
+        return vec3f(1.f);
+
+      auto it = std::upper_bound(positions.begin(), positions.end(), x);
+      if (it == positions.begin())
+        return colors.front();
+      else if (it == positions.end())
+        return colors.back();
+
+      vec3f c = evalLinear(x);
+      return vec3f(linearToSRGB(c.x), linearToSRGB(c.y), linearToSRGB(c.z));
+    }
+
+    /*! linear color at x, e.g., for compositing */
+    vec3f evalLinear(float x) const
+    {
+      if (positions.empty())
+        return vec3f(1.f);
+
+      auto it = std::upper_bound(positions.begin(), positions.end(), x);
+      if (it == positions.begin())
+        return linear.front();
+      else if (it == positions.end())
+        return linear.back();
+
+      size_t i = it-positions.begin()-1;
+      float t = (x-positions[i])/(positions[i+1]-positions[i]);
+      return linear[i] + vec3f(t)*(linear[i+1]-linear[i]);
+    }
+
+    size_t numStops() const
+    { return positions.size(); }
+
+    float getPosition(size_t i) const
+    { return positions[i]; }
+
+    vec3f getColor(size_t i) const
+    { return colors[i]; }
+
+    /*! append the stops to out */
+    void serialize(StateWriter &out) const
+    {
+      out.writeArray(positions.data(), positions.size());
+      out.writeArray(colors.data(), colors.size());
+    }
+
+    /*! read what serialize() wrote; nullptr if malformed */
+    static SP deserialize(StateReader &in)
+    {
+      std::vector<float> pos;
+      std::vector<vec3f> cols;
+      if (!in.readArray(pos) || !in.readArray(cols) || pos.size() != cols.size())
+        return nullptr;
+      return std::make_shared<ColorMap>(pos.data(), cols.data(), unsigned(pos.size()));
+    }
+
+   private:
+    void decodeStops()
+    {
+      linear.resize(colors.size());
+      for (size_t i=0; i<colors.size(); ++i) {
+        vec3f c = colors[i];
+        linear[i] = vec3f(srgbToLinear(c.x), srgbToLinear(c.y), srgbToLinear(c.z));
+      }
+    }
+
+    std::vector<float> positions;
+    // sRGB encoded, and decoded to linear
+    std::vector<vec3f> colors, linear;
+  };
+
+  namespace detail {
+
+    /*! log2 of the mantissa, at 256 equidistant mantissas in [1:2],
+      for fastLog2() */
+    struct Log2Table
+    {
+      enum { Bits = 8, Size = 1<<Bits };
+
+      float log2[Size+1];
+
+      Log2Table()
+      {
+        for (unsigned i=0; i<=Size; ++i) {
+          log2[i] = float(::log2(1.0+i/double(Size)));
         }
       }
-      return tex;
+    };
+
+    inline const Log2Table &log2Table()
+    {
+      static const Log2Table table;
+      return table;
+    }
+
+    /*! log2(x) for normal x > 0: the exponent is taken from the bits,
+      the log of the mantissa is looked up (and linearly interpolated)
+      by its leading bits, which is off by less than 3e-6 */
+    inline float fastLog2(float x)
+    {
+      const Log2Table &t = log2Table();
+      uint32_t bits;
+      memcpy(&bits, &x, sizeof(bits));
+      int e = int((bits >> 23) & 0xff)-127;
+      uint32_t i = (bits >> (23-Log2Table::Bits)) & (Log2Table::Size-1);
+      float f = (bits & ((1u << (23-Log2Table::Bits))-1))*(1.f/(1u << (23-Log2Table::Bits)));
+      return float(e) + t.log2[i] + f*(t.log2[i+1]-t.log2[i]);
     }
+
+    /*! clamp to [0:1]; unlike clamp(), this compiles to min/max
+      instructions rather than calls */
+    inline float saturate(float x)
+    {
+      return x < 0.f ? 0.f : (x > 1.f ? 1.f : x);
+    }
+
+  } // detail
+
+  /*! tags of the serialized domain mappings, see TFEditor::serialize() */
+  enum class DomainMappingType : uint32_t
+  {
+    Linear = 0, // no mapping
+    Log = 1,
+    SymLog = 2,
+    HistogramEqualized = 3,
   };
 
-  class PiecewiseLinear : public Function
+  /*! maps normalized data values t (in [0:1], linear over the data
+    range) to positions x in [0:1] along the editor's x axis, e.g., so
+    that data that spans orders of magnitude gets a log axis. map() is
+    computed directly (with fast approximations where it involves
+    logs); unmap() looks up a precomputed table of the inverse */
+  class DomainMapping
   {
    public:
-    PiecewiseLinear() : controlPoints(2)
+    typedef std::shared_ptr<DomainMapping> SP;
+
+    virtual ~DomainMapping() {}
+
+    /*! editor position of the normalized data value t; monotonically
+      increasing, with map(0)=0 and map(1)=1 */
+    virtual float map(float t) const = 0;
+
+    /*! map() for n values */
+    virtual void mapBatch(const float *ts, float *xs, size_t n) const
     {
-      controlPoints[0] = 0.f;
-      controlPoints[1] = 1.f;
-      std::sort(controlPoints.begin(), controlPoints.end(),
-        [](vec2f a, vec2f b) { return a.x<b.x; });
+      for (size_t i=0; i<n; ++i) {
+        xs[i] = map(ts[i]);
+      }
+    }
+
+    /*! normalized data value at the editor position x */
+    float unmap(float x) const
+    {
+      float xf = detail::saturate(x)*(InverseTableSize-1);
+      unsigned i = std::min(unsigned(xf), unsigned(InverseTableSize-2));
+      float f = xf-i;
+      return inverse[i] + f*(inverse[i+1]-inverse[i]);
+    }
+
+    /*! append the type and the parameters to out, see
+      deserializeDomainMapping() */
+    virtual void serialize(StateWriter &out) const = 0;
+
+    /*! describe the mapping in the program, so that program::eval()
+      takes data values like the editor's tables do */
+    virtual void compile(ProgramBuilder &builder) const = 0;
+
+    /*! false if the mapping was constructed from invalid parameters;
+      TFEditor::setDomainMapping() rejects such mappings */
+    virtual bool valid() const
+    { return true; }
+
+   protected:
+    enum : unsigned { InverseTableSize = 4097 };
+
+    /*! fill the inverse table with the (exact) inverse function
+      invert(x), at equidistant x */
+    template <typename Invert>
+    void tabulateInverse(const Invert &invert)
+    {
+      inverse.resize(InverseTableSize);
+      for (unsigned i=0; i<InverseTableSize; ++i) {
+        inverse[i] = clamp(invert(i/float(InverseTableSize-1)), 0.f, 1.f);
+      }
+      inverse.front() = 0.f;
+      inverse.back() = 1.f;
+    }
+
+    std::vector<float> inverse;
+  };
+
+  /*! logarithmic axis over the data range; values at or below
+    dataRange.lower map to 0. The data range must be positive; if
+    dataRange.lower isn't, the axis spans six decades below
+    dataRange.upper. If dataRange.upper isn't positive (or not
+    finite) either, valid() returns false and the axis is linear */
+  class LogMapping : public DomainMapping
+  {
+   public:
+    LogMapping(box1f dataRange)
+      : dataRange(dataRange.lower > 0.f ? dataRange.lower : dataRange.upper*1e-6f,
+                  dataRange.upper)
+    {
+      if (!isValid(this->dataRange)) {
+        log2Lower = scale = 0.f;
+        tabulateInverse([](float x) { return x; });
+        return;
+      }
+      log2Lower = log2f(this->dataRange.lower);
+      float span = log2f(this->dataRange.upper)-log2Lower;
+      scale = span > 0.f ? 1.f/span : 0.f;
+      box1f r = this->dataRange;
+      tabulateInverse([=](float x) {
+        return (exp2f(log2Lower+x*span)-r.lower)/(r.upper-r.lower);
+      });
+    }
+
+    float map(float t) const
+    {
+      if (scale == 0.f)
+        return detail::saturate(t);
+      float v = dataRange.lower + detail::saturate(t)*(dataRange.upper-dataRange.lower);
+      return detail::saturate((detail::fastLog2(v)-log2Lower)*scale);
+    }
+
+    bool valid() const
+    { return isValid(dataRange); }
+
+    void compile(ProgramBuilder &builder) const
+    {
+      if (scale == 0.f)
+        return;
+      float params[] = { dataRange.lower, dataRange.upper-dataRange.lower, log2Lower, scale };
+      builder.setDomain(program::DomainLog, params, 4);
+    }
+
+    void mapBatch(const float *ts, float *xs, size_t n) const
+    {
+      for (size_t i=0; i<n; ++i) {
+        xs[i] = LogMapping::map(ts[i]);
+      }
+    }
+
+    box1f getDataRange() const
+    { return dataRange; }
+
+    void serialize(StateWriter &out) const
+    {
+      out.write(uint32_t(DomainMappingType::Log));
+      out.write(dataRange);
+    }
+
+    static DomainMapping::SP deserialize(StateReader &in)
+    {
+      box1f range;
+      if (!in.read(range) || !(range.upper > range.lower) || !isValid(range))
+        return nullptr;
+      return std::make_shared<LogMapping>(range);
+    }
+
+   private:
+    static bool isValid(box1f range)
+    {
+      return range.lower > 0.f && range.upper > range.lower && range.upper < FLT_MAX;
+    }
+
+    box1f dataRange;
+    float log2Lower, scale;
+  };
+
+  /*! symmetric log axis, for data with both signs: sign(v)*log(1+|v|/c)
+    is linear along the axis, so the axis is linear for |v| below the
+    linear width c and logarithmic above it. The default linear width
+    is 1e-3 of the largest magnitude in the data range */
+  class SymLogMapping : public DomainMapping
+  {
+   public:
+    SymLogMapping(box1f dataRange, float linearWidth = 0.f)
+      : dataRange(dataRange), linearWidth(linearWidth)
+    {
+      if (!(this->linearWidth > 0.f))
+        this->linearWidth = 1e-3f*fmaxf(fabsf(dataRange.lower), fabsf(dataRange.upper));
+      if (!(this->linearWidth > 0.f))
+        this->linearWidth = 1.f;
+
+      float c = this->linearWidth;
+      invLinearWidth = 1.f/c;
+      auto exact = [c](float v) { return copysignf(log2f(1.f+fabsf(v)/c), v); };
+      lower = exact(dataRange.lower);
+      float span = exact(dataRange.upper)-lower;
+      scale = span > 0.f ? 1.f/span : 0.f;
+      float l = lower;
+      tabulateInverse([=](float x) {
+        float s = l+x*span;
+        float v = copysignf(c*(exp2f(fabsf(s))-1.f), s);
+        return (v-dataRange.lower)/(dataRange.upper-dataRange.lower);
+      });
+    }
+
+    float map(float t) const
+    {
+      float v = dataRange.lower + detail::saturate(t)*(dataRange.upper-dataRange.lower);
+      float s = copysignf(detail::fastLog2(1.f+fabsf(v)*invLinearWidth), v);
+      return detail::saturate((s-lower)*scale);
+    }
+
+    void mapBatch(const float *ts, float *xs, size_t n) const
+    {
+      for (size_t i=0; i<n; ++i) {
+        xs[i] = SymLogMapping::map(ts[i]);
+      }
+    }
+
+    void compile(ProgramBuilder &builder) const
+    {
+      float params[] = {
+        dataRange.lower, dataRange.upper-dataRange.lower, invLinearWidth, lower, scale
+      };
+      builder.setDomain(program::DomainSymLog, params, 5);
+    }
+
+    box1f getDataRange() const
+    { return dataRange; }
+
+    float getLinearWidth() const
+    { return linearWidth; }
+
+    void serialize(StateWriter &out) const
+    {
+      out.write(uint32_t(DomainMappingType::SymLog));
+      out.write(dataRange);
+      out.write(linearWidth);
+    }
+
+    static DomainMapping::SP deserialize(StateReader &in)
+    {
+      box1f range;
+      float linearWidth;
+      if (!in.read(range) || !in.read(linearWidth) || !(range.upper > range.lower))
+        return nullptr;
+      return std::make_shared<SymLogMapping>(range, linearWidth);
+    }
+
+   private:
+    box1f dataRange;
+    float linearWidth, invLinearWidth;
+    float lower, scale;
+  };
+
+  /*! histogram equalization: the axis follows the cumulative
+    distribution of a histogram over the data range (with the bins in
+    the order of the values, as Histogram::getCounts() returns them),
+    so frequent values get more room. The distribution is blended with
+    a uniform one by uniformWeight, so that value ranges without any
+    data don't collapse to nothing. Weighted histograms (see
+    WeightedHistogram) work the same */
+  class HistogramEqualizedMapping : public DomainMapping
+  {
+   public:
+    HistogramEqualizedMapping(const uint64_t *counts, size_t numBins, float uniformWeight = 0.05f)
+    {
+      build(counts, numBins, uniformWeight);
+    }
+
+    /*! from the bins of a WeightedHistogram */
+    HistogramEqualizedMapping(const double *weights, size_t numBins, float uniformWeight = 0.05f)
+    {
+      build(weights, numBins, uniformWeight);
+    }
+
+    /*! the cumulative distribution is piecewise linear, so this is a
+      lookup */
+    float map(float t) const
+    {
+      float tf = detail::saturate(t)*(cdf.size()-1);
+      size_t i = std::min(size_t(tf), cdf.size()-2);
+      float f = tf-i;
+      return cdf[i] + f*(cdf[i+1]-cdf[i]);
+    }
+
+    void mapBatch(const float *ts, float *xs, size_t n) const
+    {
+      for (size_t i=0; i<n; ++i) {
+        xs[i] = HistogramEqualizedMapping::map(ts[i]);
+      }
+    }
+
+    /*! the cdf is the exact table */
+    void compile(ProgramBuilder &builder) const
+    {
+      builder.setDomainTable(cdf.data(), cdf.size());
+    }
+
+    void serialize(StateWriter &out) const
+    {
+      out.write(uint32_t(DomainMappingType::HistogramEqualized));
+      out.writeArray(cdf.data(), cdf.size());
+    }
+
+    static DomainMapping::SP deserialize(StateReader &in)
+    {
+      std::shared_ptr<HistogramEqualizedMapping> m(new HistogramEqualizedMapping);
+      if (!in.readArray(m->cdf) || m->cdf.size() < 2 || m->cdf.front() != 0.f
+        || !std::is_sorted(m->cdf.begin(), m->cdf.end()) || m->cdf.back() <= 0.f)
+        return nullptr;
+      m->init();
+      return m;
+    }
+
+   private:
+    HistogramEqualizedMapping()
+    {}
+
+    template <typename T>
+    void build(const T *bins, size_t numBins, float uniformWeight)
+    {
+      double total = 0.0;
+      for (size_t i=0; i<numBins; ++i) total += double(bins[i]);
+      double u = total > 0.0 ? clamp(uniformWeight, 0.f, 1.f) : 1.0;
+
+      cdf.resize(std::max(numBins, size_t(1))+1);
+      double sum = 0.0;
+      cdf[0] = 0.f;
+      for (size_t i=0; i+1<cdf.size(); ++i) {
+        double p = total > 0.0 ? bins[i]/total : 0.0;
+        sum += (1.0-u)*p + u/(cdf.size()-1);
+        cdf[i+1] = float(sum);
+      }
+      init();
+    }
+
+    void init()
+    {
+      // normalized, so that map(1) is exactly 1
+      float last = cdf.back();
+      for (float &c : cdf) c /= last;
+      cdf.back() = 1.f;
+
+      // the inverse of the piecewise linear cdf, at equidistant x
+      size_t n = cdf.size()-1;
+      tabulateInverse([&](float x) {
+        size_t i = std::upper_bound(cdf.begin(), cdf.end(), x)-cdf.begin();
+        i = std::min(std::max(i, size_t(1)), n);
+        float d = cdf[i]-cdf[i-1];
+        float f = d > 0.f ? (x-cdf[i-1])/d : 0.f;
+        return (i-1+f)/n;
+      });
+    }
+
+    // cdf[i] is the fraction of the data below bin i
+    std::vector<float> cdf;
+  };
+
+  /*! read a mapping that DomainMapping::serialize() wrote; returns
+    false if the data is malformed or the type unknown, and sets
+    mapping to nullptr for DomainMappingType::Linear */
+  inline bool deserializeDomainMapping(StateReader &in, DomainMapping::SP &mapping)
+  {
+    uint32_t type;
+    if (!in.read(type))
+      return false;
+
+    mapping = nullptr;
+    switch (DomainMappingType(type)) {
+      case DomainMappingType::Linear: return true;
+      case DomainMappingType::Log: mapping = LogMapping::deserialize(in); break;
+      case DomainMappingType::SymLog: mapping = SymLogMapping::deserialize(in); break;
+      case DomainMappingType::HistogramEqualized:
+        mapping = HistogramEqualizedMapping::deserialize(in); break;
+    }
+    return mapping != nullptr;
+  }
+
+  /*! Layer, can be drawn on top of each other */
+  struct Layer
+  {
+    typedef std::shared_ptr<Layer> SP;
+    virtual Texture rasterize(unsigned width, unsigned height) const = 0;
+
+    /*! rasterize with the x axis going through mapping (see
+      DomainMapping); layers that don't show data values ignore it */
+    virtual Texture rasterizeMapped(unsigned width, unsigned height, const DomainMapping &/*mapping*/) const
+    {
+      return rasterize(width, height);
+    }
+  };
+  
+  /*! 1D alpha function ayer, defined over a valueRange in X, and can be
+    evaluated at position x; alpha is in [0:1] */
+  struct Function : public Layer
+  {
+    typedef std::shared_ptr<Function> SP;
+    box1f valueRange{0.f, 1.f};
+    // scales the function's contribution when combining functions
+    float weight{1.f};
+    // color (sRGB) over x, e.g., a constant ColorMap; the function is
+    // drawn in it and contributes it to baked RGBA TFs. Functions
+    // without a color are drawn gray, and take the editor's color map
+    // when baking
+    ColorMap::SP color{nullptr};
+
+    virtual ~Function() {}
+
+    virtual float eval(float x) const = 0;
+
+    /*! bring lazily evaluated state up to date; the editor calls this
+      before evaluating the function from several threads */
+    virtual void prepare() const
+    {}
+
+    /*! evaluate the function at n positions; functions that can
+      evaluate many samples at once faster override this */
+    virtual void evalBatch(const float *xs, float *ys, size_t n) const
+    {
+      for (size_t i=0; i<n; ++i) {
+        ys[i] = eval(xs[i]);
+      }
+    }
+
+    /*! interval in x outside of which the function evaluates to 0;
+      the editor uses this to only re-rasterize columns that changed */
+    virtual box1f support() const
+    { return valueRange; }
+
+    /*! control points the user can drag around in the editor; these
+      are in the same [0:1]^2 space that eval() and select() use */
+    virtual size_t numControlPoints() const
+    { return 0; }
+
+    virtual vec2f getControlPoint(size_t /*i*/) const
+    { return vec2f(0.f); }
+
+    virtual void setControlPoint(size_t /*i*/, vec2f /*cp*/)
+    {}
+
+    /*! set the first n control points at once, e.g., to a pose
+      interpolated between two sets of them. Setting them one at a
+      time would check each one against the old values of the others
+      (e.g., PiecewiseLinear keeps control points between their
+      neighbours); functions with such constraints override this to
+      check them against the new values only */
+    virtual void setControlPoints(const vec2f *cps, size_t n)
+    {
+      for (size_t i=0; i<std::min(n, numControlPoints()); ++i) {
+        setControlPoint(i, cps[i]);
+      }
+    }
+
+    /*! interval in x whose values depend on control point i */
+    virtual box1f controlPointSupport(size_t /*i*/) const
+    { return support(); }
+
+    /*! add the function's primitive record(s) to the program; the
+      default samples the function into a table */
+    virtual void compile(ProgramBuilder &builder) const
+    {
+      enum { NumSamples = 256 };
+      float xs[NumSamples], ys[NumSamples];
+      for (unsigned i=0; i<NumSamples; ++i) {
+        xs[i] = i/float(NumSamples-1);
+      }
+      evalBatch(xs, ys, NumSamples);
+      builder.addTable(valueRange, weight, ys, NumSamples);
+    }
+
+    /*! append the function to out, see deserializeFunction(); the
+      default stores samples, which can be restored, but no longer
+      edited in the same way */
+    virtual void serialize(StateWriter &out) const
+    {
+      enum { NumSamples = 256 };
+      float xs[NumSamples], ys[NumSamples];
+      vec2f cps[NumSamples];
+      for (unsigned i=0; i<NumSamples; ++i) {
+        xs[i] = i/float(NumSamples-1);
+      }
+      prepare();
+      evalBatch(xs, ys, NumSamples);
+      for (unsigned i=0; i<NumSamples; ++i) {
+        cps[i] = vec2f(xs[i], ys[i]);
+      }
+      writeHeader(out, FunctionType::Sampled);
+      out.writeArray(cps, NumSamples);
+    }
+
+    Texture rasterize(unsigned width, unsigned height) const
+    {
+      Texture tex(width, height);
+      for (unsigned x=0; x<width; ++x) {
+        rasterizeColumn(tex, x);
+      }
+      return tex;
+    }
+
+    /*! over-composite the function onto column x of tex, in its
+      color; blends in linear space */
+    void rasterizeColumn(Texture &tex, unsigned x) const
+    {
+      float xf = x/float(tex.width-1);
+      float yf = clamp(eval(xf), 0.f, 1.f);
+      unsigned yval = std::min(unsigned(yf * tex.height), tex.height);
+      if (yval == 0)
+        return;
+
+      // alpha 0.95, premultiplied in linear space; 0.6 gray (sRGB)
+      // without a color
+      static const float gray = srgbToLinear(0.6f)*0.95f;
+      vec4f c(gray, gray, gray, 0.95f);
+      if (color) {
+        vec3f rgb = color->evalLinear(xf);
+        c = vec4f(rgb.x*0.95f, rgb.y*0.95f, rgb.z*0.95f, 0.95f);
+      }
+      uint32_t *pixel = tex.data.data()+x;
+      for (unsigned y=0; y<yval; ++y, pixel+=tex.width) {
+        *pixel = cvt_uint32_linear(over(c,cvt_rgba32f_linear(*pixel)));
+      }
+    }
+
+   protected:
+    // common part of all serialized functions; the type comes first,
+    // so deserializeFunction() knows what to construct. The color
+    // follows, if the type is tagged with HasColor
+    void writeHeader(StateWriter &out, FunctionType type) const
+    {
+      out.write(uint32_t(type) | (color ? uint32_t(FunctionTypeHasColor) : 0u));
+      out.write(valueRange);
+      out.write(weight);
+      if (color)
+        color->serialize(out);
+    }
+  };
+
+  class PiecewiseLinear : public Function
+  {
+   public:
+    PiecewiseLinear() : controlPoints(2)
+    {
+      controlPoints[0] = 0.f;
+      controlPoints[1] = 1.f;
+      std::sort(controlPoints.begin(), controlPoints.end(),
+        [](vec2f a, vec2f b) { return a.x<b.x; });
+    }
+
+    PiecewiseLinear(const vec2f *CPs, unsigned numCPs) : controlPoints(numCPs)
+    {
+      std::copy(CPs, CPs+numCPs, controlPoints.begin());
+      std::sort(controlPoints.begin(), controlPoints.end(),
+        [](vec2f a, vec2f b) { return a.x<b.x; });
+    }
+
+    float eval(float x) const
+    {
+      if (controlPoints.size() < 2 || x < valueRange.lower || x > valueRange.upper)
+        return 0.f;
+
+      size_t k = segment(x);
+      return k < controlPoints.size() ? interpolate(k, x) : 0.f;
+    }
+
+    /*! samples are usually sorted, so the segment of the previous
+      sample is tried first */
+    void evalBatch(const float *xs, float *ys, size_t n) const
+    {
+      size_t k = 0;
+      for (size_t i=0; i<n; ++i) {
+        float x = xs[i];
+        if (controlPoints.size() < 2 || x < valueRange.lower || x > valueRange.upper) {
+          ys[i] = 0.f;
+          continue;
+        }
+        // same segment as segment(x) would return
+        bool same = k+1 < controlPoints.size() && controlPoints[k+1].x >= x
+            && (k == 0 ? controlPoints[0].x <= x : controlPoints[k].x < x);
+        if (!same)
+          k = segment(x);
+        ys[i] = k < controlPoints.size() ? interpolate(k, x) : 0.f;
+      }
+    }
+
+    box1f support() const
+    {
+      if (controlPoints.empty())
+        return box1f(0.f, 0.f);
+
+      return box1f(fmaxf(controlPoints.front().x, valueRange.lower),
+                   fminf(controlPoints.back().x, valueRange.upper));
+    }
+
+    size_t numControlPoints() const
+    { return controlPoints.size(); }
+
+    vec2f getControlPoint(size_t i) const
+    { return controlPoints[i]; }
+
+    /*! moving a control point past one of its neighbours would change
+      the order; we rather clamp it to the interval spanned by them */
+    void setControlPoint(size_t i, vec2f cp)
+    {
+      float lo = i > 0 ? controlPoints[i-1].x : 0.f;
+      float hi = i+1 < controlPoints.size() ? controlPoints[i+1].x : 1.f;
+      controlPoints[i] = vec2f(clamp(cp.x, lo, hi), clamp(cp.y, 0.f, 1.f));
+    }
+
+    void setControlPoints(const vec2f *cps, size_t n)
+    {
+      float lo = 0.f;
+      for (size_t i=0; i<std::min(n, controlPoints.size()); ++i) {
+        lo = clamp(cps[i].x, lo, 1.f);
+        controlPoints[i] = vec2f(lo, clamp(cps[i].y, 0.f, 1.f));
+      }
+    }
+
+    box1f controlPointSupport(size_t i) const
+    {
+      float lo = controlPoints[i > 0 ? i-1 : i].x;
+      float hi = controlPoints[i+1 < controlPoints.size() ? i+1 : i].x;
+      return box1f(lo, hi);
+    }
+
+    void compile(ProgramBuilder &builder) const
+    {
+      builder.addLinear(valueRange, weight, controlPoints.data(), controlPoints.size());
+    }
+
+    void serialize(StateWriter &out) const
+    {
+      writeHeader(out, FunctionType::PiecewiseLinear);
+      out.writeArray(controlPoints.data(), controlPoints.size());
+    }
+
+    static Function::SP deserialize(StateReader &in, box1f valueRange)
+    {
+      std::vector<vec2f> cps;
+      if (!in.readArray(cps))
+        return nullptr;
+      auto f = std::make_shared<PiecewiseLinear>(cps.data(), unsigned(cps.size()));
+      f->valueRange = valueRange;
+      return f;
+    }
+
+   private:
+    // index of the first segment [p_k,p_k+1] with p_k.x <= x <=
+    // p_k+1.x, or numControlPoints() if there is none
+    size_t segment(float x) const
+    {
+      auto it = std::lower_bound(controlPoints.begin()+1, controlPoints.end(), x,
+        [](vec2f p, float x) { return p.x < x; });
+      if (it == controlPoints.end() || (it-1)->x > x)
+        return controlPoints.size();
+      return size_t(it-controlPoints.begin())-1;
+    }
+
+    float interpolate(size_t k, float x) const
+    {
+      vec2f p1 = controlPoints[k];
+      vec2f p2 = controlPoints[k+1];
+      float m = (p2.y-p1.y)/(p2.x-p1.x);
+      float xf = x - p1.x;
+      return p1.y + m * xf;
+    }
+
+    std::vector<vec2f> controlPoints;
+  };
+
+  class Tent : public Function
+  {
+   public:
+    Tent() : tipPos({0.5f,1.f}), topWidth(0.f), bottomWidth(1.f)
+    { initInternal(); }
+
+    Tent(vec2f tip, float tw, float bw) : tipPos(tip), topWidth(tw), bottomWidth(bw)
+    { initInternal(); }
+
+    float eval(float x) const
+    {
+      return internal.eval(x);
+    }
+
+    box1f support() const
+    {
+      return internal.support();
+    }
+
+    /*! CP 0 is the tip, CPs 1 and 2 are handles on the right edge of
+      the top and the bottom of the tent that control the widths */
+    size_t numControlPoints() const
+    { return 3; }
+
+    vec2f getControlPoint(size_t i) const
+    {
+      if (i == 0) return tipPos;
+      else if (i == 1) return vec2f(tipPos.x+topWidth/2.f, tipPos.y);
+      else return vec2f(tipPos.x+bottomWidth/2.f, 0.f);
+    }
+
+    void setControlPoint(size_t i, vec2f cp)
+    {
+      if (i == 0)
+        tipPos = vec2f(clamp(cp.x, 0.f, 1.f), clamp(cp.y, 0.f, 1.f));
+      else if (i == 1)
+        topWidth = fminf(fmaxf(2.f*(cp.x-tipPos.x), 0.f), bottomWidth);
+      else
+        bottomWidth = fmaxf(2.f*(cp.x-tipPos.x), topWidth);
+      initInternal();
+    }
+
+    void setControlPoints(const vec2f *cps, size_t n)
+    {
+      if (n < 3) {
+        Function::setControlPoints(cps, n);
+        return;
+      }
+      tipPos = vec2f(clamp(cps[0].x, 0.f, 1.f), clamp(cps[0].y, 0.f, 1.f));
+      topWidth = fmaxf(2.f*(cps[1].x-tipPos.x), 0.f);
+      bottomWidth = fmaxf(2.f*(cps[2].x-tipPos.x), topWidth);
+      initInternal();
+    }
+
+    void compile(ProgramBuilder &builder) const
+    {
+      PiecewiseLinear pl = internal;
+      pl.weight = weight;
+      pl.compile(builder);
+    }
+
+    void serialize(StateWriter &out) const
+    {
+      writeHeader(out, FunctionType::Tent);
+      out.write(tipPos);
+      out.write(topWidth);
+      out.write(bottomWidth);
+    }
+
+    static Function::SP deserialize(StateReader &in, box1f valueRange)
+    {
+      vec2f tip;
+      float tw, bw;
+      if (!in.read(tip) || !in.read(tw) || !in.read(bw))
+        return nullptr;
+      auto f = std::make_shared<Tent>();
+      f->valueRange = valueRange;
+      f->tipPos = tip;
+      f->topWidth = tw;
+      f->bottomWidth = bw;
+      f->initInternal();
+      return f;
+    }
+
+   private:
+    void initInternal()
+    {
+      std::vector<vec2f> CPs(4);
+      CPs[0]=vec2f(tipPos.x-bottomWidth/2.f,0.f);
+      CPs[1]=vec2f(tipPos.x-topWidth/2.0f,tipPos.y);
+      CPs[2]=vec2f(tipPos.x+topWidth/2.0f,tipPos.y);
+      CPs[3]=vec2f(tipPos.x+bottomWidth/2.f,0.f);
+      internal = PiecewiseLinear(CPs.data(), CPs.size());
+      internal.valueRange = valueRange;
+    }
+
+    vec2f tipPos;
+    float topWidth, bottomWidth;
+    PiecewiseLinear internal;
+  };
+
+  /*! alpha function drawn free-hand; strokes are rasterized into a
+    dense array of samples (typically at the editor's resolution),
+    which is then simplified (Ramer-Douglas-Peucker) into a compact
+    piecewise linear function. Only the part of the simplified curve
+    that the stroke touched is recomputed. */
+  class FreeHand : public Function
+  {
+   public:
+    typedef std::shared_ptr<FreeHand> SP;
+
+    FreeHand(unsigned resolution = 256, float tolerance = 1e-3f)
+      : samples(std::max(resolution, 2u), 0.f), tolerance(tolerance)
+    {
+      controlPoints.push_back(vec2f(0.f, 0.f));
+      controlPoints.push_back(vec2f(1.f, 0.f));
+    }
+
+    float eval(float x) const
+    {
+      if (x < valueRange.lower || x > valueRange.upper)
+        return 0.f;
+
+      return interpolate(controlPoints.begin(), controlPoints.end(), x);
+    }
+
+    box1f support() const
+    {
+      return box1f(fmaxf(nonZero.lower, valueRange.lower),
+                   fminf(nonZero.upper, valueRange.upper));
+    }
+
+    /*! start a new stroke at pos; returns the x-range that changed */
+    box1f beginStroke(vec2f pos)
+    {
+      strokePos = pos;
+      return drawSegment(pos, pos);
+    }
+
+    /*! continue the current stroke to pos; returns the x-range that
+      changed */
+    box1f continueStroke(vec2f pos)
+    {
+      box1f touched = drawSegment(strokePos, pos);
+      strokePos = pos;
+      return touched;
+    }
+
+    void compile(ProgramBuilder &builder) const
+    {
+      builder.addLinear(valueRange, weight, controlPoints.data(), controlPoints.size());
+    }
+
+    /*! number of vertices of the simplified curve */
+    size_t numVertices() const
+    {
+      return controlPoints.size();
+    }
+
+    /*! both the dense samples (so that drawing can continue) and the
+      simplified curve are stored */
+    void serialize(StateWriter &out) const
+    {
+      writeHeader(out, FunctionType::FreeHand);
+      out.write(tolerance);
+      out.writeArray(samples.data(), samples.size());
+      out.writeArray(controlPoints.data(), controlPoints.size());
+    }
+
+    static Function::SP deserialize(StateReader &in, box1f valueRange)
+    {
+      float tolerance;
+      std::vector<float> samples;
+      std::vector<vec2f> cps;
+      if (!in.read(tolerance) || !in.readArray(samples) || !in.readArray(cps)
+        || samples.size() < 2 || samples.size() > UINT_MAX || !std::isfinite(tolerance)
+        || !validCurve(samples, cps))
+        return nullptr;
+      auto f = std::make_shared<FreeHand>(unsigned(samples.size()), tolerance);
+      f->valueRange = valueRange;
+      f->samples = samples;
+      f->controlPoints = cps;
+      f->updateNonZero();
+      return f;
+    }
+
+   private:
+    typedef std::vector<vec2f>::const_iterator Iterator;
+
+    // simplify() relies on the vertices spanning [0:1] with strictly
+    // increasing x, so there always is a vertex left and right of the
+    // touched columns
+    static bool validCurve(const std::vector<float> &samples, const std::vector<vec2f> &cps)
+    {
+      for (float y : samples) {
+        if (!(y >= 0.f && y <= 1.f)) // false for NaN
+          return false;
+      }
+      if (cps.size() < 2 || cps.front().x != 0.f || cps.back().x != 1.f)
+        return false;
+      for (size_t i=0; i<cps.size(); ++i) {
+        if (!(cps[i].y >= 0.f && cps[i].y <= 1.f) || (i > 0 && !(cps[i].x > cps[i-1].x)))
+          return false;
+      }
+      return true;
+    }
+
+    // linearly interpolate the sorted vertices [first,last) at x
+    static float interpolate(Iterator first, Iterator last, float x)
+    {
+      Iterator it = std::upper_bound(first, last, x,
+        [](float x, vec2f p) { return x < p.x; });
+
+      if (it == first)
+        return first->y;
+      else if (it == last)
+        return (last-1)->y;
+
+      vec2f p1 = *(it-1);
+      vec2f p2 = *it;
+      return p1.y + (p2.y-p1.y)/(p2.x-p1.x) * (x-p1.x);
+    }
+
+    unsigned column(float x) const
+    {
+      float scale = samples.size()-1;
+      return unsigned(clamp(roundf(x*scale), 0.f, scale));
+    }
+
+    float columnPos(unsigned i) const
+    {
+      return i/float(samples.size()-1);
+    }
+
+    // rasterize the segment [p1,p2] into the dense samples and
+    // re-simplify the part of the curve that was touched
+    box1f drawSegment(vec2f p1, vec2f p2)
+    {
+      if (p2.x < p1.x)
+        std::swap(p1, p2);
+
+      unsigned c1 = column(p1.x), c2 = column(p2.x);
+      for (unsigned i=c1; i<=c2; ++i) {
+        float t = c1 == c2 ? 1.f : (i-c1)/float(c2-c1);
+        samples[i] = clamp(p1.y + t*(p2.y-p1.y), 0.f, 1.f);
+      }
+
+      return simplify(c1, c2);
+    }
+
+    // replace the vertices inside the columns [c1,c2] with a new
+    // simplification of the samples; the curve is re-fitted between the
+    // closest vertices left and right of the touched columns, so the
+    // result joins up with the untouched parts
+    box1f simplify(unsigned c1, unsigned c2)
+    {
+      auto byX = [](vec2f p, float x) { return p.x < x; };
+      auto first = std::lower_bound(controlPoints.begin(), controlPoints.end(),
+                                    columnPos(c1), byX);
+      auto last = std::upper_bound(controlPoints.begin(), controlPoints.end(),
+                                   columnPos(c2),
+                                   [](float x, vec2f p) { return x < p.x; });
+      unsigned a = c1 == 0 ? 0 : column((first-1)->x);
+      unsigned b = c2 == samples.size()-1 ? c2 : column(last->x);
+      if (c1 == 0) first = controlPoints.begin();
+      else --first;
+      if (last != controlPoints.end()) ++last;
+
+      std::vector<vec2f> fitted;
+      fitted.push_back(vec2f(columnPos(a), samples[a]));
+      fitRDP(a, b, fitted);
+
+      std::vector<vec2f> replaced(first, last);
+      first = controlPoints.erase(first, last);
+      controlPoints.insert(first, fitted.begin(), fitted.end());
+
+      updateNonZero();
+
+      return changedRange(replaced, fitted);
+    }
+
+    // both curves are linear between their merged vertices, so they
+    // can only differ between the first and last such vertex where
+    // they don't agree (plus the adjacent segments)
+    static box1f changedRange(const std::vector<vec2f> &oldCurve,
+                              const std::vector<vec2f> &newCurve)
+    {
+      std::vector<float> xs;
+      for (vec2f p : oldCurve) xs.push_back(p.x);
+      for (vec2f p : newCurve) xs.push_back(p.x);
+      std::sort(xs.begin(), xs.end());
+
+      box1f range(FLT_MAX, -FLT_MAX);
+      for (size_t i=0; i<xs.size(); ++i) {
+        float y1 = interpolate(oldCurve.begin(), oldCurve.end(), xs[i]);
+        float y2 = interpolate(newCurve.begin(), newCurve.end(), xs[i]);
+        if (y1 != y2) {
+          range.extend(xs[i > 0 ? i-1 : i]);
+          range.extend(xs[i+1 < xs.size() ? i+1 : i]);
+        }
+      }
+      return range;
+    }
+
+    // append the RDP simplification of the samples (a,b] to out
+    void fitRDP(unsigned a, unsigned b, std::vector<vec2f> &out) const
+    {
+      std::vector<vec2ui> stack;
+      stack.push_back(vec2ui(a, b));
+
+      while (!stack.empty()) {
+        vec2ui seg = stack.back();
+        stack.pop_back();
+
+        float y1 = samples[seg.x], y2 = samples[seg.y];
+        float maxDist = 0.f;
+        unsigned split = seg.x;
+        for (unsigned i=seg.x+1; i<seg.y; ++i) {
+          float t = (i-seg.x)/float(seg.y-seg.x);
+          float dist = fabsf(samples[i]-(y1+t*(y2-y1)));
+          if (dist > maxDist) {
+            maxDist = dist;
+            split = i;
+          }
+        }
+
+        if (maxDist > tolerance) {
+          // right half is processed last, so push it first
+          stack.push_back(vec2ui(split, seg.y));
+          stack.push_back(vec2ui(seg.x, split));
+        } else {
+          out.push_back(vec2f(columnPos(seg.y), samples[seg.y]));
+        }
+      }
+    }
+
+    void updateNonZero()
+    {
+      nonZero = box1f(0.f, 0.f);
+      size_t lo = controlPoints.size(), hi = 0;
+      for (size_t i=0; i<controlPoints.size(); ++i) {
+        if (controlPoints[i].y > 0.f) {
+          lo = std::min(lo, i);
+          hi = i;
+        }
+      }
+
+      if (lo <= hi) {
+        nonZero.lower = controlPoints[lo > 0 ? lo-1 : lo].x;
+        nonZero.upper = controlPoints[hi+1 < controlPoints.size() ? hi+1 : hi].x;
+      }
+    }
+
+    std::vector<float> samples;
+    std::vector<vec2f> controlPoints;
+    float tolerance;
+    vec2f strokePos{0.f};
+    box1f nonZero{0.f, 0.f};
+  };
+
+  /*! base class for C1 cubic Hermite splines through a set of control
+    points; derived classes decide on the tangents. The polynomial
+    coefficients of each segment are cached, and when a control point
+    moves only the segments whose tangents depend on it are updated */
+  class CubicSpline : public Function
+  {
+   public:
+    float eval(float x) const
+    {
+      if (knots.size() < 2 || x < valueRange.lower || x > valueRange.upper
+        || x < knots.front() || x > knots.back())
+        return 0.f;
+
+      size_t k = segment(x);
+      float t = x-knots[k];
+      float y = ((c3[k]*t + c2[k])*t + c1[k])*t + c0[k];
+      return clamp(y, 0.f, 1.f);
+    }
+
+    /*! gathers the segment coefficients of four samples at a time
+      and evaluates them with Horner's scheme in SIMD */
+    void evalBatch(const float *xs, float *ys, size_t n) const
+    {
+      if (knots.size() < 2) {
+        std::fill(ys, ys+n, 0.f);
+        return;
+      }
+
+      box1f domain(fmaxf(knots.front(), valueRange.lower),
+                   fminf(knots.back(), valueRange.upper));
+
+      size_t k = 0;
+      for (size_t i=0; i<n; i+=4) {
+        alignas(16) float t[4], a[4], b[4], c[4], d[4];
+        size_t lanes = std::min(n-i, size_t(4));
+        for (size_t j=0; j<4; ++j) {
+          float x = j < lanes ? xs[i+j] : domain.lower-1.f;
+          if (x < domain.lower || x > domain.upper) {
+            t[j] = a[j] = b[j] = c[j] = d[j] = 0.f;
+            continue;
+          }
+          // samples are usually sorted, so try the previous segment
+          // first; a knot belongs to the segment that starts there,
+          // as in segment(), so both paths agree bitwise
+          if (x < knots[k] || (x >= knots[k+1] && k+2 < knots.size()))
+            k = segment(x);
+          t[j] = x-knots[k];
+          a[j] = c3[k]; b[j] = c2[k]; c[j] = c1[k]; d[j] = c0[k];
+        }
+
+        simd::float4 tt = simd::load(t);
+        simd::float4 y = simd::load(a);
+        y = y*tt + simd::load(b);
+        y = y*tt + simd::load(c);
+        y = y*tt + simd::load(d);
+        y = simd::clamp(y, 0.f, 1.f);
+
+        alignas(16) float res[4];
+        simd::store(res, y);
+        std::copy(res, res+lanes, ys+i);
+      }
+    }
+
+    box1f support() const
+    {
+      if (knots.empty())
+        return box1f(0.f, 0.f);
+
+      return box1f(fmaxf(knots.front(), valueRange.lower),
+                   fminf(knots.back(), valueRange.upper));
+    }
+
+    size_t numControlPoints() const
+    { return knots.size(); }
+
+    vec2f getControlPoint(size_t i) const
+    { return vec2f(knots[i], values[i]); }
+
+    /*! like with PiecewiseLinear, control points are clamped to the
+      interval spanned by their neighbours */
+    void setControlPoint(size_t i, vec2f cp)
+    {
+      float lo = i > 0 ? knots[i-1] : 0.f;
+      float hi = i+1 < knots.size() ? knots[i+1] : 1.f;
+      knots[i] = clamp(cp.x, lo, hi);
+      values[i] = clamp(cp.y, 0.f, 1.f);
+      // tangents at i-1,i,i+1 change; so do the segments using them
+      updateTangents(i > 0 ? i-1 : 0, std::min(i+2, knots.size()));
+      updateSegments(i > 1 ? i-2 : 0, std::min(i+2, knots.size()-1));
+    }
+
+    void setControlPoints(const vec2f *cps, size_t n)
+    {
+      float lo = 0.f;
+      for (size_t i=0; i<std::min(n, knots.size()); ++i) {
+        knots[i] = lo = clamp(cps[i].x, lo, 1.f);
+        values[i] = clamp(cps[i].y, 0.f, 1.f);
+      }
+      init();
+    }
+
+    box1f controlPointSupport(size_t i) const
+    {
+      return box1f(knots[i > 1 ? i-2 : 0], knots[std::min(i+2, knots.size()-1)]);
+    }
+
+    void compile(ProgramBuilder &builder) const
+    {
+      builder.addCubic(valueRange, weight, knots.data(), knots.size(),
+                       c0.data(), c1.data(), c2.data(), c3.data());
+    }
+
+   protected:
+    void serializeControlPoints(StateWriter &out, FunctionType type) const
+    {
+      std::vector<vec2f> cps(knots.size());
+      for (size_t i=0; i<cps.size(); ++i) cps[i] = vec2f(knots[i], values[i]);
+      writeHeader(out, type);
+      out.writeArray(cps.data(), cps.size());
+    }
+
+    template <typename Spline>
+    static Function::SP deserializeSpline(StateReader &in, box1f valueRange)
+    {
+      std::vector<vec2f> cps;
+      if (!in.readArray(cps))
+        return nullptr;
+      auto f = std::make_shared<Spline>(cps.data(), unsigned(cps.size()));
+      f->valueRange = valueRange;
+      return f;
+    }
+
+    void assignControlPoints(const vec2f *CPs, unsigned numCPs)
+    {
+      std::vector<vec2f> sorted(CPs, CPs+numCPs);
+      std::sort(sorted.begin(), sorted.end(),
+        [](vec2f a, vec2f b) { return a.x<b.x; });
+
+      knots.resize(numCPs);
+      values.resize(numCPs);
+      for (unsigned i=0; i<numCPs; ++i) {
+        knots[i] = sorted[i].x;
+        values[i] = sorted[i].y;
+      }
+      tangents.resize(numCPs);
+      size_t numSegments = numCPs > 0 ? numCPs-1 : 0;
+      c0.resize(numSegments);
+      c1.resize(numSegments);
+      c2.resize(numSegments);
+      c3.resize(numSegments);
+    }
+
+    // initialize tangents and coefficients; must be called by the
+    // derived class's constructor, after assignControlPoints()
+    void init()
+    {
+      updateTangents(0, knots.size());
+      updateSegments(0, c0.size());
+    }
+
+    /*! tangent at control point i; may only depend on the control
+      points i-1, i, and i+1 */
+    virtual float computeTangent(size_t i) const = 0;
+
+    // slope of the secant between control points i and i+1
+    float secant(size_t i) const
+    {
+      float h = knots[i+1]-knots[i];
+      return h > 0.f ? (values[i+1]-values[i])/h : 0.f;
+    }
+
+    std::vector<float> knots, values;
+
+   private:
+    size_t segment(float x) const
+    {
+      auto it = std::upper_bound(knots.begin(), knots.end()-1, x);
+      return std::max(size_t(it-knots.begin()), size_t(1))-1;
+    }
+
+    void updateTangents(size_t first, size_t last)
+    {
+      for (size_t i=first; i<last; ++i)
+        tangents[i] = computeTangent(i);
+    }
+
+    // cubic Hermite segment k in power form, relative to knots[k]
+    void updateSegments(size_t first, size_t last)
+    {
+      for (size_t k=first; k<last; ++k) {
+        float h = knots[k+1]-knots[k];
+        float m0 = tangents[k], m1 = tangents[k+1];
+        float delta = secant(k);
+        c0[k] = values[k];
+        c1[k] = m0;
+        c2[k] = h > 0.f ? (3.f*delta - 2.f*m0 - m1)/h : 0.f;
+        c3[k] = h > 0.f ? (m0 + m1 - 2.f*delta)/(h*h) : 0.f;
+      }
+    }
+
+    std::vector<float> tangents;
+    // per-segment coefficients, y = c3*t^3 + c2*t^2 + c1*t + c0
+    std::vector<float> c0, c1, c2, c3;
+  };
+
+  /*! monotone piecewise cubic Hermite interpolation (PCHIP): the
+    tangents are Brodlie's weighted harmonic mean of the adjacent
+    secants, and zero at local extrema. The curve never overshoots
+    the control points */
+  class MonotoneCubic : public CubicSpline
+  {
+   public:
+    MonotoneCubic(const vec2f *CPs, unsigned numCPs)
+    {
+      assignControlPoints(CPs, numCPs);
+      init();
+    }
+
+    void serialize(StateWriter &out) const
+    {
+      serializeControlPoints(out, FunctionType::MonotoneCubic);
+    }
+
+    static Function::SP deserialize(StateReader &in, box1f valueRange)
+    {
+      return deserializeSpline<MonotoneCubic>(in, valueRange);
+    }
+
+   private:
+    float computeTangent(size_t i) const
+    {
+      size_t n = knots.size();
+      if (n < 2)
+        return 0.f;
+      else if (i == 0)
+        return secant(0);
+      else if (i == n-1)
+        return secant(n-2);
+
+      float d0 = secant(i-1), d1 = secant(i);
+      if (d0*d1 <= 0.f)
+        return 0.f;
+
+      // weighted harmonic mean of the adjacent secants
+      float h0 = knots[i]-knots[i-1], h1 = knots[i+1]-knots[i];
+      return 3.f*(h0+h1) / ((2.f*h1+h0)/d0 + (h1+2.f*h0)/d1);
+    }
+  };
+
+  /*! Catmull-Rom spline (non-uniform knots, finite differences); may
+    overshoot, the result is clamped to [0:1] */
+  class CatmullRom : public CubicSpline
+  {
+   public:
+    CatmullRom(const vec2f *CPs, unsigned numCPs)
+    {
+      assignControlPoints(CPs, numCPs);
+      init();
+    }
+
+    void serialize(StateWriter &out) const
+    {
+      serializeControlPoints(out, FunctionType::CatmullRom);
+    }
+
+    static Function::SP deserialize(StateReader &in, box1f valueRange)
+    {
+      return deserializeSpline<CatmullRom>(in, valueRange);
+    }
+
+   private:
+    float computeTangent(size_t i) const
+    {
+      size_t n = knots.size();
+      if (n < 2)
+        return 0.f;
+      else if (i == 0)
+        return secant(0);
+      else if (i == n-1)
+        return secant(n-2);
+
+      float h = knots[i+1]-knots[i-1];
+      return h > 0.f ? (values[i+1]-values[i-1])/h : 0.f;
+    }
+  };
+
+  /*! node of a function composition graph (DAG). Each node memoizes
+    its values in a table sampled at a fixed resolution over [0:1],
+    which is lazily brought up to date when the node is evaluated.
+    Invalidating a range of a node (e.g., because a leaf function
+    was edited) also invalidates that range in all its ancestors, so
+    only those get re-evaluated, and only over the dirty range.
+    Control points of the leaf functions are forwarded, so composed
+    functions can be edited like any other function.
+    Note that evaluation updates the (mutable) tables, so different
+    threads must only evaluate the same graph concurrently after
+    calling prepare(). */
+  class Expression : public Function
+  {
+   public:
+    typedef std::shared_ptr<Expression> SP;
+
+    Expression(unsigned resolution)
+      : table(std::max(resolution, 2u)), dirtyFirst(0), dirtyLast(table.size())
+    {}
+
+    float eval(float x) const
+    {
+      if (x < valueRange.lower || x > valueRange.upper)
+        return 0.f;
+
+      update();
+      float xf = clamp(x, 0.f, 1.f) * (table.size()-1);
+      unsigned i = std::min(unsigned(xf), unsigned(table.size()-2));
+      float t = xf-i;
+      return table[i] + t*(table[i+1]-table[i]);
+    }
+
+    void evalBatch(const float *xs, float *ys, size_t n) const
+    {
+      update();
+      for (size_t i=0; i<n; ++i) {
+        ys[i] = Expression::eval(xs[i]);
+      }
+    }
+
+    void prepare() const
+    {
+      update();
+    }
+
+    /*! mark the x-range as out of date in this node and its ancestors */
+    void invalidate(box1f range)
+    {
+      if (range.lower > range.upper)
+        return;
+
+      float scale = table.size()-1;
+      unsigned first = unsigned(clamp(floorf(range.lower*scale), 0.f, scale));
+      unsigned last = unsigned(clamp(ceilf(range.upper*scale), 0.f, scale))+1;
+      invalidateSamples(first, last);
+    }
+
+    unsigned resolution() const
+    {
+      return table.size();
+    }
+
+    size_t numControlPoints() const
+    {
+      size_t n = 0;
+      for (auto &c : children) n += c->numControlPoints();
+      return n;
+    }
+
+    vec2f getControlPoint(size_t i) const
+    {
+      for (auto &c : children) {
+        if (i < c->numControlPoints()) return c->getControlPoint(i);
+        i -= c->numControlPoints();
+      }
+      return vec2f(0.f);
+    }
+
+    void setControlPoint(size_t i, vec2f cp)
+    {
+      for (auto &c : children) {
+        if (i < c->numControlPoints()) return c->setControlPoint(i, cp);
+        i -= c->numControlPoints();
+      }
+    }
+
+    void setControlPoints(const vec2f *cps, size_t n)
+    {
+      for (auto &c : children) {
+        size_t m = std::min(n, c->numControlPoints());
+        c->setControlPoints(cps, m);
+        cps += m;
+        n -= m;
+      }
+    }
+
+    box1f controlPointSupport(size_t i) const
+    {
+      for (auto &c : children) {
+        if (i < c->numControlPoints()) return c->controlPointSupport(i);
+        i -= c->numControlPoints();
+      }
+      return support();
+    }
+
+    /*! connect child to this node; used by the functions that build
+      the graph (see namespace compose) */
+    static void connect(const SP &parent, const SP &child)
+    {
+      assert(parent->table.size() == child->table.size());
+      parent->children.push_back(child);
+      child->parents.push_back(parent);
+    }
+
+   protected:
+    /*! compute the samples [first,last) of the node into table;
+      children are guaranteed to be up to date over that range */
+    virtual void compute(unsigned first, unsigned last, float *table) const = 0;
+
+    float samplePos(unsigned i) const
+    {
+      return i/float(table.size()-1);
+    }
+
+    // the table is interpolated linearly, so non-zero values leak up
+    // to one sample spacing beyond the support of what was sampled
+    box1f padded(box1f s) const
+    {
+      float h = 1.f/(table.size()-1);
+      return s.lower > s.upper ? s : box1f(s.lower-h, s.upper+h);
+    }
+
+    const float *childTable(size_t i) const
+    {
+      return children[i]->table.data();
+    }
+
+    std::vector<SP> children;
+
+   private:
+    void invalidateSamples(unsigned first, unsigned last)
+    {
+      // ranges are merged into their bounding range, so stop once the
+      // range is already contained
+      if (dirtyFirst < dirtyLast && dirtyFirst <= first && last <= dirtyLast)
+        return;
+
+      if (dirtyFirst >= dirtyLast) {
+        dirtyFirst = first;
+        dirtyLast = last;
+      } else {
+        dirtyFirst = std::min(dirtyFirst, first);
+        dirtyLast = std::max(dirtyLast, last);
+      }
+
+      for (auto &p : parents) {
+        if (SP parent = p.lock())
+          parent->invalidateSamples(first, last);
+      }
+    }
+
+    void update() const
+    {
+      if (dirtyFirst >= dirtyLast)
+        return;
+
+      for (auto &c : children) c->update();
+      compute(dirtyFirst, dirtyLast, table.data());
+      dirtyFirst = dirtyLast = 0;
+    }
+
+    mutable std::vector<float> table;
+    mutable unsigned dirtyFirst, dirtyLast;
+    std::vector<std::weak_ptr<Expression>> parents;
+  };
+
+  /*! leaf of the composition graph, memoizes an ordinary function */
+  class ExpressionLeaf : public Expression
+  {
+   public:
+    ExpressionLeaf(const Function::SP &func, unsigned resolution)
+      : Expression(resolution), func(func)
+    {}
+
+    box1f support() const
+    {
+      return padded(func->support());
+    }
+
+    size_t numControlPoints() const
+    { return func->numControlPoints(); }
+
+    vec2f getControlPoint(size_t i) const
+    { return func->getControlPoint(i); }
+
+    void setControlPoint(size_t i, vec2f cp)
+    {
+      invalidate(func->controlPointSupport(i));
+      func->setControlPoint(i, cp);
+      invalidate(func->controlPointSupport(i));
+    }
+
+    void setControlPoints(const vec2f *cps, size_t n)
+    {
+      invalidate(func->support());
+      func->setControlPoints(cps, n);
+      invalidate(func->support());
+    }
+
+    box1f controlPointSupport(size_t i) const
+    { return func->controlPointSupport(i); }
+
+   private:
+    void compute(unsigned first, unsigned last, float *table) const
+    {
+      std::vector<float> xs(last-first);
+      for (unsigned i=first; i<last; ++i) {
+        xs[i-first] = samplePos(i);
+      }
+      func->evalBatch(xs.data(), table+first, xs.size());
+    }
+
+    Function::SP func;
+  };
+
+  /*! operators of the inner nodes of the composition graph */
+  enum class ExpressionOp
+  {
+    Add,      // a+b, clamped to [0:1]
+    Subtract, // a-b, clamped to [0:1]
+    Multiply, // a*b
+    Min,      // min(a,b)
+    Max,      // max(a,b)
+    Clamp,    // clamp(a,lo,hi)
+    Remap,    // maps [0:1] to [lo:hi]
+  };
+
+  class ExpressionNode : public Expression
+  {
+   public:
+    ExpressionNode(ExpressionOp op, unsigned resolution, float lo = 0.f, float hi = 1.f)
+      : Expression(resolution), op(op), lo(lo), hi(hi)
+    {}
+
+    box1f support() const
+    {
+      // only remap and clamp can turn zeros into non-zeros
+      if ((op == ExpressionOp::Remap || op == ExpressionOp::Clamp) && lo > 0.f)
+        return box1f(0.f, 1.f);
+
+      box1f res(FLT_MAX, -FLT_MAX);
+      for (auto &c : children) {
+        box1f s = c->support();
+        res.extend(s.lower);
+        res.extend(s.upper);
+      }
+      return padded(res);
+    }
+
+   private:
+    template <typename F>
+    static void binary(const float *a, const float *b, float *out,
+                       unsigned first, unsigned last, F f)
+    {
+      for (unsigned i=first; i<last; ++i) {
+        out[i] = f(a[i], b[i]);
+      }
+    }
+
+    void compute(unsigned first, unsigned last, float *table) const
+    {
+      const float *a = childTable(0);
+      const float *b = children.size() > 1 ? childTable(1) : a;
+      float l = lo, h = hi;
+
+      switch (op) {
+        case ExpressionOp::Add:
+          binary(a, b, table, first, last,
+                 [](float x, float y) { return fminf(x+y, 1.f); });
+          break;
+        case ExpressionOp::Subtract:
+          binary(a, b, table, first, last,
+                 [](float x, float y) { return fmaxf(x-y, 0.f); });
+          break;
+        case ExpressionOp::Multiply:
+          binary(a, b, table, first, last,
+                 [](float x, float y) { return x*y; });
+          break;
+        case ExpressionOp::Min:
+          binary(a, b, table, first, last,
+                 [](float x, float y) { return fminf(x, y); });
+          break;
+        case ExpressionOp::Max:
+          binary(a, b, table, first, last,
+                 [](float x, float y) { return fmaxf(x, y); });
+          break;
+        case ExpressionOp::Clamp:
+          binary(a, a, table, first, last,
+                 [l,h](float x, float) { return fmaxf(l, fminf(x, h)); });
+          break;
+        case ExpressionOp::Remap:
+          binary(a, a, table, first, last,
+                 [l,h](float x, float) { return l + x*(h-l); });
+          break;
+      }
+    }
+
+    ExpressionOp op;
+    float lo, hi;
+  };
+
+  /*! functions to build composition graphs, e.g.:
+      using namespace tfe::compose;
+      auto e = sub(mul(leaf(ramp), leaf(box)), leaf(gauss)); */
+  namespace compose {
+
+    inline Expression::SP leaf(const Function::SP &func, unsigned resolution = 1024)
+    {
+      return std::make_shared<ExpressionLeaf>(func, resolution);
+    }
+
+    inline Expression::SP node(ExpressionOp op, const Expression::SP &a,
+                               const Expression::SP &b, float lo = 0.f, float hi = 1.f)
+    {
+      auto n = std::make_shared<ExpressionNode>(op, a->resolution(), lo, hi);
+      Expression::connect(n, a);
+      if (b) Expression::connect(n, b);
+      return n;
+    }
+
+    inline Expression::SP add(const Expression::SP &a, const Expression::SP &b)
+    { return node(ExpressionOp::Add, a, b); }
+
+    inline Expression::SP sub(const Expression::SP &a, const Expression::SP &b)
+    { return node(ExpressionOp::Subtract, a, b); }
+
+    inline Expression::SP mul(const Expression::SP &a, const Expression::SP &b)
+    { return node(ExpressionOp::Multiply, a, b); }
+
+    inline Expression::SP min(const Expression::SP &a, const Expression::SP &b)
+    { return node(ExpressionOp::Min, a, b); }
+
+    inline Expression::SP max(const Expression::SP &a, const Expression::SP &b)
+    { return node(ExpressionOp::Max, a, b); }
+
+    inline Expression::SP clamp(const Expression::SP &a, float lo, float hi)
+    { return node(ExpressionOp::Clamp, a, nullptr, lo, hi); }
+
+    inline Expression::SP remap(const Expression::SP &a, float lo, float hi)
+    { return node(ExpressionOp::Remap, a, nullptr, lo, hi); }
+
+  } // compose
+
+  /*! alpha function given by a formula in x, e.g.
+    "0.5*smoothstep(0.2,0.4,x)*exp(-x*x)". The formula is parsed once
+    and compiled into a register bytecode; the interpreter executes
+    each instruction over a whole block of samples, so the dispatch
+    cost is amortized over the block. Supported are + - * / ^, unary
+    minus, the constant pi, and the functions exp, log, sqrt, abs, sin,
+    cos, min, max, pow, step, clamp, mix and smoothstep. If the
+    formula can't be parsed, valid() returns false and the function
+    evaluates to 0 */
+  class Formula : public Function
+  {
+   public:
+    Formula(const std::string &source) : source(source)
+    {
+      compile();
+    }
+
+    float eval(float x) const
+    {
+      float y;
+      evalBatch(&x, &y, 1);
+      return y;
+    }
+
+    void evalBatch(const float *xs, float *ys, size_t n) const
+    {
+      if (!valid()) {
+        std::fill(ys, ys+n, 0.f);
+        return;
+      }
+
+      // the formula's own registers, unless another thread is using
+      // them; then a per-thread buffer that is only ever grown
+      bool own = !registersInUse.exchange(true, std::memory_order_acquire);
+      float *regs = registers.data();
+      if (!own) {
+        static thread_local std::vector<float> shared;
+        if (shared.size() < registers.size())
+          shared.resize(registers.size());
+        regs = shared.data();
+      }
+
+      for (size_t first=0; first<n; first+=BlockSize) {
+        unsigned count = unsigned(std::min(n-first, size_t(BlockSize)));
+        execute(xs+first, regs, count);
+        const float *res = regs+result*BlockSize;
+        for (unsigned i=0; i<count; ++i) {
+          float x = xs[first+i];
+          bool inside = x >= valueRange.lower && x <= valueRange.upper;
+          ys[first+i] = inside ? clamp(res[i], 0.f, 1.f) : 0.f;
+        }
+      }
+
+      if (own)
+        registersInUse.store(false, std::memory_order_release);
+    }
+
+    bool valid() const
+    {
+      return error.empty();
+    }
+
+    const std::string &errorMessage() const
+    {
+      return error;
+    }
+
+    const std::string &getSource() const
+    {
+      return source;
+    }
+
+    void serialize(StateWriter &out) const
+    {
+      writeHeader(out, FunctionType::Formula);
+      out.writeString(source);
+    }
+
+    static Function::SP deserialize(StateReader &in, box1f valueRange)
+    {
+      std::string source;
+      if (!in.readString(source))
+        return nullptr;
+      auto f = std::make_shared<Formula>(source);
+      f->valueRange = valueRange;
+      return f;
+    }
+
+   private:
+    enum { BlockSize = 64 };
+
+    enum Opcode : uint8_t
+    {
+      LoadX, LoadConst, Add, Sub, Mul, Div, Neg, Pow, Min, Max, Step,
+      Exp, Log, Sqrt, Abs, Sin, Cos, Clamp, Mix, Smoothstep,
+    };
+
+    struct Instruction
+    {
+      uint8_t op;
+      uint16_t dst, a, b, c;
+    };
+
+    // compile-time value: either a constant (not yet materialized in
+    // a register, so it can be folded) or a register
+    struct Operand
+    {
+      bool isConst;
+      float value;
+      uint16_t reg;
+    };
+
+    static float apply(Opcode op, float a, float b, float c)
+    {
+      switch (op) {
+        case Add: return a+b;
+        case Sub: return a-b;
+        case Mul: return a*b;
+        case Div: return a/b;
+        case Neg: return -a;
+        case Pow: return powf(a, b);
+        case Min: return fminf(a, b);
+        case Max: return fmaxf(a, b);
+        case Step: return b < a ? 0.f : 1.f;
+        case Exp: return expf(a);
+        case Log: return logf(a);
+        case Sqrt: return sqrtf(a);
+        case Abs: return fabsf(a);
+        case Sin: return sinf(a);
+        case Cos: return cosf(a);
+        case Clamp: return fmaxf(b, fminf(a, c));
+        case Mix: return a + c*(b-a);
+        case Smoothstep: {
+          float t = clamp((c-a)/(b-a), 0.f, 1.f);
+          return t*t*(3.f-2.f*t);
+        }
+        default: return 0.f;
+      }
+    }
+
+    // d[i] = f(a[i],b[i],c[i]) for one instruction; the opcode switch
+    // stays outside the loop
+    template <typename F>
+    static void forEachLane(float *d, const float *a, const float *b, const float *c,
+                            unsigned n, const F &f)
+    {
+      for (unsigned i=0; i<n; ++i)
+        d[i] = f(a[i], b[i], c[i]);
+    }
+
+    // count is padded to the SIMD width; the padding lanes compute
+    // garbage that's never read back
+    void execute(const float *xs, float *regs, unsigned count) const
+    {
+      unsigned padded = (count+3) & ~3u;
+      for (const Instruction &inst : code) {
+        float *d = regs+inst.dst*BlockSize;
+        const float *a = regs+inst.a*BlockSize;
+        const float *b = regs+inst.b*BlockSize;
+        const float *c = regs+inst.c*BlockSize;
+        switch (inst.op) {
+          case LoadX:
+            std::copy(xs, xs+count, d);
+            std::fill(d+count, d+padded, 0.f);
+            break;
+          case LoadConst:
+            std::fill(d, d+padded, constants[inst.a]);
+            break;
+          case Add:
+            for (unsigned i=0; i<padded; i+=4)
+              simd::store(d+i, simd::load(a+i) + simd::load(b+i));
+            break;
+          case Sub:
+            for (unsigned i=0; i<padded; i+=4)
+              simd::store(d+i, simd::load(a+i) - simd::load(b+i));
+            break;
+          case Mul:
+            for (unsigned i=0; i<padded; i+=4)
+              simd::store(d+i, simd::load(a+i) * simd::load(b+i));
+            break;
+          case Min:
+            for (unsigned i=0; i<padded; i+=4)
+              simd::store(d+i, simd::min(simd::load(a+i), simd::load(b+i)));
+            break;
+          case Max:
+            for (unsigned i=0; i<padded; i+=4)
+              simd::store(d+i, simd::max(simd::load(a+i), simd::load(b+i)));
+            break;
+          case Div:
+            for (unsigned i=0; i<padded; i+=4)
+              simd::store(d+i, simd::load(a+i) / simd::load(b+i));
+            break;
+          case Neg:
+            for (unsigned i=0; i<padded; i+=4)
+              simd::store(d+i, -simd::load(a+i));
+            break;
+          case Sqrt:
+            for (unsigned i=0; i<padded; i+=4)
+              simd::store(d+i, simd::sqrt(simd::load(a+i)));
+            break;
+          case Mix:
+            for (unsigned i=0; i<padded; i+=4) {
+              simd::float4 va = simd::load(a+i);
+              simd::store(d+i, va + simd::load(c+i)*(simd::load(b+i)-va));
+            }
+            break;
+          // no SIMD versions; still one loop per instruction
+          case Pow:
+            forEachLane(d, a, b, c, padded, [](float x, float y, float) { return powf(x, y); });
+            break;
+          case Step:
+            forEachLane(d, a, b, c, padded, [](float x, float y, float) { return y < x ? 0.f : 1.f; });
+            break;
+          case Exp:
+            forEachLane(d, a, b, c, padded, [](float x, float, float) { return expf(x); });
+            break;
+          case Log:
+            forEachLane(d, a, b, c, padded, [](float x, float, float) { return logf(x); });
+            break;
+          case Abs:
+            forEachLane(d, a, b, c, padded, [](float x, float, float) { return fabsf(x); });
+            break;
+          case Sin:
+            forEachLane(d, a, b, c, padded, [](float x, float, float) { return sinf(x); });
+            break;
+          case Cos:
+            forEachLane(d, a, b, c, padded, [](float x, float, float) { return cosf(x); });
+            break;
+          case Clamp:
+            forEachLane(d, a, b, c, padded, [](float x, float y, float z) {
+              return fmaxf(y, fminf(x, z));
+            });
+            break;
+          case Smoothstep:
+            forEachLane(d, a, b, c, padded, [](float x, float y, float z) {
+              float t = clamp((z-x)/(y-x), 0.f, 1.f);
+              return t*t*(3.f-2.f*t);
+            });
+            break;
+        }
+      }
+    }
+
+    // ------------------------------------------------------------------
+    // recursive descent parser; emits code while parsing:
+    //   expr    := term (('+'|'-') term)*
+    //   term    := unary (('*'|'/') unary)*
+    //   unary   := '-' unary | power
+    //   power   := primary ('^' unary)?
+    //   primary := number | 'x' | 'pi' | ident '(' expr (',' expr)* ')'
+    //            | '(' expr ')'
+    // ------------------------------------------------------------------
+
+    void compile()
+    {
+      pos = 0;
+      Operand res = parseExpr();
+      skipSpace();
+      if (error.empty() && pos != source.size())
+        fail("unexpected character");
+
+      if (!error.empty()) {
+        code.clear();
+        return;
+      }
+
+      result = materialize(res);
+      registers.assign(numRegisters*size_t(BlockSize), 0.f);
+    }
+
+    void fail(const std::string &msg)
+    {
+      if (error.empty())
+        error = msg + " at position " + std::to_string(pos);
+    }
+
+    void skipSpace()
+    {
+      while (pos < source.size() && isspace((unsigned char)source[pos])) ++pos;
+    }
+
+    bool accept(char c)
+    {
+      skipSpace();
+      if (pos < source.size() && source[pos] == c) {
+        ++pos;
+        return true;
+      }
+      return false;
+    }
+
+    uint16_t allocRegister()
+    {
+      if (!freeRegisters.empty()) {
+        uint16_t r = freeRegisters.back();
+        freeRegisters.pop_back();
+        return r;
+      }
+      return numRegisters++;
+    }
+
+    uint16_t materialize(const Operand &o)
+    {
+      if (!o.isConst)
+        return o.reg;
+
+      uint16_t r = allocRegister();
+      constants.push_back(o.value);
+      code.push_back({LoadConst, r, uint16_t(constants.size()-1), 0, 0});
+      return r;
+    }
+
+    static Operand constant(float value)
+    {
+      return {true, value, 0};
+    }
+
+    // emit an instruction with arity operands, or fold it if all of
+    // them are constants; operand registers are released first, so the
+    // result can reuse one of them (instructions work element-wise)
+    Operand emit(Opcode op, unsigned arity, const Operand *args)
+    {
+      bool allConst = true;
+      for (unsigned i=0; i<arity; ++i) allConst &= args[i].isConst;
+
+      if (allConst) {
+        float v[3] = {0.f, 0.f, 0.f};
+        for (unsigned i=0; i<arity; ++i) v[i] = args[i].value;
+        return constant(apply(op, v[0], v[1], v[2]));
+      }
+
+      uint16_t regs[3] = {0, 0, 0};
+      for (unsigned i=0; i<arity; ++i) regs[i] = materialize(args[i]);
+      for (unsigned i=0; i<arity; ++i) freeRegisters.push_back(regs[i]);
+
+      uint16_t dst = allocRegister();
+      code.push_back({op, dst, regs[0], regs[1], regs[2]});
+      return {false, 0.f, dst};
+    }
+
+    Operand emit(Opcode op, Operand a)
+    {
+      return emit(op, 1, &a);
+    }
+
+    Operand emit(Opcode op, Operand a, Operand b)
+    {
+      Operand args[2] = {a, b};
+      return emit(op, 2, args);
+    }
+
+    Operand parseExpr()
+    {
+      Operand lhs = parseTerm();
+      while (error.empty()) {
+        if (accept('+')) lhs = emit(Add, lhs, parseTerm());
+        else if (accept('-')) lhs = emit(Sub, lhs, parseTerm());
+        else break;
+      }
+      return lhs;
+    }
+
+    Operand parseTerm()
+    {
+      Operand lhs = parseUnary();
+      while (error.empty()) {
+        if (accept('*')) lhs = emit(Mul, lhs, parseUnary());
+        else if (accept('/')) lhs = emit(Div, lhs, parseUnary());
+        else break;
+      }
+      return lhs;
+    }
+
+    Operand parseUnary()
+    {
+      if (accept('-'))
+        return emit(Neg, parseUnary());
+      return parsePower();
+    }
+
+    Operand parsePower()
+    {
+      Operand base = parsePrimary();
+      if (error.empty() && accept('^'))
+        return emit(Pow, base, parseUnary());
+      return base;
+    }
+
+    Operand parsePrimary()
+    {
+      skipSpace();
+      if (pos >= source.size()) {
+        fail("unexpected end of formula");
+        return constant(0.f);
+      }
+
+      if (accept('(')) {
+        Operand res = parseExpr();
+        if (!accept(')'))
+          fail("expected ')'");
+        return res;
+      }
+
+      const char *begin = source.c_str()+pos;
+      if (isdigit((unsigned char)*begin) || *begin == '.') {
+        char *end;
+        float value = strtof(begin, &end);
+        pos += end-begin;
+        return constant(value);
+      }
+
+      std::string name;
+      while (pos < source.size() && (isalnum((unsigned char)source[pos]) || source[pos] == '_'))
+        name += source[pos++];
+
+      if (name.empty()) {
+        fail("unexpected character");
+        return constant(0.f);
+      } else if (name == "x") {
+        uint16_t r = allocRegister();
+        code.push_back({LoadX, r, 0, 0, 0});
+        return {false, 0.f, r};
+      } else if (name == "pi") {
+        return constant(3.14159265358979f);
+      }
+
+      struct Builtin { const char *name; Opcode op; unsigned arity; };
+      static const Builtin builtins[] = {
+        {"exp", Exp, 1}, {"log", Log, 1}, {"sqrt", Sqrt, 1}, {"abs", Abs, 1},
+        {"sin", Sin, 1}, {"cos", Cos, 1}, {"min", Min, 2}, {"max", Max, 2},
+        {"pow", Pow, 2}, {"step", Step, 2}, {"clamp", Clamp, 3},
+        {"mix", Mix, 3}, {"smoothstep", Smoothstep, 3},
+      };
+
+      for (const Builtin &b : builtins) {
+        if (name != b.name)
+          continue;
+
+        Operand args[3] = {constant(0.f), constant(0.f), constant(0.f)};
+        if (!accept('('))
+          fail("expected '('");
+        for (unsigned i=0; i<b.arity && error.empty(); ++i) {
+          if (i > 0 && !accept(','))
+            fail("expected ','");
+          args[i] = parseExpr();
+        }
+        if (error.empty() && !accept(')'))
+          fail("expected ')'");
+        return emit(b.op, b.arity, args);
+      }
+
+      fail("unknown identifier '" + name + "'");
+      return constant(0.f);
+    }
+
+    std::string source;
+    std::string error;
+
+    // compiled program
+    std::vector<Instruction> code;
+    std::vector<float> constants;
+    uint16_t numRegisters{0};
+    uint16_t result{0};
+
+    // numRegisters blocks of BlockSize samples; see evalBatch()
+    mutable std::vector<float> registers;
+    mutable std::atomic<bool> registersInUse{false};
+
+    // parser state
+    size_t pos{0};
+    std::vector<uint16_t> freeRegisters;
+  };
+
+  /*! constant height over an interval, e.g., to assign opacity to
+    one label of a segmentation; CP 0 is the top left corner (moves
+    the box and sets its height), CP 1 the top right corner (sets the
+    width) */
+  class Box : public Function
+  {
+   public:
+    Box(box1f range = {0.4f, 0.6f}, float height = 1.f)
+      : range(range), height(clamp(height, 0.f, 1.f))
+    {}
+
+    float eval(float x) const
+    {
+      if (x < range.lower || x > range.upper || x < valueRange.lower || x > valueRange.upper)
+        return 0.f;
+      return height;
+    }
+
+    box1f support() const
+    {
+      return box1f(fmaxf(range.lower, valueRange.lower), fminf(range.upper, valueRange.upper));
+    }
+
+    size_t numControlPoints() const
+    { return 2; }
+
+    vec2f getControlPoint(size_t i) const
+    { return vec2f(i == 0 ? range.lower : range.upper, height); }
+
+    void setControlPoint(size_t i, vec2f cp)
+    {
+      height = clamp(cp.y, 0.f, 1.f);
+      if (i == 0) {
+        float width = range.upper-range.lower;
+        range.lower = clamp(cp.x, 0.f, 1.f-width);
+        range.upper = range.lower+width;
+      } else {
+        range.upper = clamp(cp.x, range.lower, 1.f);
+      }
+    }
+
+    void setControlPoints(const vec2f *cps, size_t n)
+    {
+      if (n < 2) {
+        Function::setControlPoints(cps, n);
+        return;
+      }
+      height = clamp(cps[1].y, 0.f, 1.f);
+      range.lower = clamp(cps[0].x, 0.f, 1.f);
+      range.upper = clamp(cps[1].x, range.lower, 1.f);
+    }
+
+    box1f controlPointSupport(size_t /*i*/) const
+    { return support(); }
+
+    void compile(ProgramBuilder &builder) const
+    {
+      vec2f points[4] = {
+        {range.lower, 0.f}, {range.lower, height}, {range.upper, height}, {range.upper, 0.f}
+      };
+      builder.addLinear(valueRange, weight, points, 4);
+    }
+
+    void serialize(StateWriter &out) const
+    {
+      writeHeader(out, FunctionType::Box);
+      out.write(range);
+      out.write(height);
+    }
+
+    static Function::SP deserialize(StateReader &in, box1f valueRange)
+    {
+      box1f range;
+      float height;
+      if (!in.read(range) || !in.read(height))
+        return nullptr;
+      auto f = std::make_shared<Box>(range, height);
+      f->valueRange = valueRange;
+      return f;
+    }
+
+   private:
+    box1f range;
+    float height;
+  };
+
+  /*! Gaussian bump, e.g., for a material whose values are normally
+    distributed; it is cut off at three standard deviations, so that
+    its support is finite. CP 0 is the peak (moves the bump and sets
+    its height), CP 1 sits one standard deviation right of the peak
+    (sets the width) */
+  class Gaussian : public Function
+  {
+   public:
+    Gaussian(float center = 0.5f, float sigma = 0.1f, float height = 1.f)
+      : center(center), sigma(fmaxf(sigma, minSigma())), height(clamp(height, 0.f, 1.f))
+    {}
+
+    float eval(float x) const
+    {
+      float d = (x-center)/sigma;
+      if (fabsf(d) > 3.f || x < valueRange.lower || x > valueRange.upper)
+        return 0.f;
+      return height*expf(-0.5f*d*d);
+    }
+
+    box1f support() const
+    {
+      return box1f(fmaxf(center-3.f*sigma, valueRange.lower),
+                   fminf(center+3.f*sigma, valueRange.upper));
+    }
+
+    size_t numControlPoints() const
+    { return 2; }
+
+    vec2f getControlPoint(size_t i) const
+    {
+      if (i == 0) return vec2f(center, height);
+      else return vec2f(center+sigma, height*expf(-0.5f));
+    }
+
+    void setControlPoint(size_t i, vec2f cp)
+    {
+      if (i == 0) {
+        center = clamp(cp.x, 0.f, 1.f);
+        height = clamp(cp.y, 0.f, 1.f);
+      } else {
+        sigma = fmaxf(cp.x-center, minSigma());
+      }
+    }
+
+    box1f controlPointSupport(size_t /*i*/) const
+    { return support(); }
+
+    float getCenter() const
+    { return center; }
+
+    float getSigma() const
+    { return sigma; }
+
+    float getHeight() const
+    { return height; }
+
+    /*! piecewise linear, 64 segments over the support */
+    void compile(ProgramBuilder &builder) const
+    {
+      const int numSegments = 64;
+      vec2f points[numSegments+3];
+      points[0] = vec2f(center-3.f*sigma, 0.f);
+      for (int i=0; i<=numSegments; ++i) {
+        float d = -3.f + 6.f*i/numSegments;
+        points[i+1] = vec2f(center+d*sigma, height*expf(-0.5f*d*d));
+      }
+      points[numSegments+2] = vec2f(center+3.f*sigma, 0.f);
+      builder.addLinear(valueRange, weight, points, numSegments+3);
+    }
+
+    void serialize(StateWriter &out) const
+    {
+      writeHeader(out, FunctionType::Gaussian);
+      out.write(center);
+      out.write(sigma);
+      out.write(height);
+    }
+
+    static Function::SP deserialize(StateReader &in, box1f valueRange)
+    {
+      float center, sigma, height;
+      if (!in.read(center) || !in.read(sigma) || !in.read(height))
+        return nullptr;
+      auto f = std::make_shared<Gaussian>(center, sigma, height);
+      f->valueRange = valueRange;
+      return f;
+    }
+
+   private:
+    static float minSigma()
+    { return 1e-4f; }
+
+    float center;
+    float sigma;
+    float height;
+  };
+
+  /*! read a function that Function::serialize() wrote; returns nullptr
+    if the data is malformed or the type unknown */
+  inline Function::SP deserializeFunction(StateReader &in)
+  {
+    uint32_t type;
+    box1f valueRange;
+    float weight;
+    ColorMap::SP color;
+    if (!in.read(type) || !in.read(valueRange) || !in.read(weight))
+      return nullptr;
+    if (type & FunctionTypeHasColor) {
+      type &= ~FunctionTypeHasColor;
+      if (!(color = ColorMap::deserialize(in)))
+        return nullptr;
+    }
+
+    Function::SP f;
+    switch (FunctionType(type)) {
+      case FunctionType::Sampled:
+      case FunctionType::PiecewiseLinear:
+        f = PiecewiseLinear::deserialize(in, valueRange); break;
+      case FunctionType::Tent: f = Tent::deserialize(in, valueRange); break;
+      case FunctionType::FreeHand: f = FreeHand::deserialize(in, valueRange); break;
+      case FunctionType::MonotoneCubic: f = MonotoneCubic::deserialize(in, valueRange); break;
+      case FunctionType::CatmullRom: f = CatmullRom::deserialize(in, valueRange); break;
+      case FunctionType::Formula: f = Formula::deserialize(in, valueRange); break;
+      case FunctionType::Box: f = Box::deserialize(in, valueRange); break;
+      case FunctionType::Gaussian: f = Gaussian::deserialize(in, valueRange); break;
+    }
+    if (f) {
+      f->weight = weight;
+      f->color = color;
+    }
+    return f;
+  }
+
+  /*! linear sRGB to Oklab (perceptually uniform) */
+  inline vec3f linearToOklab(vec3f c)
+  {
+    float l = cbrtf(0.4122214708f*c.x + 0.5363325363f*c.y + 0.0514459929f*c.z);
+    float m = cbrtf(0.2119034982f*c.x + 0.6806995451f*c.y + 0.1073969566f*c.z);
+    float s = cbrtf(0.0883024619f*c.x + 0.2817188376f*c.y + 0.6299787005f*c.z);
+    return vec3f(0.2104542553f*l + 0.7936177850f*m - 0.0040720468f*s,
+                 1.9779984951f*l - 2.4285922050f*m + 0.4505937099f*s,
+                 0.0259040371f*l + 0.7827717662f*m - 0.8086757660f*s);
+  }
+
+  inline vec3f oklabToLinear(vec3f c)
+  {
+    float l = c.x + 0.3963377774f*c.y + 0.2158037573f*c.z;
+    float m = c.x - 0.1055613458f*c.y - 0.0638541728f*c.z;
+    float s = c.x - 0.0894841775f*c.y - 1.2914855480f*c.z;
+    l = l*l*l; m = m*m*m; s = s*s*s;
+    return vec3f(+4.0767416621f*l - 3.3077115913f*m + 0.2309699292f*s,
+                 -1.2684380046f*l + 2.6097574011f*m - 0.3413193965f*s,
+                 -0.0041960863f*l - 0.7034186147f*m + 1.7076147010f*s);
+  }
+
+  namespace detail {
+
+    /*! the bin (of numBins over the data range) that column x of width
+      columns shows, when the x axis goes through mapping */
+    inline size_t mapBin(const DomainMapping &mapping, unsigned x, unsigned width, size_t numBins)
+    {
+      float t = mapping.unmap((x+0.5f)/width);
+      return std::min(size_t(t*numBins), numBins-1);
+    }
+
+    /*! bar chart of heights in [0:1], one bar per bin over the data
+      range; the x axis goes through mapping, if not nullptr */
+    inline Texture rasterizeBars(const std::vector<float> &heights, unsigned width, unsigned height,
+                                 const DomainMapping *mapping)
+    {
+      Texture tex(width, height);
+      uint32_t bg = cvt_uint32(vec4f(0.95f, 0.95f, 0.95f, 1.f));
+      uint32_t bar = cvt_uint32(vec4f(0.6f, 0.65f, 0.75f, 1.f));
+      for (unsigned x=0; x<width; ++x) {
+        size_t bin = mapping ? mapBin(*mapping, x, width, heights.size())
+                             : std::min(size_t(x)*heights.size()/width, heights.size()-1);
+        unsigned yval = std::min(unsigned(heights[bin] * height), height);
+        uint32_t *pixel = tex.data.data()+x;
+        for (unsigned y=0; y<height; ++y, pixel+=width) {
+          *pixel = y < yval ? bar : bg;
+        }
+      }
+      return tex;
+    }
+
+  } // detail
+
+  /*! histogram of scalar values, e.g., to use as background layer;
+    values can be added in several batches (e.g., when streaming a
+    volume brick by brick), each batch is binned in parallel */
+  class Histogram : public Layer
+  {
+   public:
+    typedef std::shared_ptr<Histogram> SP;
+
+    Histogram(unsigned numBins = 256, box1f valueRange = {0.f, 1.f})
+      : counts(std::max(numBins, 1u), 0), valueRange(valueRange)
+    {}
+
+    void clear()
+    {
+      std::fill(counts.begin(), counts.end(), 0);
+    }
+
+    /*! bin the values; values outside the value range are ignored */
+    void add(const float *values, size_t n)
+    {
+      typedef std::vector<uint64_t> Bins;
+      float scale = counts.size()/valueRange.size();
+      unsigned maxBin = unsigned(counts.size()-1);
+      box1f range = valueRange;
+
+      // a fixed number of partial histograms, so that memory stays
+      // bounded for many bins and the result doesn't depend on the
+      // number of threads
+      Bins sum = parallel::binnedReduce<uint64_t>(n, counts.size(), 64, size_t(1)<<16,
+        [&](Bins &bins, size_t first, size_t last) {
+          for (size_t i=first; i<last; ++i) {
+            float v = values[i];
+            if (v >= range.lower && v <= range.upper) // false for NaN
+              ++bins[std::min(unsigned((v-range.lower)*scale), maxBin)];
+          }
+        });
+
+      for (size_t i=0; i<counts.size(); ++i) {
+        counts[i] += sum[i];
+      }
+    }
+
+    const std::vector<uint64_t> &getCounts() const
+    {
+      return counts;
+    }
+
+    box1f getValueRange() const
+    {
+      return valueRange;
+    }
+
+    Texture rasterize(unsigned width, unsigned height) const
+    {
+      return rasterize(width, height, nullptr);
+    }
+
+    Texture rasterizeMapped(unsigned width, unsigned height, const DomainMapping &mapping) const
+    {
+      return rasterize(width, height, &mapping);
+    }
+
+   private:
+    Texture rasterize(unsigned width, unsigned height, const DomainMapping *mapping) const
+    {
+      uint64_t maxCount = *std::max_element(counts.begin(), counts.end());
+      float norm = maxCount > 0 ? 1.f/logf(1.f+maxCount) : 0.f;
+      // log scale, so that small peaks remain visible
+      std::vector<float> heights(counts.size());
+      for (size_t i=0; i<counts.size(); ++i) {
+        heights[i] = logf(1.f+counts[i])*norm;
+      }
+      return detail::rasterizeBars(heights, width, height, mapping);
+    }
+
+    std::vector<uint64_t> counts;
+    box1f valueRange;
+  };
+
+  /*! histogram in which every value comes with a weight, e.g., the
+    volume of its cell, so that the histograms of AMR data and of
+    unstructured meshes aren't biased towards finely resolved regions.
+    Like Histogram, values can be added in several batches, and each
+    batch is binned in parallel into per-chunk bins that are reduced
+    in order, so the result is deterministic. Weights are accumulated
+    in double precision. With AMR data, leave out the cells that are
+    covered by finer levels (or weight them 0), or they are counted
+    twice */
+  class WeightedHistogram : public Layer
+  {
+   public:
+    typedef std::shared_ptr<WeightedHistogram> SP;
+
+    WeightedHistogram(unsigned numBins = 256, box1f valueRange = {0.f, 1.f})
+      : weights(std::max(numBins, 1u), 0.0), valueRange(valueRange)
+    {}
+
+    void clear()
+    {
+      std::fill(weights.begin(), weights.end(), 0.0);
+    }
+
+    /*! bin the values, value i with weight weights[i] (e.g., the
+      volumes of the cells of an unstructured mesh); values outside
+      the value range are ignored */
+    void add(const float *values, const float *weights, size_t n)
+    {
+      addT(values, n, [weights](size_t i) { return double(weights[i]); });
+    }
+
+    /*! bin the values, all with the same weight, e.g., the cells of
+      one AMR level or patch */
+    void add(const float *values, size_t n, double weight)
+    {
+      addT(values, n, [weight](size_t) { return weight; });
+    }
+
+    /*! bin the values of cells on several AMR levels at once: value i
+      is on level levels[i], and weighted with levelWeights[levels[i]]
+      (e.g., the cell volume on that level); values on levels >=
+      numLevels are ignored */
+    void add(const float *values, const uint8_t *levels, const double *levelWeights,
+             unsigned numLevels, size_t n)
+    {
+      // levels past numLevels index a zero weight
+      double table[256] = {};
+      std::copy(levelWeights, levelWeights+std::min(numLevels, 256u), table);
+      addT(values, n, [levels, &table](size_t i) { return table[levels[i]]; });
+    }
+
+    const std::vector<double> &getWeights() const
+    {
+      return weights;
+    }
+
+    double getTotalWeight() const
+    {
+      double total = 0.0;
+      for (double w : weights) total += w;
+      return total;
+    }
+
+    box1f getValueRange() const
+    {
+      return valueRange;
+    }
+
+    Texture rasterize(unsigned width, unsigned height) const
+    {
+      return rasterize(width, height, nullptr);
+    }
+
+    Texture rasterizeMapped(unsigned width, unsigned height, const DomainMapping &mapping) const
+    {
+      return rasterize(width, height, &mapping);
+    }
+
+   private:
+    template <typename WeightOf>
+    void addT(const float *values, size_t n, const WeightOf &weightOf)
+    {
+      typedef std::vector<double> Bins;
+      float scale = weights.size()/valueRange.size();
+      unsigned maxBin = unsigned(weights.size()-1);
+      box1f range = valueRange;
+
+      // as in Histogram::add()
+      Bins sum = parallel::binnedReduce<double>(n, weights.size(), 64, size_t(1)<<16,
+        [&](Bins &bins, size_t first, size_t last) {
+          for (size_t i=first; i<last; ++i) {
+            float v = values[i];
+            if (v >= range.lower && v <= range.upper) // false for NaN
+              bins[std::min(unsigned((v-range.lower)*scale), maxBin)] += weightOf(i);
+          }
+        });
+
+      for (size_t i=0; i<weights.size(); ++i) {
+        weights[i] += sum[i];
+      }
+    }
+
+    Texture rasterize(unsigned width, unsigned height, const DomainMapping *mapping) const
+    {
+      // log scale like Histogram, in units of the smallest weight
+      double maxWeight = 0.0, unit = DBL_MAX;
+      for (double w : weights) {
+        maxWeight = std::max(maxWeight, w);
+        if (w > 0.0) unit = std::min(unit, w);
+      }
+      double norm = maxWeight > 0.0 ? 1.0/log1p(maxWeight/unit) : 0.0;
+      std::vector<float> heights(weights.size());
+      for (size_t i=0; i<weights.size(); ++i) {
+        heights[i] = weights[i] > 0.0 ? float(log1p(weights[i]/unit)*norm) : 0.f;
+      }
+      return detail::rasterizeBars(heights, width, height, mapping);
+    }
+
+    std::vector<double> weights;
+    box1f valueRange;
+  };
+
+  /*! joint 2D histogram, e.g., of value (x) and gradient magnitude
+    (y), to use as background layer for 2D TFs; like Histogram,
+    batches are binned in parallel and deterministically */
+  class Histogram2D : public Layer
+  {
+   public:
+    typedef std::shared_ptr<Histogram2D> SP;
+
+    Histogram2D(vec2ui numBins = vec2ui(256, 256),
+                box1f xRange = {0.f, 1.f},
+                box1f yRange = {0.f, 1.f})
+      : numBins(std::max(numBins.x, 1u), std::max(numBins.y, 1u)),
+        counts(size_t(this->numBins.x)*this->numBins.y, 0),
+        xRange(xRange), yRange(yRange)
+    {}
+
+    void clear()
+    {
+      std::fill(counts.begin(), counts.end(), 0);
+    }
+
+    /*! bin the pairs (xs[i],ys[i]); pairs outside the ranges are
+      ignored */
+    void add(const float *xs, const float *ys, size_t n)
+    {
+      typedef std::vector<uint64_t> Bins;
+      float sx = numBins.x/xRange.size(), sy = numBins.y/yRange.size();
+      box1f rx = xRange, ry = yRange;
+      vec2ui nb = numBins;
+
+      // fewer partial histograms than in Histogram::add(), as each
+      // of them is large
+      Bins sum = parallel::binnedReduce<uint64_t>(n, counts.size(), 16, size_t(1)<<16,
+        [&](Bins &bins, size_t first, size_t last) {
+          for (size_t i=first; i<last; ++i) {
+            float x = xs[i], y = ys[i];
+            if (x >= rx.lower && x <= rx.upper && y >= ry.lower && y <= ry.upper) {
+              unsigned bx = std::min(unsigned((x-rx.lower)*sx), nb.x-1);
+              unsigned by = std::min(unsigned((y-ry.lower)*sy), nb.y-1);
+              ++bins[bx+size_t(nb.x)*by];
+            }
+          }
+        });
+
+      for (size_t i=0; i<sum.size(); ++i) {
+        counts[i] += sum[i];
+      }
+    }
+
+    const std::vector<uint64_t> &getCounts() const
+    {
+      return counts;
+    }
+
+    vec2ui getNumBins() const
+    {
+      return numBins;
+    }
+
+    box1f getXRange() const
+    {
+      return xRange;
+    }
+
+    box1f getYRange() const
+    {
+      return yRange;
+    }
+
+    Texture rasterize(unsigned width, unsigned height) const
+    {
+      return rasterize(width, height, nullptr);
+    }
+
+    /*! the mapping applies to x (the value) */
+    Texture rasterizeMapped(unsigned width, unsigned height, const DomainMapping &mapping) const
+    {
+      return rasterize(width, height, &mapping);
+    }
+
+   private:
+    Texture rasterize(unsigned width, unsigned height, const DomainMapping *mapping) const
+    {
+      Texture tex(width, height);
+      uint64_t maxCount = *std::max_element(counts.begin(), counts.end());
+      float norm = maxCount > 0 ? 1.f/logf(1.f+maxCount) : 0.f;
+      std::vector<size_t> bins(width);
+      for (unsigned x=0; x<width; ++x) {
+        bins[x] = mapping ? detail::mapBin(*mapping, x, width, numBins.x)
+                          : std::min(size_t(x)*numBins.x/width, size_t(numBins.x-1));
+      }
+      // colors are blended in linear space
+      vec4f lo = cvt_rgba32f_linear(cvt_uint32(vec4f(0.95f, 0.95f, 0.95f, 1.f)));
+      vec4f hi = cvt_rgba32f_linear(cvt_uint32(vec4f(0.2f, 0.25f, 0.45f, 1.f)));
+      for (unsigned y=0; y<height; ++y) {
+        size_t by = std::min(size_t(y)*numBins.y/height, size_t(numBins.y-1));
+        uint32_t *row = tex.row(y);
+        for (unsigned x=0; x<width; ++x) {
+          float t = logf(1.f+counts[bins[x]+numBins.x*by])*norm;
+          row[x] = cvt_uint32_linear(lo + vec4f(t)*(hi-lo));
+        }
+      }
+      return tex;
+    }
+
+    vec2ui numBins;
+    std::vector<uint64_t> counts;
+    box1f xRange, yRange;
+  };
+
+  // Checkers texture (use as background!)
+  class Checkers : public Layer
+  {
+   public:
+    Checkers(unsigned cs = 8, vec3f c1 = {0.f, 0.f, 0.f}, vec3f c2 = {1.f, 1.f, 1.f})
+        : checkerSize(cs), color1(c1), color2(c2)
+    {}
+
+    Texture rasterize(unsigned width, unsigned height) const
+    {
+      Texture tex(width, height);
+      // colors are sRGB, so they are stored as is
+      uint32_t colors[2] = {
+        cvt_uint32(vec4f(color1.x,color1.y,color1.z,1.f)),
+        cvt_uint32(vec4f(color2.x,color2.y,color2.z,1.f)),
+      };
+      for (unsigned y=0; y<height; ++y) {
+        uint32_t *row = tex.row(y);
+        for (unsigned x=0; x<width; ++x) {
+          unsigned xx = x/checkerSize;
+          unsigned yy = y/checkerSize;
+          int idx = (xx % 2) == (yy % 2) ? 0 : 1;
+          row[x] = colors[idx];
+        }
+      }
+      return tex;
+    }
+
+   private:
+    unsigned checkerSize;
+    vec3f color1, color2;
+  };
+
+  /*! out[i] = a[i] + t*(b[i]-a[i]), for n floats; used to blend
+    baked tables (e.g., RGBA LUTs viewed as 4n floats) */
+  inline void lerpBatch(const float *a, const float *b, float t, float *out, size_t n)
+  {
+    simd::float4 t4 = simd::splat(t);
+    size_t i = 0;
+    for (; i+4<=n; i+=4) {
+      simd::float4 a4 = simd::load(a+i), b4 = simd::load(b+i);
+      simd::store(out+i, a4 + t4*(b4-a4));
+    }
+    for (; i<n; ++i) {
+      out[i] = a[i] + t*(b[i]-a[i]);
+    }
+  }
+
+  // Combine operators, used as template arguments so the bake kernels
+  // don't need to switch per sample. Each provides the identity
+  // element, the (scalar and SIMD) reduction step, and the final step
+  // applied after all functions were combined.
+
+  struct CombineMax
+  {
+    static float identity() { return 0.f; }
+    static float apply(float acc, float y) { return fmaxf(acc, y); }
+    static simd::float4 apply(simd::float4 acc, simd::float4 y)
+    { return simd::max(acc, y); }
+    static float finalize(float acc) { return acc; }
+  };
+
+  struct CombineSum
+  {
+    static float identity() { return 0.f; }
+    static float apply(float acc, float y) { return acc + y; }
+    static simd::float4 apply(simd::float4 acc, simd::float4 y)
+    { return acc + y; }
+    static float finalize(float acc) { return fminf(acc, 1.f); }
+  };
+
+  struct CombineProduct
+  {
+    static float identity() { return 1.f; }
+    static float apply(float acc, float y) { return acc * y; }
+    static simd::float4 apply(simd::float4 acc, simd::float4 y)
+    { return acc * y; }
+    static float finalize(float acc) { return acc; }
+  };
+
+  struct CombineOver
+  {
+    static float identity() { return 0.f; }
+    static float apply(float acc, float y) { return acc + y - acc*y; }
+    static simd::float4 apply(simd::float4 acc, simd::float4 y)
+    { return acc + y - acc*y; }
+    static float finalize(float acc) { return acc; }
+  };
+
+  /*! one recorded editor interaction, see InteractionTrace */
+  struct TraceEvent
+  {
+    enum Type : uint32_t
+    {
+      PointerDown,    // pos
+      PointerMove,    // pos
+      PointerUp,
+      ApplyInput,     // applyPointerInput()
+      Frame,          // updateTexture(size), a change of size is a resize
+      AddFunction,    // function, serialized
+      RemoveFunction, // index in the function stack
+      MoveToTop,      // index in the function stack
+      // index in the function stack, or NoIndex with the (off-stack)
+      // target serialized in function; NoIndex and no function: none
+      SetDrawTarget,
+      SetWeight,      // index in the function stack, weight in pos.x
+      SetCombineOp,   // op in index
+      SetColorMap,    // color map serialized in function, none if empty
+      SetColor,       // index in the function stack, color map like above
+      SetDomainMapping, // mapping serialized in function, none if empty
+      SetPickRadius,  // radius in pos
+    };
+
+    enum : uint32_t { NoIndex = ~0u };
+
+    double time{0.0}; // seconds since the start of the recording
+    Type type{Frame};
+    vec2f pos{0.f};
+    vec2ui size{0u, 0u};
+    uint32_t index{0};
+    std::vector<uint8_t> function;
+  };
+
+  /*! sequence of editor interactions with timestamps, together with
+    the editor state they started from; see TFEditor::startRecording()
+    and TraceReplayer (trace.h) */
+  class InteractionTrace
+  {
+   public:
+    std::vector<uint8_t> initialState;
+    std::vector<TraceEvent> events;
+
+    void record(TraceEvent event)
+    {
+      event.time = std::chrono::duration<double>(
+          std::chrono::steady_clock::now()-startTime).count();
+      events.push_back(event);
+    }
+
+    void restart(const std::vector<uint8_t> &state)
+    {
+      initialState = state;
+      events.clear();
+      startTime = std::chrono::steady_clock::now();
+    }
+
+    std::vector<uint8_t> serialize() const
+    {
+      StateWriter out;
+      out.write(uint32_t(Magic));
+      out.write(uint32_t(Version));
+      out.writeArray(initialState.data(), initialState.size());
+      out.write(uint32_t(events.size()));
+      for (auto &e : events) {
+        out.write(e.time);
+        out.write(uint32_t(e.type));
+        out.write(e.pos);
+        out.write(e.size);
+        out.write(e.index);
+        out.writeArray(e.function.data(), e.function.size());
+      }
+      return out.bytes;
+    }
+
+    bool deserialize(const uint8_t *data, size_t size)
+    {
+      StateReader in(data, size);
+      uint32_t magic, version, numEvents, type;
+      std::vector<uint8_t> state;
+      // versions 1 and 2 had the same layout, with fewer event types
+      if (!in.read(magic) || magic != Magic || !in.read(version) || version < 1 || version > Version
+        || !in.readArray(state) || !in.read(numEvents))
+        return false;
+
+      std::vector<TraceEvent> evs;
+      for (uint32_t i=0; i<numEvents; ++i) {
+        TraceEvent e;
+        if (!in.read(e.time) || !in.read(type) || type > TraceEvent::SetPickRadius
+          || !in.read(e.pos) || !in.read(e.size) || !in.read(e.index)
+          || !in.readArray(e.function))
+          return false;
+        e.type = TraceEvent::Type(type);
+        evs.push_back(e);
+      }
+
+      initialState.swap(state);
+      events.swap(evs);
+      return true;
+    }
+
+   private:
+    enum : uint32_t { Magic = 0x52544654, Version = 3 }; // "TFTR"
+
+    std::chrono::steady_clock::time_point startTime{std::chrono::steady_clock::now()};
+  };
+
+  /*! index over the supports of a function stack, so the editor only
+    evaluates the functions that can be non-zero at a given x. [0:1]
+    is divided into buckets that list (in stack order) the positions
+    of the functions whose support overlaps them; functions that span
+    many buckets are kept in a separate list instead, so neither
+    building the index nor updating a wide function costs more than a
+    few bucket visits. Positions outside of [0:1] go to the outermost
+    buckets. The index is generic over the ranges it holds, so the
+    editor also uses one for the x-ranges of the control points */
+  class SupportIndex
+  {
+   public:
+    /*! index the ranges rangeOf(0), ..., rangeOf(n-1) */
+    template <typename RangeOf>
+    void build(size_t n, const RangeOf &rangeOf)
+    {
+      buckets.assign(std::min(std::max(n, size_t(MinBuckets)), size_t(MaxBuckets)),
+                     std::vector<uint32_t>());
+      wide.clear();
+      supports.clear();
+      for (size_t i=0; i<n; ++i) {
+        add(uint32_t(i), rangeOf(i));
+      }
+    }
+
+    /*! add the function at position pos, which must be on top of all
+      functions that were added so far */
+    void add(uint32_t pos, box1f support)
+    {
+      assert(pos == supports.size());
+      if (buckets.empty())
+        buckets.resize(MinBuckets);
+      supports.push_back(support);
+      insert(pos, support);
+    }
+
+    /*! the support of the function at position pos changed */
+    void update(uint32_t pos, box1f newSupport)
+    {
+      assert(pos < supports.size());
+      box1f old = supports[pos];
+      if (old.lower == newSupport.lower && old.upper == newSupport.upper)
+        return;
+      erase(pos, old);
+      supports[pos] = newSupport;
+      insert(pos, newSupport);
+    }
+
+    /*! the function at position pos was removed from the stack; the
+      ones above it move down by one. Only the entries above pos are
+      renumbered (in place), nothing is rebuilt */
+    void remove(uint32_t pos)
+    {
+      assert(pos < supports.size());
+      erase(pos, supports[pos]);
+      supports.erase(supports.begin()+pos);
+      for (auto &b : buckets)
+        shiftDown(b, pos);
+      shiftDown(wide, pos);
+    }
+
+    /*! the function at position pos was raised to the top of the
+      stack */
+    void moveToTop(uint32_t pos)
+    {
+      box1f s = supports[pos];
+      remove(pos);
+      add(uint32_t(supports.size()), s);
+    }
+
+    size_t size() const
+    {
+      return supports.size();
+    }
+
+    box1f support(uint32_t pos) const
+    {
+      return supports[pos];
+    }
+
+    /*! call f(pos) for the positions of all functions whose support
+      contains x, bottom to top */
+    template <typename Func>
+    void forEach(float x, const Func &f) const
+    {
+      if (buckets.empty())
+        return;
+
+      const std::vector<uint32_t> &b = buckets[bucket(x)];
+      size_t i = 0, j = 0;
+      while (i < b.size() || j < wide.size()) {
+        uint32_t pos = j == wide.size() || (i < b.size() && b[i] < wide[j]) ? b[i++] : wide[j++];
+        if (x >= supports[pos].lower && x <= supports[pos].upper)
+          f(pos);
+      }
+    }
+
+    /*! positions of all functions whose support overlaps range,
+      bottom to top */
+    void query(box1f range, std::vector<uint32_t> &out) const
+    {
+      out.clear();
+      if (buckets.empty() || range.lower > range.upper)
+        return;
+
+      size_t first = bucket(range.lower), last = bucket(range.upper);
+      for (size_t b=first; b<=last; ++b) {
+        out.insert(out.end(), buckets[b].begin(), buckets[b].end());
+      }
+      out.insert(out.end(), wide.begin(), wide.end());
+      std::sort(out.begin(), out.end());
+      out.erase(std::unique(out.begin(), out.end()), out.end());
+      out.erase(std::remove_if(out.begin(), out.end(), [&](uint32_t pos) {
+        return supports[pos].upper < range.lower || supports[pos].lower > range.upper;
+      }), out.end());
+    }
+
+   private:
+    enum { MinBuckets = 64, MaxBuckets = 4096 };
+
+    size_t bucket(float x) const
+    {
+      float f = x*buckets.size();
+      // also maps NaNs to bucket 0
+      return f >= 0.f ? std::min(size_t(std::min(f, float(MaxBuckets))), buckets.size()-1) : 0;
+    }
+
+    bool isWide(box1f s) const
+    {
+      return bucket(s.upper)-bucket(s.lower) >= std::max(buckets.size()/16, size_t(4));
+    }
+
+    void insert(uint32_t pos, box1f s)
+    {
+      if (s.lower > s.upper)
+        return;
+
+      if (isWide(s)) {
+        wide.insert(std::upper_bound(wide.begin(), wide.end(), pos), pos);
+        return;
+      }
+      for (size_t b=bucket(s.lower); b<=bucket(s.upper); ++b) {
+        buckets[b].insert(std::upper_bound(buckets[b].begin(), buckets[b].end(), pos), pos);
+      }
+    }
+
+    void erase(uint32_t pos, box1f s)
+    {
+      if (s.lower > s.upper)
+        return;
+
+      auto eraseFrom = [pos](std::vector<uint32_t> &list) {
+        auto it = std::lower_bound(list.begin(), list.end(), pos);
+        if (it != list.end() && *it == pos)
+          list.erase(it);
+      };
+      if (isWide(s)) {
+        eraseFrom(wide);
+      } else {
+        for (size_t b=bucket(s.lower); b<=bucket(s.upper); ++b) {
+          eraseFrom(buckets[b]);
+        }
+      }
+    }
+
+    // positions in the sorted list above pos move down by one
+    static void shiftDown(std::vector<uint32_t> &list, uint32_t pos)
+    {
+      for (auto it = std::upper_bound(list.begin(), list.end(), pos); it != list.end(); ++it)
+        --*it;
+    }
+
+    std::vector<std::vector<uint32_t>> buckets;
+    // positions of the functions spanning too many buckets, sorted
+    std::vector<uint32_t> wide;
+    // support of the function at each position
+    std::vector<box1f> supports;
+  };
+
+  /*! stable reference to a function on the editor's stack; stays
+    valid while the stack is reordered and other functions are removed,
+    and becomes stale (rather than referring to a different function)
+    once its function was removed. Resolving a handle to its stack
+    position, and thus to its function, is O(1) */
+  typedef SlotHandle FunctionHandle;
+
+  class TFEditor
+  {
+   public:
+    virtual ~TFEditor() {}
+
+    virtual FunctionHandle addFunction(const Function::SP &func)
+    {
+      if (trace) {
+        TraceEvent e;
+        e.type = TraceEvent::AddFunction;
+        StateWriter out;
+        func->serialize(out);
+        e.function = out.bytes;
+        trace->record(e);
+      }
+      functions.push_back(func);
+      handles.push_back(stackPositions.insert(uint32_t(functions.size()-1)));
+      index.add(uint32_t(functions.size()-1), func->support());
+      handleIndex.add(uint32_t(functions.size()-1), controlPointRange(*func));
+      markChanged(func->support());
+      return handles.back();
+    }
+
+    /*! remove the function from the function list (if present) */
+    virtual void removeFunction(const Function::SP &func)
+    {
+      auto it = std::find(functions.begin(), functions.end(), func);
+      if (it != functions.end())
+        removeAt(it-functions.begin());
+    }
+
+    void removeFunction(FunctionHandle h)
+    {
+      ptrdiff_t pos = stackPosition(h);
+      if (pos >= 0)
+        removeAt(size_t(pos));
+    }
+
+    /*! the function h refers to, or nullptr if h is stale */
+    Function::SP getFunction(FunctionHandle h) const
+    {
+      ptrdiff_t pos = stackPosition(h);
+      return pos >= 0 ? functions[pos] : nullptr;
+    }
+
+    /*! handle of the (topmost, if it was added several times)
+      function; stale if the function is not on the stack */
+    FunctionHandle getHandle(const Function::SP &func) const
+    {
+      auto it = std::find(functions.rbegin(), functions.rend(), func);
+      return it != functions.rend() ? handles[functions.rend()-it-1] : FunctionHandle();
+    }
+
+    /*! record all interactions (pointer input, the pick radius,
+      adding, removing and raising functions, the draw target, weights,
+      colors, the combine op, the color map and domain mapping, and
+      frames) into trace,
+      starting from the current state, until stopRecording() is
+      called */
+    void startRecording(InteractionTrace &t)
+    {
+      t.restart(serialize());
+      trace = &t;
+
+      // not part of the serialized state, but picks depend on it
+      TraceEvent e;
+      e.type = TraceEvent::SetPickRadius;
+      e.pos = pickRadius;
+      trace->record(e);
+    }
+
+    void stopRecording()
+    {
+      trace = nullptr;
+    }
+
+    /*! the function stack, bottom to top */
+    const std::vector<Function::SP> &getFunctions() const
+    {
+      return functions;
+    }
+
+    virtual void setBackground(const Layer::SP &bg)
+    {
+      background = bg;
+      // background is rasterized as a whole, so force a full update
+      cached = Texture();
+    }
+
+    Layer::SP getBackground() const
+    {
+      return background;
+    }
+
+    /*! search through the function list; if the function is
+      present, make sure it is drawn on top of all the others */
+    virtual void moveToTop(const Function::SP &func)
+    {
+      auto it = std::find(functions.begin(), functions.end(), func);
+      if (it == functions.end() || it+1 == functions.end())
+        return;
+
+      recordIndexEvent(TraceEvent::MoveToTop, it-functions.begin());
+      raise(it);
+    }
+
+    void moveToTop(FunctionHandle h)
+    {
+      ptrdiff_t pos = stackPosition(h);
+      if (pos < 0 || size_t(pos)+1 == functions.size())
+        return;
+
+      recordIndexEvent(TraceEvent::MoveToTop, pos);
+      raise(functions.begin()+pos);
+    }
+
+    /*! return the function underneath the (e.g., mouse) pos
+      that is topmost on the function stack */
+    Function::SP select(vec2f pos) const
+    {
+      ptrdiff_t i = selectPosition(pos);
+      return i >= 0 ? functions[i] : nullptr;
+    }
+
+    /*! the function that pointer input at pos would select: the
+      topmost one with a control point within the pick radius, or
+      else the topmost one underneath pos */
+    Function::SP pickFunction(vec2f pos, int *controlPoint = nullptr) const
+    {
+      int cp;
+      ptrdiff_t i = pickPosition(pos, cp);
+      if (controlPoint) *controlPoint = cp;
+      return i >= 0 ? functions[i] : nullptr;
+    }
+
+    Function::SP getSelected() const
+    {
+      return selected;
+    }
+
+    int getActiveControlPoint() const
+    {
+      return activeControlPoint;
+    }
+
+    /*! move control point i of func and mark the x-range that
+      changed as dirty */
+    void moveControlPoint(const Function::SP &func, size_t i, vec2f pos)
+    {
+      markChanged(func->controlPointSupport(i));
+      func->setControlPoint(i, pos);
+      markChanged(func->controlPointSupport(i));
+      updateIndex(func);
+    }
+
+    void moveControlPoint(FunctionHandle h, size_t i, vec2f pos)
+    {
+      ptrdiff_t p = stackPosition(h);
+      if (p < 0)
+        return;
+
+      const Function::SP &func = functions[p];
+      markChanged(func->controlPointSupport(i));
+      func->setControlPoint(i, pos);
+      markChanged(func->controlPointSupport(i));
+      updateIndex(size_t(p));
+    }
+
+    /*! set the first n control points of func at once (see
+      Function::setControlPoints()) and mark the x-range that
+      changed as dirty */
+    void setControlPoints(const Function::SP &func, const vec2f *cps, size_t n)
+    {
+      markChanged(func->support());
+      func->setControlPoints(cps, n);
+      markChanged(func->support());
+      updateIndex(func);
+    }
+
+    void deleteSelected()
+    {
+      if (selected)
+        removeFunction(selected);
+    }
+
+    /*! while a draw target is set, dragging the pointer draws
+      strokes into it instead of picking and moving control points;
+      pass nullptr to go back to picking */
+    void setDrawTarget(const FreeHand::SP &target)
+    {
+      if (trace) {
+        ptrdiff_t pos = stackIndex(target);
+        std::vector<uint8_t> payload;
+        if (target && pos < 0) {
+          StateWriter out;
+          target->serialize(out);
+          payload = out.bytes;
+        }
+        recordEvent(TraceEvent::SetDrawTarget, pos < 0 ? TraceEvent::NoIndex : uint32_t(pos), 0.f, payload);
+      }
+      drawTarget = target;
+      stroking = false;
+    }
+
+    /*! mark the x-range [range.lower,range.upper] as out of date;
+      the next call to updateTexture() re-rasterizes these columns.
+      Ranges with lower>upper are considered empty and ignored. Call
+      this after changing functions directly (rather than through the
+      editor), so the editor also re-indexes their supports; until
+      then, evaluation may skip the functions where their support
+      grew, i.e., eval() and the tables return wrong values, not only
+      the texture is stale */
+    void markDirty(box1f range)
+    {
+      rebuildIndex();
+      markChanged(range);
+    }
+
+    /*! counter that is incremented with every change to the TF */
+    uint64_t getVersion() const
+    {
+      return version;
+    }
+
+    /*! x-range that changed since the given version; consumers of the
+      TF (like baked tables) remember the version they are up to date
+      with, and use this to only update what changed. If the version
+      is too old to be known, the whole range is returned */
+    box1f changedSince(uint64_t since) const
+    {
+      if (since >= version)
+        return emptyRange();
+      else if (version-since > ChangeLogSize)
+        return box1f(0.f, 1.f);
+
+      box1f res = emptyRange();
+      for (uint64_t v=since; v<version; ++v) {
+        res.extend(changeLog[v % ChangeLogSize].lower);
+        res.extend(changeLog[v % ChangeLogSize].upper);
+      }
+      return res;
+    }
+
+    bool isDirty() const
+    {
+      return dirtyRange.lower <= dirtyRange.upper || cached.data.empty();
+    }
+
+    // ------------------------------------------------------------------
+    // Pointer input. The pointer*() functions only record the most
+    // recent state and can safely be called at the device's event
+    // rate; applyPointerInput() then turns the coalesced state into (at
+    // most) one edit, typically once per frame.
+    // ------------------------------------------------------------------
+
+    void pointerDown(vec2f pos)
+    {
+      if (trace) {
+        TraceEvent e;
+        e.type = TraceEvent::PointerDown;
+        e.pos = pos;
+        trace->record(e);
+      }
+      pointer.pressed = true;
+      pointer.pressPos = pos;
+      pointer.pos = pos;
+    }
+
+    void pointerMove(vec2f pos)
+    {
+      if (trace) {
+        TraceEvent e;
+        e.type = TraceEvent::PointerMove;
+        e.pos = pos;
+        trace->record(e);
+      }
+      pointer.moved = true;
+      pointer.pos = pos;
+    }
+
+    void pointerUp()
+    {
+      if (trace) {
+        TraceEvent e;
+        e.type = TraceEvent::PointerUp;
+        trace->record(e);
+      }
+      pointer.released = true;
+    }
+
+    /*! radius (in [0:1]^2 editor space) around control points that
+      counts as a hit when picking */
+    void setPickRadius(vec2f radius)
+    {
+      // front ends set it every frame, so only changes are recorded
+      if (trace && (radius.x != pickRadius.x || radius.y != pickRadius.y)) {
+        TraceEvent e;
+        e.type = TraceEvent::SetPickRadius;
+        e.pos = radius;
+        trace->record(e);
+      }
+      pickRadius = radius;
+    }
+
+    vec2f getPickRadius() const
+    {
+      return pickRadius;
+    }
+
+    void applyPointerInput()
+    {
+      if (trace) {
+        TraceEvent e;
+        e.type = TraceEvent::ApplyInput;
+        trace->record(e);
+      }
+
+      if (drawTarget) {
+        applyStrokeInput();
+        return;
+      }
+
+      // the control point keeps its offset to the pointer while
+      // dragging, so a click without a drag doesn't move it
+      if (pointer.pressed) {
+        pick(pointer.pressPos);
+        if (selected && activeControlPoint >= 0)
+          grabOffset = selected->getControlPoint(activeControlPoint)-pointer.pressPos;
+      }
+
+      if (selected && activeControlPoint >= 0 && pointer.moved)
+        moveControlPoint(selected, activeControlPoint, pointer.pos+grabOffset);
+
+      if (pointer.released)
+        activeControlPoint = -1;
+
+      pointer.pressed = pointer.moved = pointer.released = false;
+    }
+
+    Texture rasterize(unsigned width, unsigned height) const
+    {
+      Texture tex(width, height);
+      rasterizeColumns(tex, rasterizeBackground(width, height), 0, width);
+      return tex;
+    }
+
+    /*! composite B over A, in place into B (which is returned); blends
+      premultiplied colors in linear space, like rasterize(). A and B
+      must have the same size */
+    Texture &layerOver(const Texture &A, Texture &B) const
+    {
+      for (size_t i=0; i<B.data.size(); ++i) {
+        vec4f dst = cvt_rgba32f_linear(A.data[i]);
+        vec4f src = cvt_rgba32f_linear(B.data[i]);
+        B.data[i] = cvt_uint32_linear(over(src,dst));
+      }
+      return B;
+    }
+
+    /*! incremental version of rasterize(); columns outside the dirty
+      range are kept from the previous call. The column range [lower,
+      upper) that was updated can be queried with getUpdatedColumns() */
+    const Texture &updateTexture(unsigned width, unsigned height)
+    {
+      if (trace) {
+        TraceEvent e;
+        e.type = TraceEvent::Frame;
+        e.size = vec2ui(width, height);
+        trace->record(e);
+      }
+
+      if (cached.width != width || cached.height != height || cached.data.empty()) {
+        cached = Texture(width, height);
+        cachedBackground = rasterizeBackground(width, height);
+        updatedColumns = vec2ui(0, width);
+      } else if (dirtyRange.lower > dirtyRange.upper) {
+        updatedColumns = vec2ui(0, 0);
+      } else {
+        float scale = width-1;
+        float lo = clamp(floorf(dirtyRange.lower*scale), 0.f, scale);
+        float hi = clamp(ceilf(dirtyRange.upper*scale), 0.f, scale);
+        updatedColumns = vec2ui(unsigned(lo), unsigned(hi)+1);
+      }
+
+      rasterizeColumns(cached, cachedBackground, updatedColumns.x, updatedColumns.y);
+      dirtyRange = emptyRange();
+      return cached;
+    }
+
+    vec2ui getUpdatedColumns() const
+    {
+      return updatedColumns;
+    }
+
+    void setColorMap(const ColorMap::SP &cm)
+    {
+      if (trace)
+        recordEvent(TraceEvent::SetColorMap, 0, 0.f, serialized(cm));
+      colorMap = cm;
+      markChanged(box1f(0.f, 1.f));
+    }
+
+    ColorMap::SP getColorMap() const
+    {
+      return colorMap;
+    }
+
+    /*! set how normalized data values map to the x axis (nullptr for
+      linearly). Functions, the color map and picking work along the
+      mapped axis, and so does the background (see
+      Layer::rasterizeMapped()); the tables (getAlpha(), getRGBA(),
+      bakeLUT(), ...) and compile() are over equidistant data values.
+      Returns false, and keeps the current mapping, if m isn't valid() */
+    bool setDomainMapping(const DomainMapping::SP &m)
+    {
+      if (m && !m->valid())
+        return false;
+
+      if (trace)
+        recordEvent(TraceEvent::SetDomainMapping, 0, 0.f, serialized(m));
+      mapping = m;
+      // re-rasterizes the background, too
+      cached = Texture();
+      markChanged(box1f(0.f, 1.f));
+      return true;
+    }
+
+    DomainMapping::SP getDomainMapping() const
+    {
+      return mapping;
+    }
+
+    /*! x position of the normalized data value t */
+    float mapValue(float t) const
+    {
+      return mapping ? mapping->map(t) : t;
+    }
+
+    /*! normalized data value at x position x */
+    float unmapPosition(float x) const
+    {
+      return mapping ? mapping->unmap(x) : x;
+    }
+
+    /*! colors of the color map, sampled at numSamples equidistant
+      data values in [0:1] (see setDomainMapping()) */
+    std::vector<vec3f> getRGB(unsigned numSamples) const
+    {
+      std::vector<vec4f> rgba = getRGBA(numSamples);
+      std::vector<vec3f> rgb(numSamples);
+      for (unsigned i=0; i<numSamples; ++i) {
+        rgb[i] = vec3f(rgba[i].x, rgba[i].y, rgba[i].z);
+      }
+      return rgb;
+    }
+
+    /*! color and alpha, sampled at numSamples equidistant data
+      values in [0:1] (see setDomainMapping()) */
+    std::vector<vec4f> getRGBA(unsigned numSamples) const
+    {
+      std::vector<vec4f> rgba(numSamples);
+      bakeLUT(numSamples, 0, numSamples, rgba.data());
+      return rgba;
+    }
+
+    /*! entries [first,last) of getRGBA(numSamples), e.g., to update
+      the entries in changedLUTEntries() */
+    void bakeLUT(unsigned numSamples, unsigned first, unsigned last, vec4f *rgba) const
+    {
+      std::vector<float> xs(last-first);
+      for (unsigned i=first; i<last; ++i) {
+        xs[i-first] = lutPosition(i, numSamples);
+      }
+      bakeRGBA(xs.data(), rgba, xs.size());
+    }
+
+    /*! the entries [x,y) of a table of numSamples entries (like
+      getRGBA() returns) that changed since the given version (see
+      changedSince()); x==y if none did */
+    vec2ui changedLUTEntries(uint64_t since, unsigned numSamples) const
+    {
+      box1f changed = changedSince(since);
+      if (changed.lower > changed.upper || numSamples == 0)
+        return vec2ui(0, 0);
+
+      float scale = numSamples-1;
+      if (!mapping) {
+        return vec2ui(unsigned(clamp(floorf(changed.lower*scale), 0.f, scale)),
+                      unsigned(clamp(ceilf(changed.upper*scale), 0.f, scale))+1);
+      }
+
+      // the entries' positions increase with i; search for the ones
+      // inside the range, plus one on each side (like above)
+      auto firstAbove = [&](float x, bool inclusive) {
+        unsigned lo = 0, hi = numSamples;
+        while (lo < hi) {
+          unsigned mid = (lo+hi)/2;
+          float pos = lutPosition(mid, numSamples);
+          if (pos < x || (inclusive && pos == x)) lo = mid+1;
+          else hi = mid;
+        }
+        return lo;
+      };
+      unsigned first = firstAbove(changed.lower, false);
+      unsigned last = firstAbove(changed.upper, true);
+      return vec2ui(first > 0 ? first-1 : 0, std::min(last+1, numSamples));
+    }
+
+    /*! getRGBA(), packed into RGBA8 (see cvt_uint32()) */
+    std::vector<uint32_t> getRGBA8(unsigned numSamples) const
+    {
+      std::vector<vec4f> rgba = getRGBA(numSamples);
+      std::vector<uint32_t> rgba8(numSamples);
+      cvt_uint32(rgba.data(), rgba8.data(), numSamples);
+      return rgba8;
+    }
+
+    /*! evaluate color and alpha at the n positions xs. Functions
+      that carry a color (see Function::color) contribute it in the
+      same pass as their alpha: the colors of the functions at x are
+      averaged in linear space, weighted by their alpha (composited
+      in stack order with CombineOp::Over). Functions without a color
+      contribute the color map's; where no function contributes, the
+      color is the color map's */
+    void bakeRGBA(const float *xs, vec4f *rgba, size_t n) const
+    {
+      bool anyColor = false;
+      for (size_t i=0; i<functions.size() && !anyColor; ++i) {
+        anyColor = functions[i]->color != nullptr;
+      }
+
+      std::vector<float> alpha(n);
+      if (!anyColor) {
+        bakeAlpha(xs, alpha.data(), n);
+        for (size_t i=0; i<n; ++i) {
+          vec3f rgb = colorMap ? colorMap->eval(xs[i]) : vec3f(1.f);
+          rgba[i] = vec4f(rgb, alpha[i]);
+        }
+        return;
+      }
+
+      std::vector<vec3f> rgb(n);
+      switch (combineOp) {
+        case CombineOp::Max: bakeT<CombineMax>(xs, alpha.data(), rgb.data(), n); break;
+        case CombineOp::Sum: bakeT<CombineSum>(xs, alpha.data(), rgb.data(), n); break;
+        case CombineOp::Product: bakeT<CombineProduct>(xs, alpha.data(), rgb.data(), n); break;
+        case CombineOp::Over: bakeT<CombineOver>(xs, alpha.data(), rgb.data(), n); break;
+      }
+      for (size_t i=0; i<n; ++i) {
+        rgba[i] = vec4f(rgb[i], alpha[i]);
+      }
+    }
+
+    /*! alpha values of the combined functions, sampled at numSamples
+      equidistant data values in [0:1] (see setDomainMapping()) */
+    std::vector<float> getAlpha(unsigned numSamples) const
+    {
+      std::vector<float> xs(numSamples), alpha(numSamples);
+      for (unsigned i=0; i<numSamples; ++i) {
+        xs[i] = lutPosition(i, numSamples);
+      }
+      bakeAlpha(xs.data(), alpha.data(), numSamples);
+      return alpha;
+    }
+
+    /*! evaluate the combined functions at the n positions xs */
+    void bakeAlpha(const float *xs, float *alpha, size_t n) const
+    {
+      switch (combineOp) {
+        case CombineOp::Max: bakeT<CombineMax>(xs, alpha, nullptr, n); break;
+        case CombineOp::Sum: bakeT<CombineSum>(xs, alpha, nullptr, n); break;
+        case CombineOp::Product: bakeT<CombineProduct>(xs, alpha, nullptr, n); break;
+        case CombineOp::Over: bakeT<CombineOver>(xs, alpha, nullptr, n); break;
+      }
+    }
+
+    /*! the combined functions at x. Only the functions whose support
+      contains x are evaluated, so functions changed directly (rather
+      than through the editor) give wrong values until markDirty() is
+      called. Const evaluation doesn't modify the editor, so it may be
+      called from several threads (after Function::prepare()) */
+    float eval(float x) const
+    {
+      switch (combineOp) {
+        case CombineOp::Max: return evalT<CombineMax>(x);
+        case CombineOp::Sum: return evalT<CombineSum>(x);
+        case CombineOp::Product: return evalT<CombineProduct>(x);
+        case CombineOp::Over: return evalT<CombineOver>(x);
+      }
+      return 0.f;
+    }
+
+    /*! map the n values to alpha; values are normalized to [0:1]
+      using dataRange, and looked up in an alpha table of lutSize
+      entries */
+    void classify(const float *values, size_t n, box1f dataRange, float *alpha,
+                  unsigned lutSize = 1024) const
+    {
+      lutSize = std::max(lutSize, 2u);
+      std::vector<float> lut = getAlpha(lutSize);
+      float scale = (lutSize-1)/dataRange.size();
+
+      parallel::forEachRange(n, size_t(1)<<16, [&](size_t first, size_t last) {
+        for (size_t i=first; i<last; ++i) {
+          float xf = clamp((values[i]-dataRange.lower)*scale, 0.f, lutSize-1.f);
+          unsigned j = std::min(unsigned(xf), lutSize-2);
+          float t = xf-j;
+          alpha[i] = lut[j] + t*(lut[j+1]-lut[j]);
+        }
+      });
+    }
+
+    /*! test mode: runs all the parallel code paths (bake, histogram,
+      classification, rasterization) with 1 to maxThreads threads and
+      checks that the results are bitwise identical */
+    bool verifyDeterminism(unsigned maxThreads) const
+    {
+      struct Results
+      {
+        std::vector<float> alpha, classified;
+        std::vector<uint64_t> histogram;
+        std::vector<uint32_t> texture;
+
+        bool operator==(const Results &other) const
+        {
+          auto same = [](const void *a, const void *b, size_t size) {
+            return size == 0 || memcmp(a, b, size) == 0;
+          };
+          return alpha.size() == other.alpha.size()
+              && same(alpha.data(), other.alpha.data(), alpha.size()*sizeof(float))
+              && classified.size() == other.classified.size()
+              && same(classified.data(), other.classified.data(), classified.size()*sizeof(float))
+              && histogram == other.histogram
+              && texture == other.texture;
+        }
+      };
+
+      // pseudo-random values, identical on all machines
+      std::vector<float> values(size_t(1)<<20);
+      uint32_t state = 1;
+      for (size_t i=0; i<values.size(); ++i) {
+        state = state*1664525u + 1013904223u;
+        values[i] = (state >> 8)/float(1<<24);
+      }
+
+      auto run = [&]() {
+        Results res;
+        res.alpha = getAlpha(4096);
+        res.classified.resize(values.size());
+        classify(values.data(), values.size(), box1f(0.f, 1.f), res.classified.data());
+        Histogram hist(256);
+        hist.add(values.data(), values.size());
+        res.histogram = hist.getCounts();
+        res.texture = rasterize(512, 256).data;
+        return res;
+      };
+
+      unsigned prevNumThreads = parallel::getNumThreads();
+      parallel::setNumThreads(1);
+      Results reference = run();
+
+      bool deterministic = true;
+      for (unsigned t=2; t<=maxThreads && deterministic; ++t) {
+        parallel::setNumThreads(t);
+        deterministic = run() == reference;
+      }
+
+      parallel::setNumThreads(prevNumThreads);
+      return deterministic;
+    }
+
+    /*! flatten the function stack into a self-contained program;
+      like getAlpha(), the program takes normalized data values, and
+      maps them through the domain mapping (if any) */
+    TFProgram compile() const
+    {
+      ProgramBuilder builder;
+      for (size_t i=0; i<functions.size(); ++i) {
+        functions[i]->compile(builder);
+      }
+      if (mapping)
+        mapping->compile(builder);
+      return builder.finalize(combineOp);
+    }
+
+    /*! the editor's state (function stack, combine op, color map and
+      domain mapping); the background is not part of the state */
+    std::vector<uint8_t> serialize() const
+    {
+      StateWriter out;
+      out.write(uint32_t(StateMagic));
+      out.write(uint32_t(StateVersion));
+      out.write(uint32_t(combineOp));
+
+      size_t numStops = colorMap ? colorMap->numStops() : 0;
+      std::vector<float> positions(numStops);
+      std::vector<vec3f> colors(numStops);
+      for (size_t i=0; i<numStops; ++i) {
+        positions[i] = colorMap->getPosition(i);
+        colors[i] = colorMap->getColor(i);
+      }
+      out.write(uint32_t(colorMap ? 1 : 0));
+      out.writeArray(positions.data(), numStops);
+      out.writeArray(colors.data(), numStops);
+
+      if (mapping)
+        mapping->serialize(out);
+      else
+        out.write(uint32_t(DomainMappingType::Linear));
+
+      out.write(uint32_t(functions.size()));
+      for (size_t i=0; i<functions.size(); ++i) {
+        functions[i]->serialize(out);
+      }
+      return out.bytes;
+    }
+
+    /*! replace the editor's state with one that serialize() returned;
+      returns false (and leaves the editor unchanged) if the data is
+      malformed */
+    bool deserialize(const uint8_t *data, size_t size)
+    {
+      StateReader in(data, size);
+      uint32_t magic, version, op, hasColorMap, numFunctions;
+      std::vector<float> positions;
+      std::vector<vec3f> colors;
+      DomainMapping::SP m;
+      if (!in.read(magic) || magic != StateMagic || !in.read(version)
+        || version < 1 || version > StateVersion
+        || !in.read(op) || op > uint32_t(CombineOp::Over) || !in.read(hasColorMap)
+        || !in.readArray(positions) || !in.readArray(colors) || positions.size() != colors.size())
+        return false;
+      // version 1 had no domain mapping
+      if ((version >= 2 && !deserializeDomainMapping(in, m)) || !in.read(numFunctions))
+        return false;
+
+      std::vector<Function::SP> funcs;
+      for (uint32_t i=0; i<numFunctions; ++i) {
+        Function::SP f = deserializeFunction(in);
+        if (!f)
+          return false;
+        funcs.push_back(f);
+      }
+
+      functions = funcs;
+      stackPositions.clear();
+      handles.clear();
+      for (size_t i=0; i<functions.size(); ++i) {
+        handles.push_back(stackPositions.insert(uint32_t(i)));
+      }
+      combineOp = CombineOp(op);
+      colorMap = hasColorMap
+          ? std::make_shared<ColorMap>(positions.data(), colors.data(), unsigned(positions.size()))
+          : nullptr;
+      if (mapping != m)
+        cached = Texture();
+      mapping = m;
+      selected = nullptr;
+      activeControlPoint = -1;
+      drawTarget = nullptr;
+      stroking = false;
+      rebuildIndex();
+      markChanged(box1f(0.f, 1.f));
+      return true;
+    }
+
+    void setCombineOp(CombineOp op)
+    {
+      if (trace)
+        recordEvent(TraceEvent::SetCombineOp, uint32_t(op), 0.f, {});
+      combineOp = op;
+      markChanged(box1f(0.f, 1.f));
+    }
+
+    CombineOp getCombineOp() const
+    {
+      return combineOp;
+    }
+
+    /*! set the weight the function is scaled with when combining */
+    void setWeight(const Function::SP &func, float weight)
+    {
+      // changes to functions that aren't on the stack don't affect
+      // the TF, so they aren't recorded
+      ptrdiff_t pos = stackIndex(func);
+      if (trace && pos >= 0)
+        recordEvent(TraceEvent::SetWeight, uint32_t(pos), weight, {});
+      func->weight = weight;
+      markChanged(func->support());
+    }
+
+    /*! set the function's color (nullptr: none), see Function::color */
+    void setColor(const Function::SP &func, const ColorMap::SP &color)
+    {
+      ptrdiff_t pos = stackIndex(func);
+      if (trace && pos >= 0)
+        recordEvent(TraceEvent::SetColor, uint32_t(pos), 0.f, serialized(color));
+      func->color = color;
+      markChanged(func->support());
+    }
+
+   protected:
+    // Variable transfer functions layered on top of each other
+    std::vector<Function::SP> functions;
+
+   private:
+    struct PointerState
+    {
+      vec2f pos{0.f}, pressPos{0.f};
+      bool pressed{false}, moved{false}, released{false};
+    };
+
+    static box1f emptyRange()
+    {
+      return box1f(FLT_MAX, -FLT_MAX);
+    }
+
+    // x position of entry i of a table of numSamples entries
+    float lutPosition(unsigned i, unsigned numSamples) const
+    {
+      return mapValue(numSamples > 1 ? i/float(numSamples-1) : 0.f);
+    }
+
+    Texture rasterizeBackground(unsigned width, unsigned height) const
+    {
+      if (!background)
+        return Texture();
+      return mapping ? background->rasterizeMapped(width, height, *mapping)
+                     : background->rasterize(width, height);
+    }
+
+    template <typename Op>
+    float evalT(float x) const
+    {
+      if (functions.empty())
+        return 0.f;
+
+      float res = Op::identity();
+      size_t count = 0;
+      supportIndex().forEach(x, [&](uint32_t i) {
+        res = Op::apply(res, functions[i]->weight * functions[i]->eval(x));
+        ++count;
+      });
+      // the functions that were skipped are all 0 at x, and combining
+      // with 0 once is the same as combining with it several times
+      if (count < functions.size())
+        res = Op::apply(res, 0.f);
+      return Op::finalize(res);
+    }
+
+    // bake kernel; works on chunks of samples that fit in L1 and
+    // reduces the batch-evaluated functions into them in SIMD. Only the
+    // functions whose support overlaps the chunk are evaluated, and
+    // if the samples are sorted, only at the samples inside it. If rgb
+    // isn't nullptr, the functions' colors are combined in the same
+    // pass, see bakeRGBA()
+    template <typename Op>
+    void bakeT(const float *xs, float *alpha, vec3f *rgb, size_t n) const
+    {
+      if (functions.empty()) {
+        std::fill(alpha, alpha+n, 0.f);
+        return;
+      }
+
+      prepareFunctions();
+
+      enum { ChunkSize = 256 };
+      const bool over = std::is_same<Op, CombineOver>::value;
+      parallel::forEachRange(n, ChunkSize, [&](size_t first, size_t last) {
+        alignas(16) float ys[ChunkSize];
+        size_t count = last-first;
+        float *acc = alpha+first;
+        std::fill(acc, acc+count, Op::identity());
+
+        // alpha-weighted sum of linear colors, and the total weight
+        vec3f colorSum[ChunkSize];
+        float colorWeight[ChunkSize];
+        // the color map's colors (linear), where needed
+        vec3f mapColor[ChunkSize];
+        bool haveMapColor = false;
+        if (rgb) {
+          std::fill(colorSum, colorSum+count, vec3f(0.f));
+          std::fill(colorWeight, colorWeight+count, 0.f);
+        }
+
+        const float *x = xs+first;
+        box1f range = emptyRange();
+        for (size_t j=0; j<count; ++j) {
+          range.extend(x[j]);
+        }
+        bool sorted = std::is_sorted(x, x+count);
+        std::vector<uint32_t> candidates;
+        index.query(range, candidates);
+
+        // number of functions skipped at each sample, as differences
+        // of consecutive samples
+        int skipped[ChunkSize+1] = {};
+        skipped[0] = int(functions.size()-candidates.size());
+
+        for (uint32_t i : candidates) {
+          size_t a = 0, b = count;
+          if (sorted) {
+            box1f s = index.support(i);
+            a = std::lower_bound(x, x+count, s.lower)-x;
+            b = std::upper_bound(x+a, x+count, s.upper)-x;
+            ++skipped[0]; --skipped[a];
+            ++skipped[b]; --skipped[count];
+          }
+
+          const Function &func = *functions[i];
+          func.evalBatch(x+a, ys+a, b-a);
+          simd::float4 w = simd::splat(func.weight);
+          size_t j=a;
+          for (; j+4<=b; j+=4) {
+            simd::float4 y = w * simd::load(ys+j);
+            simd::store(acc+j, Op::apply(simd::load(acc+j), y));
+          }
+          for (; j<b; ++j) {
+            acc[j] = Op::apply(acc[j], func.weight * ys[j]);
+          }
+
+          if (!rgb)
+            continue;
+
+          const ColorMap *cm = func.color.get();
+          if (!cm && !haveMapColor) {
+            for (size_t k=0; k<count; ++k) {
+              mapColor[k] = colorMap ? colorMap->evalLinear(x[k]) : vec3f(1.f);
+            }
+            haveMapColor = true;
+          }
+          bool constant = cm && cm->numStops() == 1;
+          vec3f c = constant ? cm->evalLinear(0.f) : vec3f(0.f);
+          for (j=a; j<b; ++j) {
+            float aj = clamp(func.weight * ys[j], 0.f, 1.f);
+            if (aj <= 0.f)
+              continue;
+            vec3f cj = !cm ? mapColor[j] : (constant ? c : cm->evalLinear(x[j]));
+            if (over) {
+              colorSum[j] = vec3f(aj)*cj + vec3f(1.f-aj)*colorSum[j];
+              colorWeight[j] = aj + (1.f-aj)*colorWeight[j];
+            } else {
+              colorSum[j] = colorSum[j] + vec3f(aj)*cj;
+              colorWeight[j] += aj;
+            }
+          }
+        }
+
+        // see evalT()
+        int numSkipped = 0;
+        for (size_t j=0; j<count; ++j) {
+          numSkipped += skipped[j];
+          acc[j] = Op::finalize(numSkipped > 0 ? Op::apply(acc[j], 0.f) : acc[j]);
+        }
+
+        if (rgb) {
+          for (size_t j=0; j<count; ++j) {
+            if (colorWeight[j] > 0.f) {
+              vec3f c = colorSum[j]/vec3f(colorWeight[j]);
+              rgb[first+j] = vec3f(linearToSRGB(c.x), linearToSRGB(c.y), linearToSRGB(c.z));
+            } else {
+              rgb[first+j] = colorMap ? colorMap->eval(x[j]) : vec3f(1.f);
+            }
+          }
+        }
+      });
+    }
+
+    // bring lazily evaluated state of the functions up to date, so
+    // they can be evaluated from several threads
+    void prepareFunctions() const
+    {
+      for (size_t i=0; i<functions.size(); ++i) {
+        functions[i]->prepare();
+      }
+    }
+
+    // kept up to date eagerly by the mutators that change or reorder
+    // the function stack (and rebuilt by markDirty()), so const
+    // evaluation only ever reads it
+    const SupportIndex &supportIndex() const
+    {
+      return index;
+    }
+
+    // the support or the control points of func (which is usually on
+    // top) changed
+    void updateIndex(const Function::SP &func)
+    {
+      auto it = std::find(functions.rbegin(), functions.rend(), func);
+      if (it != functions.rend())
+        updateIndex(size_t(functions.rend()-it-1));
+    }
+
+    void updateIndex(size_t pos)
+    {
+      index.update(uint32_t(pos), functions[pos]->support());
+      handleIndex.update(uint32_t(pos), controlPointRange(*functions[pos]));
+    }
+
+    void rebuildIndex()
+    {
+      index.build(functions.size(), [&](size_t i) { return functions[i]->support(); });
+      handleIndex.build(functions.size(), [&](size_t i) { return controlPointRange(*functions[i]); });
+    }
+
+    // x-range spanned by the control points of func; empty if it has
+    // none
+    static box1f controlPointRange(const Function &func)
+    {
+      box1f res = emptyRange();
+      for (size_t i=0; i<func.numControlPoints(); ++i) {
+        res.extend(func.getControlPoint(i).x);
+      }
+      return res;
+    }
+
+    // record a change to the TF, see markDirty()
+    void markChanged(box1f range)
+    {
+      if (range.lower > range.upper)
+        return;
+
+      dirtyRange.extend(range.lower);
+      dirtyRange.extend(range.upper);
+
+      changeLog[version % ChangeLogSize] = range;
+      ++version;
+    }
+
+    void applyStrokeInput()
+    {
+      if (pointer.pressed) {
+        markChanged(drawTarget->beginStroke(pointer.pressPos));
+        stroking = true;
+      }
+
+      if (stroking && (pointer.pressed || pointer.moved))
+        markChanged(drawTarget->continueStroke(pointer.pos));
+      updateIndex(drawTarget);
+
+      if (pointer.released)
+        stroking = false;
+
+      pointer.pressed = pointer.moved = pointer.released = false;
+    }
+
+    /*! select the function (and control point) under pos and raise
+      it to the top; control points take precedence over the area
+      underneath the functions */
+    void pick(vec2f pos)
+    {
+      ptrdiff_t i = pickPosition(pos, activeControlPoint);
+      selected = i >= 0 ? functions[i] : nullptr;
+
+      // raised as part of the recorded pointer input, not on its own
+      if (i >= 0 && size_t(i)+1 != functions.size())
+        raise(functions.begin()+i);
+    }
+
+    // stack position of pickFunction(pos), or -1; only the functions
+    // with control points near pos.x are tested, through handleIndex
+    ptrdiff_t pickPosition(vec2f pos, int &controlPoint) const
+    {
+      std::vector<uint32_t> candidates;
+      handleIndex.query(box1f(pos.x-fabsf(pickRadius.x), pos.x+fabsf(pickRadius.x)), candidates);
+      for (auto it = candidates.rbegin(); it != candidates.rend(); ++it) {
+        const Function &func = *functions[*it];
+        for (size_t j=0; j<func.numControlPoints(); ++j) {
+          vec2f d = (func.getControlPoint(j)-pos) / pickRadius;
+          if (dot(d,d) <= 1.f) {
+            controlPoint = int(j);
+            return *it;
+          }
+        }
+      }
+
+      controlPoint = -1;
+      return selectPosition(pos);
+    }
+
+    // stack position of select(pos), or -1
+    ptrdiff_t selectPosition(vec2f pos) const
+    {
+      ptrdiff_t res = -1;
+      supportIndex().forEach(pos.x, [&](uint32_t i) {
+        if (pos.y < functions[i]->eval(pos.x)) res = i;
+      });
+      return res;
+    }
+
+    void raise(std::vector<Function::SP>::iterator it)
+    {
+      Function::SP func = *it;
+      size_t pos = it-functions.begin();
+      std::rotate(it, it+1, functions.end());
+      std::rotate(handles.begin()+pos, handles.begin()+pos+1, handles.end());
+      updatePositions(pos);
+      index.moveToTop(uint32_t(pos));
+      handleIndex.moveToTop(uint32_t(pos));
+      markChanged(func->support());
+    }
+
+    void removeAt(size_t pos)
+    {
+      Function::SP func = functions[pos];
+      recordIndexEvent(TraceEvent::RemoveFunction, pos);
+      markChanged(func->support());
+      functions.erase(functions.begin()+pos);
+      stackPositions.erase(handles[pos]);
+      handles.erase(handles.begin()+pos);
+      updatePositions(pos);
+      index.remove(uint32_t(pos));
+      handleIndex.remove(uint32_t(pos));
+
+      if (selected == func) {
+        selected = nullptr;
+        activeControlPoint = -1;
+      }
+      if (drawTarget == func) {
+        drawTarget = nullptr;
+        stroking = false;
+      }
+    }
+
+    // stack position of the function h refers to, or -1 if h is stale
+    ptrdiff_t stackPosition(FunctionHandle h) const
+    {
+      const uint32_t *pos = stackPositions.get(h);
+      return pos ? ptrdiff_t(*pos) : -1;
+    }
+
+    // the functions from stack position first on moved; store their
+    // new positions with their handles
+    void updatePositions(size_t first)
+    {
+      for (size_t i=first; i<handles.size(); ++i)
+        *stackPositions.get(handles[i]) = uint32_t(i);
+    }
+
+    void recordIndexEvent(TraceEvent::Type type, ptrdiff_t index)
+    {
+      if (!trace)
+        return;
+      TraceEvent e;
+      e.type = type;
+      e.index = uint32_t(index);
+      trace->record(e);
+    }
+
+    void recordEvent(TraceEvent::Type type, uint32_t index, float value,
+                     const std::vector<uint8_t> &payload)
+    {
+      TraceEvent e;
+      e.type = type;
+      e.index = index;
+      e.pos = vec2f(value, 0.f);
+      e.function = payload;
+      trace->record(e);
+    }
+
+    // serialized color map or domain mapping; empty for nullptr
+    template <typename T>
+    static std::vector<uint8_t> serialized(const std::shared_ptr<T> &obj)
+    {
+      StateWriter out;
+      if (obj)
+        obj->serialize(out);
+      return out.bytes;
+    }
+
+    // position of the (topmost) func on the stack, or -1
+    ptrdiff_t stackIndex(const Function::SP &func) const
+    {
+      auto it = std::find(functions.rbegin(), functions.rend(), func);
+      return it != functions.rend() ? functions.rend()-it-1 : -1;
+    }
+
+    // composite background, functions (back to front) and outline
+    // for the columns [x0,x1)
+    void rasterizeColumns(Texture &tex, const Texture &bg, unsigned x0, unsigned x1) const
+    {
+      prepareFunctions();
+
+      enum { ChunkSize = 32 };
+      parallel::forEachRange(x1-x0, ChunkSize, [&](size_t first, size_t last) {
+        rasterizeColumnsSerial(tex, bg, x0+unsigned(first), x0+unsigned(last));
+      });
+    }
+
+    void rasterizeColumnsSerial(Texture &tex, const Texture &bg, unsigned x0, unsigned x1) const
+    {
+      for (unsigned y=0; y<tex.height; ++y) {
+        uint32_t *row = tex.row(y);
+        if (bg.data.empty())
+          std::fill(row+x0, row+x1, 0u);
+        else
+          std::copy(bg.row(y)+x0, bg.row(y)+x1, row+x0);
+      }
+
+      for (unsigned x=x0; x<x1; ++x) {
+        float xf = x/float(tex.width-1);
+        index.forEach(xf, [&](uint32_t i) {
+          functions[i]->rasterizeColumn(tex, x);
+        });
+
+        if (showOutline) {
+          float yf = eval(xf);
+          if (yf > 0.f) {
+            unsigned y = std::min(unsigned(yf * tex.height), tex.height-1);
+            tex.set(x,y,cvt_uint32(vec4f(1.f,0.5f,0.f,1.f)));
+          }
+        }
+      }
     }
 
-    PiecewiseLinear(const vec2f *CPs, unsigned numCPs) : controlPoints(numCPs)
-    {
-      std::copy(CPs, CPs+numCPs, controlPoints.begin());
-      std::sort(controlPoints.begin(), controlPoints.end(),
-        [](vec2f a, vec2f b) { return a.x<b.x; });
-    }
+    // Constant background; always the bottom layer
+    Layer::SP background{nullptr};
 
-    float eval(float x) const
-    {
-      if (controlPoints.size() < 2 || x < valueRange.lower || x > valueRange.upper)
-        return 0.f;
+    // Render outline of the convoluted alpha functions
+    bool showOutline{true};
 
-      for (size_t i=0; i<controlPoints.size()-1; ++i) {
-        vec2f p1 = controlPoints[i];
-        vec2f p2 = controlPoints[i+1];
-        if (p1.x > x || p2.x < x)
-          continue;
+    // How the functions' alpha values are combined
+    CombineOp combineOp{CombineOp::Max};
 
+    // Currently selected function, and control point being dragged
+    Function::SP selected{nullptr};
+    int activeControlPoint{-1};
 
-        float m = (p2.y-p1.y)/(p2.x-p1.x);
-        float xf = x - p1.x;
-        return p1.y + m * xf;
-      }
+    // Free-hand function that strokes are drawn into (if any)
+    FreeHand::SP drawTarget{nullptr};
+    bool stroking{false};
 
-      return 0.f;
-    }
+    // Coalesced pointer state since the last applyPointerInput()
+    PointerState pointer;
+    vec2f pickRadius{0.02f, 0.04f};
 
-   private:
-    std::vector<vec2f> controlPoints;
-  };
+    // active control point minus the pointer position it was grabbed at
+    vec2f grabOffset{0.f};
 
-  class Tent : public Function
-  {
-   public:
-    Tent() : tipPos({0.5f,1.f}), topWidth(0.f), bottomWidth(1.f)
-    { initInternal(); }
+    // Colors assigned to the functions' domain when baking RGBA
+    ColorMap::SP colorMap{nullptr};
 
-    Tent(vec2f tip, float tw, float bw) : tipPos(tip), topWidth(tw), bottomWidth(bw)
-    { initInternal(); }
+    // Maps data values to the x axis; linear if nullptr
+    DomainMapping::SP mapping{nullptr};
 
-    float eval(float x) const
-    {
-      return internal.eval(x);
-    }
+    enum : uint32_t { StateMagic = 0x53454654, StateVersion = 2 }; // "TFES"
 
-   private:
-    void initInternal()
-    {
-      std::vector<vec2f> CPs(4);
-      CPs[0]=vec2f(tipPos.x-bottomWidth/2.f,0.f);
-      CPs[1]=vec2f(tipPos.x-topWidth/2.0f,tipPos.y);
-      CPs[2]=vec2f(tipPos.x+topWidth/2.0f,tipPos.y);
-      CPs[3]=vec2f(tipPos.x+bottomWidth/2.f,0.f);
-      internal = PiecewiseLinear(CPs.data(), CPs.size());
-      internal.valueRange = valueRange;
-    }
+    // Interactions are recorded into this trace, if set
+    InteractionTrace *trace{nullptr};
 
-    vec2f tipPos;
-    float topWidth, bottomWidth;
-    PiecewiseLinear internal;
-  };
+    // Handles of the functions (in stack order, reordered along with
+    // the stack), and the stack position each handle refers to
+    std::vector<FunctionHandle> handles;
+    SlotMap<uint32_t> stackPositions;
 
-  class Box : public Function
-  {
-  };
+    // Supports of the functions, and the x-ranges of their control
+    // points for picking; updated in place when a function is edited,
+    // raised or removed, and rebuilt by markDirty() and deserialize()
+    SupportIndex index;
+    SupportIndex handleIndex;
 
-  class Gaussian : public Function
-  {
-  };
+    // Recent changes, see changedSince()
+    enum { ChangeLogSize = 64 };
+    box1f changeLog[ChangeLogSize];
+    uint64_t version{0};
 
-  class ColorMap : public Function
-  {
+    // Cached rasterization for updateTexture()
+    Texture cached, cachedBackground;
+    box1f dirtyRange{emptyRange()};
+    vec2ui updatedColumns{0u, 0u};
   };
 
-  // Checkers texture (use as background!)
-  class Checkers : public Layer
+  /*! pre-filtered RGBA TF: a summed-area table (prefix integrals) of
+    the baked TF, so that the average of the TF over any interval
+    [a,b] can be looked up in O(1), e.g., to classify coarse LOD
+    levels whose voxels each cover a range of values. The table
+    stores opacity-weighted linear colors (averaging sRGB encoded
+    values would darken the result), so averages and samples are
+    premultiplied linear RGBA, ready for compositing. update() only
+    re-bakes the samples that changed since the last update */
+  class PrefilteredTF
   {
    public:
-    Checkers(unsigned cs = 8, vec3f c1 = {0.f, 0.f, 0.f}, vec3f c2 = {1.f, 1.f, 1.f})
-        : checkerSize(cs), color1(c1), color2(c2)
+    PrefilteredTF(unsigned numSamples = 1024)
+      : samples(std::max(numSamples, 2u)), prefix(samples.size())
     {}
 
-    Texture rasterize(unsigned width, unsigned height) const
+    /*! bring the table up to date with the editor's TF */
+    void update(const TFEditor &editor)
     {
-      Texture tex(width, height);
-      vec4f colors[2] = {
-        {color1.x,color1.y,color1.z,1.f},
-        {color2.x,color2.y,color2.z,1.f},
-      };
-      for (unsigned y=0; y<height; ++y) {
-        for (unsigned x=0; x<width; ++x) {
-          unsigned xx = x/checkerSize;
-          unsigned yy = y/checkerSize;
-          int idx = (xx % 2) == (yy % 2) ? 0 : 1;
-          tex.set(x,y,cvt_uint32(colors[idx]));
+      unsigned n = unsigned(samples.size());
+      unsigned first = 0, last = n;
+      if (valid) {
+        vec2ui changed = editor.changedLUTEntries(version, n);
+        if (changed.x == changed.y)
+          return;
+        first = changed.x;
+        last = changed.y;
+      }
+
+      std::vector<vec4f> rgba(last-first);
+      editor.bakeLUT(n, first, last, rgba.data());
+      for (unsigned i=first; i<last; ++i) {
+        vec4f c = rgba[i-first];
+        samples[i] = vec4f(srgbToLinear(c.x)*c.w, srgbToLinear(c.y)*c.w,
+                           srgbToLinear(c.z)*c.w, c.w);
+      }
+
+      // everything right of the first changed sample integrates over
+      // it; prefix[i] is the integral from 0 to x_i (trapezoidal)
+      double h = 1.0/(n-1);
+      if (first == 0) {
+        prefix[0] = Sum();
+        first = 1;
+      }
+      for (unsigned i=first; i<n; ++i) {
+        for (int c=0; c<4; ++c) {
+          prefix[i].v[c] = prefix[i-1].v[c] + 0.5*h*(samples[i-1][c] + samples[i][c]);
         }
       }
-      return tex;
-    }
 
-   private:
-    unsigned checkerSize;
-    vec3f color1, color2;
-  };
+      version = editor.getVersion();
+      valid = true;
+    }
 
-  class TFEditor
-  {
-   public:
-    virtual void addFunction(const Function::SP &func)
+    /*! average (premultiplied linear) RGBA over [a,b]; like sample(), the TF
+      is extended by its edge values outside of [0:1] */
+    vec4f average(float a, float b) const
     {
-      functions.push_back(func);
+      if (b < a)
+        std::swap(a, b);
+
+      if (b-a < 1e-6f)
+        return sample(a);
+
+      Sum ia = integral(a), ib = integral(b);
+      double scale = 1.0/(double(b)-double(a));
+      return vec4f(float((ib.v[0]-ia.v[0])*scale), float((ib.v[1]-ia.v[1])*scale),
+                   float((ib.v[2]-ia.v[2])*scale), float((ib.v[3]-ia.v[3])*scale));
     }
 
-    virtual void setBackground(const Layer::SP &bg)
+    /*! (premultiplied linear) RGBA at x */
+    vec4f sample(float x) const
     {
-      background = bg;
+      unsigned i;
+      float t;
+      locate(x, i, t);
+      vec4f c0 = samples[i], c1 = samples[i+1];
+      return c0 + vec4f(t)*(c1-c0);
     }
 
-    /*! search through the function list; if the function is
-      present, make sure it is drawn on top of all the others */
-    virtual void moveToTop(const Function::SP &func)
+   private:
+    struct Sum
     {
-      // TODO...!
-    }
+      double v[4] = {0.0, 0.0, 0.0, 0.0};
+    };
 
-    /*! return the function underneath the (e.g., mouse) pos
-      that is topmost on the function stack */
-    Function::SP select(vec2f pos) const
+    void locate(float x, unsigned &i, float &t) const
     {
-      for (ptrdiff_t i=functions.size()-1; i>=0; --i) {
-        float y = functions[i]->eval(pos.x);
-        if (pos.y < y) return functions[i];
-      }
-      return nullptr;
+      float xf = clamp(x, 0.f, 1.f) * (samples.size()-1);
+      i = std::min(unsigned(xf), unsigned(samples.size()-2));
+      t = xf-i;
     }
 
-    Texture rasterize(unsigned width, unsigned height) const
+    // integral from 0 to x; the TF is linear between samples, and
+    // constant outside of [0:1]
+    Sum integral(float x) const
     {
-      Texture tex(width, height);
-
-      for (size_t i=0; i<functions.size(); ++i) {
-        Texture layer = functions[i]->rasterize(width, height);
-        layerOver(layer,tex);
+      Sum res;
+      if (x < 0.f || x > 1.f) {
+        size_t i = x < 0.f ? 0 : samples.size()-1;
+        double d = x < 0.f ? double(x) : double(x)-1.0;
+        if (i > 0) res = prefix[i];
+        for (int c=0; c<4; ++c) {
+          res.v[c] += d*samples[i][c];
+        }
+        return res;
       }
 
-      if (background) {
-        tex = layerOver(background->rasterize(width, height), tex);
+      unsigned i;
+      float t;
+      locate(x, i, t);
+      double h = 1.0/(samples.size()-1);
+      res = prefix[i];
+      for (int c=0; c<4; ++c) {
+        double f0 = samples[i][c], f1 = samples[i+1][c];
+        double ft = f0 + t*(f1-f0);
+        res.v[c] += 0.5*t*h*(f0+ft);
       }
+      return res;
+    }
 
-      if (showOutline) {
-        for (unsigned x=0; x<width; ++x) {
-          float xf = x/float(width-1);
-          float yf = eval(xf);
-          if (yf > 0.f) {
-            unsigned y = yf * height;
-            tex.set(x,y,cvt_uint32(vec4f(1.f,0.5f,0.f,1.f)));
-          }
-        }
-      }
+    std::vector<vec4f> samples;
+    std::vector<Sum> prefix;
+    uint64_t version{0};
+    bool valid{false};
+  };
 
-      return tex;
-    }
+  /*! color space two TFs' colors are blended in */
+  enum class BlendSpace
+  {
+    SRGB,  // blend the (sRGB encoded) colors directly
+    Oklab, // perceptually uniform, avoids muddy in-between colors
+  };
 
-    vec3f *getRGB(unsigned numSamples) const
+  /*! morph between two TFs, e.g., two presets: both are baked once
+    (and re-baked by update() only where they changed), so that each
+    blend() is a single vectorized pass over the tables, independent
+    of the number and type of functions */
+  class TFMorph
+  {
+   public:
+    TFMorph(unsigned numSamples = 256, BlendSpace space = BlendSpace::SRGB)
+      : space(space)
     {
+      for (int i=0; i<2; ++i) tables[i].table.resize(std::max(numSamples, 2u));
     }
 
-    float *getAlpha(unsigned numSamples) const
+    /*! bring the baked tables up to date with the two TFs */
+    void update(const TFEditor &from, const TFEditor &to)
     {
+      tables[0].update(from, space);
+      tables[1].update(to, space);
     }
 
-    float eval(float x) const
+    /*! RGBA of the TF in between from (t=0) and to (t=1), sampled at
+      numSamples equidistant positions in [0:1]; colors blended in
+      Oklab are encoded back through the sRGB tables, i.e., come out
+      rounded to 8-bit sRGB steps */
+    void blend(float t, vec4f *rgba) const
     {
-      float res = 0.f;
-      for (size_t i=0; i<functions.size(); ++i) {
-        float y = functions[i]->eval(x);
-        res = fmaxf(res,y);
+      size_t n = tables[0].table.size();
+      const vec4f *a = tables[0].table.data(), *b = tables[1].table.data();
+      simd::float4 t4 = simd::splat(t);
+      for (size_t i=0; i<n; ++i) {
+        simd::float4 a4 = simd::load(&a[i].x), b4 = simd::load(&b[i].x);
+        simd::store(&rgba[i].x, a4 + t4*(b4-a4));
+      }
+
+      if (space != BlendSpace::Oklab)
+        return;
+
+      const float inv255 = 1.f/255.f;
+      for (size_t i=0; i<n; ++i) {
+        vec3f c = oklabToLinear(vec3f(rgba[i].x, rgba[i].y, rgba[i].z));
+        rgba[i] = vec4f(linearToSRGB8(c.x)*inv255, linearToSRGB8(c.y)*inv255,
+                        linearToSRGB8(c.z)*inv255, rgba[i].w);
       }
-      return res;
+    }
+
+    std::vector<vec4f> blend(float t) const
+    {
+      std::vector<vec4f> rgba(tables[0].table.size());
+      blend(t, rgba.data());
+      return rgba;
     }
 
    private:
-    Texture& layerOver(const Texture &A, Texture &B) const
+    struct Table
     {
-      for (size_t y=0; y<A.height; ++y) {
-        for (size_t x=0; x<A.width; ++x) {
-          vec4f dst = cvt_rgba32f(A.get(x,y));
-          vec4f src = cvt_rgba32f(B.get(x,y));
-          dst = over(src,dst);
-          B.set(x,y,cvt_uint32(dst));
+      // RGBA, with the colors in the blend space
+      std::vector<vec4f> table;
+      const TFEditor *editor{nullptr};
+      uint64_t version{0};
+
+      void update(const TFEditor &ed, BlendSpace space)
+      {
+        unsigned n = unsigned(table.size());
+        unsigned first = 0, last = n;
+        if (editor == &ed) {
+          vec2ui changed = ed.changedLUTEntries(version, n);
+          if (changed.x == changed.y)
+            return;
+          first = changed.x;
+          last = changed.y;
         }
-      }
-      return B;
-    }
 
-    // Constant background; always the bottom layer
-    Layer::SP background{nullptr};
+        ed.bakeLUT(n, first, last, table.data()+first);
+        if (space == BlendSpace::Oklab) {
+          for (unsigned i=first; i<last; ++i) {
+            vec4f c = table[i];
+            vec3f lin(srgbToLinear(c.x), srgbToLinear(c.y), srgbToLinear(c.z));
+            table[i] = vec4f(linearToOklab(lin), c.w);
+          }
+        }
 
-    // Variable transfer functions layered on top of each other
-    std::vector<Function::SP> functions;
+        editor = &ed;
+        version = ed.getVersion();
+      }
+    };
 
-    // Render outline of the convoluted alpha functions
-    bool showOutline{true};
+    BlendSpace space;
+    Table tables[2];
   };
 
 #ifdef TFE_ENABLE_OPENGL
   class TFEditorOpenGL : public  TFEditor
   {
-   public:
-    virtual void addFunction(const Function::SP &func)
-    { updated = true; TFEditor::addFunction(func); }
-
-    virtual void setBackground(const Layer::SP &bg)
-    { updated = true; TFEditor::setBackground(bg); }
-
-    /*! search through the function list; if the function is
-      present, make sure it is drawn on top of all the others */
-    virtual void moveToTop(const Function::SP &func)
-    { updated = true; TFEditor::moveToTop(func); }
-
    protected:
-    // renders the alpha functions and background
+    // renders the alpha functions and background; only the columns
+    // that changed since the last call are rastered and uploaded
     void setupTFETexture(unsigned width, unsigned height)
     {
       if (tfeTexture == 0)
@@ -380,20 +5223,37 @@ namespace tfe {
       glGetIntegerv(GL_TEXTURE_BINDING_2D, &prevTexture);
       glBindTexture(GL_TEXTURE_2D, tfeTexture);
 
-      Texture tex = TFEditor::rasterize(width, height);
+      const Texture &tex = TFEditor::updateTexture(width, height);
+      vec2ui cols = TFEditor::getUpdatedColumns();
 
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
       glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-      glTexImage2D(GL_TEXTURE_2D,
-          0,
-          GL_RGBA8,
-          tex.width,
-          tex.height,
-          0,
-          GL_RGBA,
-          GL_UNSIGNED_BYTE,
-          tex.data.data());
+      if (cols == vec2ui(0, tex.width)) {
+        glTexImage2D(GL_TEXTURE_2D,
+            0,
+            GL_RGBA8,
+            tex.width,
+            tex.height,
+            0,
+            GL_RGBA,
+            GL_UNSIGNED_BYTE,
+            tex.data.data());
+      } else if (cols.x < cols.y) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, tex.width);
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, cols.x);
+        glTexSubImage2D(GL_TEXTURE_2D,
+            0,
+            cols.x,
+            0,
+            cols.y-cols.x,
+            tex.height,
+            GL_RGBA,
+            GL_UNSIGNED_BYTE,
+            tex.data.data());
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+      }
 
       // restore
       glBindTexture(GL_TEXTURE_2D, prevTexture);
@@ -402,11 +5262,60 @@ namespace tfe {
     // renders the TFE texture plus UI elements
     void setupTexture(unsigned width, unsigned height)
     {
-      if (!updated && width == prevWidth && height == prevHeight)
+      bool resized = width != prevWidth || height != prevHeight;
+      if (!resized && !TFEditor::isDirty())
         return;
 
-      // setup framebuffer and renderbuffer
+      if (resized)
+        allocateFramebuffer(width, height);
+
+      GLint prevTexture;
+      glGetIntegerv(GL_TEXTURE_BINDING_2D, &prevTexture);
+
+      // render to framebuffer texture:
+      glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    #if 1
+      glViewport(0, 0, width, height);
+
+      glMatrixMode(GL_PROJECTION);
+      glLoadIdentity();
+      glOrtho(0.0, width, 0.0, height, -1.0, 1.0);
+
+      // resolution of the background texture;
+      // can be different from widget's size
+      unsigned resX = width-2*margin;
+      unsigned resY = height-2*margin;
+
+      setupTFETexture(resX, resY);
+      glBindTexture(GL_TEXTURE_2D, tfeTexture);
+      glBegin(GL_QUADS);
+
+      glTexCoord2f(0.f, 0.f);
+      glVertex2f(margin, margin);
+
+      glTexCoord2f(0.f, 1.f);
+      glVertex2f(margin, height-margin);
+
+      glTexCoord2f(1.f, 1.f);
+      glVertex2f(width-margin, height-margin);
+
+      glTexCoord2f(1.f, 0.f);
+      glVertex2f(width-margin, margin);
+
+      glEnd();
+    #endif
+
+      // restore
+      glBindTexture(GL_TEXTURE_2D, prevTexture);
+      glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+      prevWidth = width;
+      prevHeight = height;
+    }
 
+    // (re-)allocates framebuffer, color texture and depth buffer
+    void allocateFramebuffer(unsigned width, unsigned height)
+    {
       if (framebuffer == 0)
         glGenFramebuffers(1, &framebuffer);
 
@@ -456,58 +5365,21 @@ namespace tfe {
 
       GLenum drawBuffers[1] = {GL_COLOR_ATTACHMENT0};
       glDrawBuffers(1, drawBuffers);
-      if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-        return;
-
-      // render to framebuffer texture:
-      glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-    #if 1
-      glViewport(0, 0, width, height);
-
-      glMatrixMode(GL_PROJECTION);
-      glLoadIdentity();
-      glOrtho(0.0, width, 0.0, height, -1.0, 1.0);
-
-      unsigned margin=8;
-      // resolution of the background texture;
-      // can be different from widget's size
-      unsigned resX = width-2*margin;
-      unsigned resY = height-2*margin;
-
-      setupTFETexture(resX, resY);
-      glBindTexture(GL_TEXTURE_2D, tfeTexture);
-      glBegin(GL_QUADS);
-
-      glTexCoord2f(0.f, 0.f);
-      glVertex2f(margin, margin);
-
-      glTexCoord2f(0.f, 1.f);
-      glVertex2f(margin, height-margin);
-
-      glTexCoord2f(1.f, 1.f);
-      glVertex2f(width-margin, height-margin);
-
-      glTexCoord2f(1.f, 0.f);
-      glVertex2f(width-margin, margin);
-
-      glEnd();
-    #endif
 
       // restore
       glBindTexture(GL_TEXTURE_2D, prevTexture);
+      glBindRenderbuffer(GL_RENDERBUFFER, prevDepthbuffer);
       glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-      prevWidth = width;
-      prevHeight = height;
     }
 
-    bool updated{true};
     unsigned prevWidth = 0, prevHeight = 0;
+    // border around the TFE texture, in pixels
+    unsigned margin{8};
     // texture containing functions + ui elements
     GLuint texture{0};
    private:
     // texture that the functions are rastered into
-    GLuint tfeTexture{~0u};
+    GLuint tfeTexture{0};
     // framebuffer for render-to-texture
     GLuint framebuffer{0};
     GLuint depthbuffer{0};
@@ -520,17 +5392,24 @@ namespace tfe {
    public:
     void draw(unsigned width, unsigned height)
     {
+      // the widget's origin is known before the widget is submitted,
+      // so input gets applied before rasterization and edits show up
+      // in the same frame
+      ImVec2 origin = ImGui::GetCursorScreenPos();
+      handleInput(origin, width, height);
+
       setupTexture(width, height);
 
       ImGui::GetWindowDrawList()->AddCallback(
         [](const ImDrawList *, const ImDrawCmd *)
         { glDisable(GL_BLEND); }, nullptr);
 
+      // the framebuffer is y-up, ImGui's origin is the top left
       ImGui::ImageButton(
           (void*)(intptr_t)texture,
           ImVec2(width, height),
-          ImVec2(0, 0),
-          ImVec2(1, 1),
+          ImVec2(0, 1),
+          ImVec2(1, 0),
           0 // frame size = 0
           );
 
@@ -538,7 +5417,68 @@ namespace tfe {
         [](const ImDrawList *, const ImDrawCmd *)
         { glEnable(GL_BLEND); }, nullptr);
 
+      drawControlPoints(origin, width, height);
+    }
+
+   private:
+    // ImGui samples the mouse once per frame, so all pointer events
+    // that happened since the last frame are already coalesced here
+    void handleInput(ImVec2 origin, unsigned width, unsigned height)
+    {
+      ImGuiIO &io = ImGui::GetIO();
+      vec2f res(float(width-2*margin), float(height-2*margin));
+      vec2f pos((io.MousePos.x-origin.x-margin)/res.x,
+                1.f-(io.MousePos.y-origin.y-margin)/res.y);
+
+      bool hovered = ImGui::IsWindowHovered()
+          && io.MousePos.x >= origin.x && io.MousePos.x < origin.x+width
+          && io.MousePos.y >= origin.y && io.MousePos.y < origin.y+height;
+
+      setPickRadius(vec2f(pickRadiusInPixels)/res);
+
+      if (hovered && ImGui::IsMouseClicked(ImGuiMouseButton_Left))
+        pointerDown(pos);
+      else if (io.MouseDelta.x != 0.f || io.MouseDelta.y != 0.f)
+        pointerMove(pos);
+
+      if (ImGui::IsMouseReleased(ImGuiMouseButton_Left))
+        pointerUp();
+
+      // right click deletes the function under the pointer; it
+      // doesn't go through the pointer state, so a left drag or a
+      // stroke in progress is left alone
+      if (hovered && ImGui::IsMouseClicked(ImGuiMouseButton_Right)) {
+        if (Function::SP func = pickFunction(pos))
+          removeFunction(func);
+      }
+
+      applyPointerInput();
+
+      if (hovered && ImGui::IsKeyPressed(ImGuiKey_Delete, false))
+        deleteSelected();
+    }
+
+    // control point handles of the selected function are drawn
+    // with ImGui so they don't invalidate the rasterized texture
+    void drawControlPoints(ImVec2 origin, unsigned width, unsigned height)
+    {
+      Function::SP func = getSelected();
+      if (!func)
+        return;
+
+      ImDrawList *drawList = ImGui::GetWindowDrawList();
+      vec2f res(float(width-2*margin), float(height-2*margin));
+      float r = pickRadiusInPixels*0.5f;
+      for (size_t i=0; i<func->numControlPoints(); ++i) {
+        vec2f cp = func->getControlPoint(i);
+        ImVec2 p(origin.x+margin+cp.x*res.x, origin.y+margin+(1.f-cp.y)*res.y);
+        ImU32 col = int(i) == getActiveControlPoint()
+            ? IM_COL32(255,128,0,255) : IM_COL32(32,32,32,255);
+        drawList->AddRectFilled(ImVec2(p.x-r,p.y-r), ImVec2(p.x+r,p.y+r), col);
+      }
     }
+
+    float pickRadiusInPixels{6.f};
   };
 #endif
 } // tfe
@@ -0,0 +1,252 @@
+#pragma once
+
+/*! @file
+  @brief Keyframed TF animation
+
+  A keyframe is a snapshot of the editor's parameters (control
+  points and weights of all functions, and the color map) at a point
+  in time, together with its baked RGBA LUT. Between two keyframes
+  whose function stacks have the same topology (same functions, same
+  number of control points and color stops), the parameters are
+  interpolated and the editor is posed accordingly; the LUT is then
+  only re-baked over the x-range the pose changed, using the editor's
+  change log. Between keyframes with different topologies, the two
+  keyframes' LUTs are blended instead. Baked frames are kept in a
+  bounded LRU cache, so re-rendering (or scrubbing back and forth)
+  doesn't bake again.
+ */
+
+#include <list>
+#include <map>
+#include "TFEditor.h"
+
+namespace tfe {
+
+  class TFAnimation
+  {
+   public:
+    /*! animate the editor's TF; bake() poses the editor, i.e., it
+      changes the parameters of the editor's functions */
+    TFAnimation(TFEditor &editor, unsigned lutSize = 256, size_t cacheSize = 256)
+      : editor(editor), lutSize(std::max(lutSize, 2u)), cacheSize(std::max(cacheSize, size_t(1)))
+    {}
+
+    /*! snapshot the editor's current state as keyframe at time; a
+      keyframe already at that time is replaced */
+    void addKeyframe(float time)
+    {
+      Keyframe key;
+      key.time = time;
+      key.functions = editor.getFunctions();
+      for (auto &f : key.functions) {
+        std::vector<vec2f> cps(f->numControlPoints());
+        for (size_t i=0; i<cps.size(); ++i) cps[i] = f->getControlPoint(i);
+        key.controlPoints.push_back(cps);
+        key.weights.push_back(f->weight);
+      }
+      key.colorMap = editor.getColorMap();
+      key.lut = editor.getRGBA(lutSize);
+
+      auto it = std::lower_bound(keyframes.begin(), keyframes.end(), time,
+        [](const Keyframe &k, float t) { return k.time < t; });
+      if (it != keyframes.end() && it->time == time)
+        *it = key;
+      else
+        keyframes.insert(it, key);
+      clearCache();
+    }
+
+    void removeKeyframe(size_t i)
+    {
+      if (i >= keyframes.size())
+        return;
+      keyframes.erase(keyframes.begin()+i);
+      clearCache();
+    }
+
+    size_t numKeyframes() const
+    {
+      return keyframes.size();
+    }
+
+    float getKeyframeTime(size_t i) const
+    {
+      return keyframes[i].time;
+    }
+
+    /*! the RGBA LUT (lutSize entries over [0:1]) at time; before the
+      first and after the last keyframe, the TF is held constant. The
+      returned reference is valid until the next call */
+    const std::vector<vec4f> &bake(float time)
+    {
+      auto it = cache.find(time);
+      if (it != cache.end()) {
+        lru.splice(lru.begin(), lru, it->second.lruPos);
+        return it->second.lut;
+      }
+
+      std::vector<vec4f> lut;
+      if (keyframes.empty()) {
+        lut = editor.getRGBA(lutSize);
+      } else if (time <= keyframes.front().time) {
+        lut = keyframes.front().lut;
+      } else if (time >= keyframes.back().time) {
+        lut = keyframes.back().lut;
+      } else {
+        size_t k = std::upper_bound(keyframes.begin(), keyframes.end(), time,
+          [](float t, const Keyframe &k) { return t < k.time; }) - keyframes.begin() - 1;
+        const Keyframe &k0 = keyframes[k], &k1 = keyframes[k+1];
+        float t = (time-k0.time)/(k1.time-k0.time);
+        if (sameTopology(k0, k1)) {
+          pose(k0, k1, t);
+          lut = updateWorkingLUT();
+        } else {
+          lut.resize(lutSize);
+          lerpBatch(&k0.lut[0].x, &k1.lut[0].x, t, &lut[0].x, 4*size_t(lutSize));
+        }
+      }
+
+      if (cache.size() >= cacheSize) {
+        cache.erase(lru.back());
+        lru.pop_back();
+      }
+      lru.push_front(time);
+      CacheEntry &entry = cache[time];
+      entry.lut.swap(lut);
+      entry.lruPos = lru.begin();
+      return entry.lut;
+    }
+
+    /*! convenience for rendering at a fixed frame rate */
+    const std::vector<vec4f> &bakeFrame(unsigned frame, float framesPerSecond)
+    {
+      return bake(frame/framesPerSecond);
+    }
+
+    /*! drop all cached frames, e.g., after the functions were changed
+      outside of the animation */
+    void clearCache()
+    {
+      cache.clear();
+      lru.clear();
+    }
+
+   private:
+    struct Keyframe
+    {
+      float time;
+      std::vector<Function::SP> functions;
+      std::vector<std::vector<vec2f>> controlPoints;
+      std::vector<float> weights;
+      ColorMap::SP colorMap;
+      std::vector<vec4f> lut;
+    };
+
+    struct CacheEntry
+    {
+      std::vector<vec4f> lut;
+      std::list<float>::iterator lruPos;
+    };
+
+    static size_t numStops(const ColorMap::SP &cm)
+    {
+      return cm ? cm->numStops() : 0;
+    }
+
+    static bool sameTopology(const Keyframe &a, const Keyframe &b)
+    {
+      if (a.functions != b.functions || numStops(a.colorMap) != numStops(b.colorMap))
+        return false;
+      for (size_t i=0; i<a.controlPoints.size(); ++i) {
+        if (a.controlPoints[i].size() != b.controlPoints[i].size())
+          return false;
+      }
+      return true;
+    }
+
+    // set the editor's parameters to the interpolation of k0 and k1;
+    // parameters that don't change leave the editor untouched, so the
+    // dirty range only covers what actually moved
+    void pose(const Keyframe &k0, const Keyframe &k1, float t)
+    {
+      if (editor.getFunctions() != k0.functions) {
+        std::vector<Function::SP> current = editor.getFunctions();
+        for (auto &f : current) editor.removeFunction(f);
+        for (auto &f : k0.functions) editor.addFunction(f);
+      }
+
+      for (size_t i=0; i<k0.functions.size(); ++i) {
+        const Function::SP &f = k0.functions[i];
+        // all control points at once, as constraints between them
+        // (e.g., a tent's top no wider than its bottom) must hold for
+        // the interpolated values, not against the previous pose
+        size_t n = k0.controlPoints[i].size();
+        std::vector<vec2f> cps(n);
+        bool moved = false;
+        for (size_t j=0; j<n; ++j) {
+          vec2f a = k0.controlPoints[i][j], b = k1.controlPoints[i][j];
+          cps[j] = vec2f(a.x + t*(b.x-a.x), a.y + t*(b.y-a.y));
+          vec2f cur = f->getControlPoint(j);
+          moved |= cps[j].x != cur.x || cps[j].y != cur.y;
+        }
+        if (moved)
+          editor.setControlPoints(f, cps.data(), n);
+        float w = k0.weights[i] + t*(k1.weights[i]-k0.weights[i]);
+        if (w != f->weight)
+          editor.setWeight(f, w);
+      }
+
+      if (k0.colorMap == k1.colorMap) {
+        if (editor.getColorMap() != k0.colorMap)
+          editor.setColorMap(k0.colorMap);
+      } else {
+        size_t n = numStops(k0.colorMap);
+        std::vector<float> pos(n);
+        std::vector<vec3f> cols(n);
+        for (size_t i=0; i<n; ++i) {
+          float p0 = k0.colorMap->getPosition(i), p1 = k1.colorMap->getPosition(i);
+          vec3f c0 = k0.colorMap->getColor(i), c1 = k1.colorMap->getColor(i);
+          pos[i] = p0 + t*(p1-p0);
+          cols[i] = c0 + vec3f(t)*(c1-c0);
+        }
+        editor.setColorMap(std::make_shared<ColorMap>(pos.data(), cols.data(), unsigned(n)));
+      }
+    }
+
+    // bring the working LUT up to date with the editor, re-baking only
+    // the entries in the x-range that changed since the last frame
+    const std::vector<vec4f> &updateWorkingLUT()
+    {
+      unsigned first = 0, last = lutSize;
+      if (working.size() == lutSize) {
+        vec2ui changed = editor.changedLUTEntries(workingVersion, lutSize);
+        if (changed.x == changed.y)
+          return working;
+        first = changed.x;
+        last = changed.y;
+      } else {
+        working.resize(lutSize);
+      }
+
+      editor.bakeLUT(lutSize, first, last, working.data()+first);
+      workingVersion = editor.getVersion();
+      return working;
+    }
+
+    TFEditor &editor;
+    unsigned lutSize;
+    size_t cacheSize;
+
+    // sorted by time
+    std::vector<Keyframe> keyframes;
+
+    // LUT of the last posed frame, and the editor version it reflects
+    std::vector<vec4f> working;
+    uint64_t workingVersion{0};
+
+    std::map<float, CacheEntry> cache;
+    // most recently used first
+    std::list<float> lru;
+  };
+
+} // tfe
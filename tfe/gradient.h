@@ -0,0 +1,199 @@
+#pragma once
+
+/*! @file
+  @brief Gradient magnitude pre-processing for (large) scalar volumes
+
+  The volume is streamed slab by slab (a slab is a number of
+  consecutive z-slices) through a user-provided reader, so that only
+  (slabSize+2) input slices are in memory at a time. The two slices
+  the next slab needs as halo are kept from the previous slab instead
+  of being read again. Each slab is processed in parallel, row by row,
+  and in SIMD along x. The gradient magnitudes are either passed to a
+  writer slab by slab, or directly binned into a 2D joint histogram of
+  value and gradient magnitude without ever materializing the
+  gradient volume.
+ */
+
+#include <functional>
+#include "TFEditor.h"
+
+namespace tfe {
+
+  enum class GradientOperator
+  {
+    CentralDifferences,
+    Sobel, // 3x3x3, smoother but more expensive
+  };
+
+  /*! reads numSlices z-slices, starting at firstSlice, into dst */
+  typedef std::function<void(unsigned firstSlice, unsigned numSlices, float *dst)>
+      SliceReader;
+
+  /*! receives numSlices z-slices of values and gradient magnitudes,
+    starting at firstSlice; the pointers are only valid during the call */
+  typedef std::function<void(unsigned firstSlice, unsigned numSlices,
+                             const float *values, const float *gradMag)>
+      SliceWriter;
+
+  namespace detail {
+
+    inline float constant(float f, float) { return f; }
+    inline simd::float4 constant(float f, simd::float4) { return simd::splat(f); }
+
+    // gradient magnitude at one (T=float) or four (T=simd::float4)
+    // consecutive voxels; rows[dz][dy] are the neighbouring rows, and
+    // load(row,dx) returns the value(s) at x+dx
+
+    template <typename T, typename Load>
+    T gradientMagnitude(GradientOperator op, const float *const rows[3][3],
+                        const Load &load, vec3f scale)
+    {
+      using std::sqrt;
+      using simd::sqrt;
+
+      T gx, gy, gz;
+      if (op == GradientOperator::CentralDifferences) {
+        gx = load(rows[1][1], 1) - load(rows[1][1], -1);
+        gy = load(rows[1][2], 0) - load(rows[1][0], 0);
+        gz = load(rows[2][1], 0) - load(rows[0][1], 0);
+      } else {
+        // separable Sobel: derivative [-1,0,1] along one axis,
+        // smoothing [1,2,1] along the other two
+        T one = constant(1.f, T()), two = constant(2.f, T());
+        T w[3] = {one, two, one};
+        gx = gy = gz = constant(0.f, T());
+        for (int dz=0; dz<3; ++dz) {
+          for (int dy=0; dy<3; ++dy) {
+            T l = load(rows[dz][dy], -1), c = load(rows[dz][dy], 0), r = load(rows[dz][dy], 1);
+            T smoothX = l + two*c + r;
+            gx = gx + w[dz]*w[dy]*(r-l);
+            if (dy == 0) gy = gy - w[dz]*smoothX;
+            if (dy == 2) gy = gy + w[dz]*smoothX;
+            if (dz == 0) gz = gz - w[dy]*smoothX;
+            if (dz == 2) gz = gz + w[dy]*smoothX;
+          }
+        }
+      }
+      gx = gx*constant(scale.x, T());
+      gy = gy*constant(scale.y, T());
+      gz = gz*constant(scale.z, T());
+      return sqrt(gx*gx + gy*gy + gz*gz);
+    }
+
+  } // detail
+
+  /*! stream the volume with dims through read, and pass the values and
+    gradient magnitudes to write, slab by slab */
+  inline void computeGradientMagnitude(vec3i dims, const SliceReader &read,
+                                       const SliceWriter &write,
+                                       GradientOperator op = GradientOperator::CentralDifferences,
+                                       vec3f spacing = vec3f(1.f),
+                                       unsigned slabSize = 16)
+  {
+    if (dims.x <= 0 || dims.y <= 0 || dims.z <= 0)
+      return;
+
+    unsigned nx = dims.x, ny = dims.y, nz = dims.z;
+    size_t sliceSize = size_t(nx)*ny;
+    slabSize = std::max(slabSize, 1u);
+
+    // central differences and Sobel are both normalized so that a
+    // linear ramp with slope 1 has gradient magnitude 1
+    float norm = op == GradientOperator::CentralDifferences ? 0.5f : 1.f/32.f;
+    vec3f scale(norm/spacing.x, norm/spacing.y, norm/spacing.z);
+
+    // slot s of the input buffer holds slice z0-1+s (clamped to the volume)
+    std::vector<float> input((slabSize+2)*sliceSize);
+    std::vector<float> output(slabSize*sliceSize);
+    auto slot = [&](unsigned s) { return input.data()+s*sliceSize; };
+
+    for (unsigned z0=0; z0<nz; z0+=slabSize) {
+      unsigned count = std::min(slabSize, nz-z0);
+
+      // fill slots [first,count+2); slots [0,first) are the halo kept
+      // from the previous slab (which is always a full one)
+      unsigned first = 1;
+      if (z0 > 0) {
+        std::copy(slot(slabSize), slot(slabSize+2), slot(0));
+        first = 2;
+      }
+      unsigned readFirst = z0-1+first;
+      unsigned readCount = std::min(count+2-first, nz-readFirst);
+      if (readCount > 0)
+        read(readFirst, readCount, slot(first));
+      if (z0 == 0)
+        std::copy(slot(1), slot(2), slot(0));
+      for (unsigned s=first+readCount; s<count+2; ++s)
+        std::copy(slot(s-1), slot(s), slot(s));
+
+      size_t numRows = size_t(count)*ny;
+      parallel::forEachRange(numRows, 64, [&](size_t firstRow, size_t lastRow) {
+        for (size_t row=firstRow; row<lastRow; ++row) {
+          unsigned z = unsigned(row/ny), y = unsigned(row%ny);
+          const float *rows[3][3];
+          for (int dz=0; dz<3; ++dz) {
+            for (int dy=0; dy<3; ++dy) {
+              unsigned yy = unsigned(std::min(std::max(int(y)+dy-1, 0), int(ny)-1));
+              rows[dz][dy] = slot(z+dz)+size_t(yy)*nx;
+            }
+          }
+          float *out = output.data()+row*nx;
+
+          auto loadScalar = [&](const float *r, int dx, unsigned x) {
+            return r[std::min(std::max(int(x)+dx, 0), int(nx)-1)];
+          };
+
+          // x=0 and the tail need clamping, the interior goes 4-wide
+          unsigned x = 0;
+          {
+            auto load = [&](const float *r, int dx) { return loadScalar(r, dx, 0); };
+            out[0] = detail::gradientMagnitude<float>(op, rows, load, scale);
+          }
+          for (x=1; x+4<nx; x+=4) {
+            auto load = [&](const float *r, int dx) { return simd::load(r+x+dx); };
+            simd::store(out+x, detail::gradientMagnitude<simd::float4>(op, rows, load, scale));
+          }
+          for (; x<nx; ++x) {
+            auto load = [&](const float *r, int dx) { return loadScalar(r, dx, x); };
+            out[x] = detail::gradientMagnitude<float>(op, rows, load, scale);
+          }
+        }
+      });
+
+      write(z0, count, slot(1), output.data());
+    }
+  }
+
+  /*! convenience overload for volumes that fit in memory */
+  inline void computeGradientMagnitude(vec3i dims, const float *volume, float *gradMag,
+                                       GradientOperator op = GradientOperator::CentralDifferences,
+                                       vec3f spacing = vec3f(1.f),
+                                       unsigned slabSize = 16)
+  {
+    size_t sliceSize = size_t(dims.x)*dims.y;
+    computeGradientMagnitude(dims,
+      [&](unsigned first, unsigned num, float *dst) {
+        std::copy(volume+first*sliceSize, volume+(first+num)*sliceSize, dst);
+      },
+      [&](unsigned first, unsigned num, const float *, const float *grad) {
+        std::copy(grad, grad+num*sliceSize, gradMag+first*sliceSize);
+      },
+      op, spacing, slabSize);
+  }
+
+  /*! stream the volume through read, and bin (value, gradient magnitude)
+    into hist; the gradient volume is never materialized */
+  inline void computeJointHistogram(vec3i dims, const SliceReader &read, Histogram2D &hist,
+                                    GradientOperator op = GradientOperator::CentralDifferences,
+                                    vec3f spacing = vec3f(1.f),
+                                    unsigned slabSize = 16)
+  {
+    size_t sliceSize = size_t(dims.x)*dims.y;
+    computeGradientMagnitude(dims, read,
+      [&](unsigned, unsigned num, const float *values, const float *grad) {
+        hist.add(values, grad, num*sliceSize);
+      },
+      op, spacing, slabSize);
+  }
+
+} // tfe
@@ -0,0 +1,206 @@
+#pragma once
+
+/*! @file
+  @brief Per-timestep histogram cache for time-varying data
+
+  Histograms are built on demand by a user-provided builder (which
+  typically loads the timestep and bins it) on a small pool of worker
+  threads. Requesting a timestep never blocks: when its histogram is
+  not cached yet, the request is queued ahead of everything else, and
+  the neighbouring timesteps are queued for prefetching behind it. The
+  cache holds a bounded number of histograms and evicts the least
+  recently used one.
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include "TFEditor.h"
+
+namespace tfe {
+
+  class HistogramCache
+  {
+   public:
+    typedef std::function<Histogram::SP(unsigned timestep)> Builder;
+
+    /*! capacity is the maximum number of cached histograms; it is
+      raised so that the current timestep and all prefetched neighbours
+      fit */
+    HistogramCache(unsigned numTimesteps, const Builder &build,
+                   size_t capacity = 32,
+                   unsigned prefetchRadius = 2,
+                   unsigned numWorkers = 2)
+      : numTimesteps(numTimesteps), build(build),
+        capacity(std::max(capacity, size_t(2)*prefetchRadius+1)),
+        prefetchRadius(prefetchRadius)
+    {
+      for (unsigned i=0; i<std::max(numWorkers, 1u); ++i)
+        workers.emplace_back([this]() { work(); });
+    }
+
+    ~HistogramCache()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+      }
+      wakeup.notify_all();
+      for (auto &w : workers)
+        w.join();
+    }
+
+    HistogramCache(const HistogramCache &) = delete;
+    HistogramCache &operator=(const HistogramCache &) = delete;
+
+    /*! make timestep the current one, and (re)prioritize the queue:
+      timestep first, then its neighbours by increasing distance */
+    void setTimestep(unsigned timestep)
+    {
+      if (timestep >= numTimesteps)
+        return;
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        current = timestep;
+        queue.clear();
+        for (unsigned d=0; d<=prefetchRadius; ++d) {
+          if (timestep+d < numTimesteps)
+            enqueue(timestep+d);
+          if (d > 0 && timestep >= d)
+            enqueue(timestep-d);
+        }
+      }
+      wakeup.notify_all();
+    }
+
+    unsigned getTimestep() const
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return current;
+    }
+
+    /*! the histogram of timestep if it is cached, nullptr otherwise;
+      never blocks on a build */
+    Histogram::SP get(unsigned timestep)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto it = entries.find(timestep);
+      if (it == entries.end())
+        return nullptr;
+      lru.splice(lru.begin(), lru, it->second.lruPos);
+      return it->second.histogram;
+    }
+
+    /*! the histogram of the current timestep, or nullptr if it is still
+      being built */
+    Histogram::SP getCurrent()
+    {
+      return get(getTimestep());
+    }
+
+    /*! make the editor's background follow the current timestep; call
+      once per frame. The previous background stays in place until the
+      new histogram is ready. Returns true if the background changed */
+    bool updateBackground(TFEditor &editor)
+    {
+      Histogram::SP hist = getCurrent();
+      if (!hist || hist == editor.getBackground())
+        return false;
+      editor.setBackground(hist);
+      return true;
+    }
+
+    /*! true if the histogram of timestep is cached */
+    bool isCached(unsigned timestep) const
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return entries.find(timestep) != entries.end();
+    }
+
+    size_t size() const
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      return entries.size();
+    }
+
+   private:
+    struct Entry
+    {
+      Histogram::SP histogram;
+      std::list<unsigned>::iterator lruPos;
+    };
+
+    // requires the mutex to be held
+    void enqueue(unsigned timestep)
+    {
+      if (entries.find(timestep) == entries.end() && inFlight.find(timestep) == inFlight.end())
+        queue.push_back(timestep);
+    }
+
+    void work()
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      for (;;) {
+        wakeup.wait(lock, [this]() { return quit || !queue.empty(); });
+        if (quit)
+          return;
+
+        unsigned timestep = queue.front();
+        queue.pop_front();
+        inFlight.insert(timestep);
+
+        lock.unlock();
+        Histogram::SP hist = build(timestep);
+        lock.lock();
+
+        inFlight.erase(timestep);
+        if (!hist || entries.find(timestep) != entries.end())
+          continue;
+
+        lru.push_front(timestep);
+        entries[timestep] = {hist, lru.begin()};
+        evict();
+      }
+    }
+
+    // drop the least recently used histograms, but never the ones the
+    // current timestep and its prefetch window need
+    void evict()
+    {
+      auto it = lru.end();
+      while (entries.size() > capacity && it != lru.begin()) {
+        --it;
+        unsigned t = *it;
+        unsigned dist = t > current ? t-current : current-t;
+        if (dist <= prefetchRadius)
+          continue;
+        entries.erase(t);
+        it = lru.erase(it);
+      }
+    }
+
+    unsigned numTimesteps;
+    Builder build;
+    size_t capacity;
+    unsigned prefetchRadius;
+
+    mutable std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<std::thread> workers;
+    bool quit{false};
+
+    unsigned current{0};
+    std::deque<unsigned> queue;
+    std::unordered_set<unsigned> inFlight;
+    std::unordered_map<unsigned, Entry> entries;
+    // most recently used first
+    std::list<unsigned> lru;
+  };
+
+} // tfe
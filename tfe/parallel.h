@@ -0,0 +1,142 @@
+#pragma once
+
+/*! @file
+  @brief Deterministic parallel loops
+
+  The work is always split into chunks that only depend on the size
+  of the problem, never on the number of threads; threads pick up
+  chunks dynamically, and each chunk writes its own output. Reductions
+  first reduce within fixed ranges of the input, and then combine the
+  partial results in range order. Together with disabling floating
+  point contraction, this makes all results bitwise identical,
+  independent of the number of threads and of the machine.
+
+  Contraction is a compiler flag, not something a header can switch
+  off reliably, so it is a requirement on the code that includes
+  these headers: compile with -ffp-contract=off (GCC, Clang), or link
+  against the CMake target tfe (TFE::tfe), which adds the flag to its
+  consumers. MSVC doesn't contract by default; don't pass /fp:fast or
+  /fp:contract. Without this, results may still differ in the last
+  bits between builds and machines.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace tfe {
+namespace parallel {
+
+  inline unsigned &numThreadsStorage()
+  {
+    static unsigned numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+    return numThreads;
+  }
+
+  /*! number of threads used by all parallel loops; defaults to the
+    number of hardware threads */
+  inline void setNumThreads(unsigned numThreads)
+  {
+    numThreadsStorage() = std::max(numThreads, 1u);
+  }
+
+  inline unsigned getNumThreads()
+  {
+    return numThreadsStorage();
+  }
+
+  // true on threads that currently execute a chunk
+  inline bool &insideParallelLoop()
+  {
+    static thread_local bool inside = false;
+    return inside;
+  }
+
+  /*! call func(chunkID) for each chunk in [0,numChunks); loops nested
+    inside a chunk run serially on the calling thread, so running,
+    e.g., whole bakes in parallel doesn't oversubscribe the machine */
+  template <typename Func>
+  void forEachChunk(size_t numChunks, const Func &func)
+  {
+    size_t numThreads = std::min(size_t(getNumThreads()), numChunks);
+    if (numThreads <= 1 || insideParallelLoop()) {
+      for (size_t i=0; i<numChunks; ++i) func(i);
+      return;
+    }
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+      insideParallelLoop() = true;
+      for (size_t i=next++; i<numChunks; i=next++) func(i);
+      insideParallelLoop() = false;
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i=1; i<numThreads; ++i)
+      threads.emplace_back(worker);
+    worker();
+    for (auto &t : threads)
+      t.join();
+  }
+
+  /*! call func(first,last) for the ranges [first,last) that [0,n) is
+    split into, each of chunkSize elements (except for the last one) */
+  template <typename Func>
+  void forEachRange(size_t n, size_t chunkSize, const Func &func)
+  {
+    size_t numChunks = (n+chunkSize-1)/chunkSize;
+    forEachChunk(numChunks, [&](size_t i) {
+      func(i*chunkSize, std::min((i+1)*chunkSize, n));
+    });
+  }
+
+  /*! split [0,n) into chunks of chunkSize elements, reduce each chunk
+    into a partial result with map(partial,first,last), and combine
+    the partial results in chunk order with reduce(result,partial) */
+  template <typename T, typename Map, typename Reduce>
+  T mapReduce(size_t n, size_t chunkSize, const T &init, const Map &map, const Reduce &reduce)
+  {
+    size_t numChunks = (n+chunkSize-1)/chunkSize;
+    std::vector<T> partials(numChunks, init);
+    forEachChunk(numChunks, [&](size_t i) {
+      map(partials[i], i*chunkSize, std::min((i+1)*chunkSize, n));
+    });
+
+    T result = init;
+    for (const T &p : partials)
+      reduce(result, p);
+    return result;
+  }
+
+  /*! histogram-style reduction: split [0,n) into at most
+    maxPartitions ranges of at least minChunk elements, let
+    map(bins,first,last) accumulate each range into its own vector of
+    numBins zeros, and sum the vectors bin by bin in range order. The
+    sums are computed in parallel over bins, and the number of
+    partial vectors stays bounded however large n gets. */
+  template <typename T, typename Map>
+  std::vector<T> binnedReduce(size_t n, size_t numBins, size_t maxPartitions,
+                              size_t minChunk, const Map &map)
+  {
+    maxPartitions = std::max(maxPartitions, size_t(1));
+    size_t chunkSize = std::max(std::max(minChunk, size_t(1)),
+                                (n+maxPartitions-1)/maxPartitions);
+    size_t numChunks = (n+chunkSize-1)/chunkSize;
+    std::vector<std::vector<T>> partials(numChunks);
+    forEachChunk(numChunks, [&](size_t i) {
+      partials[i].assign(numBins, T(0));
+      map(partials[i], i*chunkSize, std::min((i+1)*chunkSize, n));
+    });
+
+    std::vector<T> result(numBins, T(0));
+    forEachRange(numBins, 4096, [&](size_t first, size_t last) {
+      for (const std::vector<T> &p : partials)
+        for (size_t b=first; b<last; ++b) result[b] += p[b];
+    });
+    return result;
+  }
+
+} // parallel
+} // tfe
@@ -0,0 +1,390 @@
+#pragma once
+
+/*! @file
+  @brief Memory-mapped library of TF presets
+
+  A library file stores many serialized editor states (see
+  TFEditor::serialize()), each with a pre-baked RGBA8 LUT and an RGBA8
+  thumbnail. The file starts with a header, followed by an index of
+  fixed-size entries sorted by name, followed by the payloads:
+
+    LibraryHeader
+    IndexEntry[numPresets]
+    payloads (state, LUT, thumbnail of each preset; 16 byte aligned)
+
+  Thumbnails are stored with their rows top to bottom.
+
+  PresetLibrary maps the file into memory, so opening it only touches
+  the header and the index; names, LUTs and thumbnails are read in
+  place (which is all a preset browser needs), and a preset's state
+  is only decoded when load() is called.
+ */
+
+#include <cstdio>
+#include "TFEditor.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace tfe {
+
+  namespace preset {
+
+    enum : uint32_t
+    {
+      Magic = 0x4c454654, // "TFEL"
+      Version = 1,
+      MaxNameLength = 63,
+    };
+
+    struct LibraryHeader
+    {
+      uint32_t magic;
+      uint32_t version;
+      uint32_t numPresets;
+      uint32_t lutSize;
+      uint32_t thumbnailWidth;
+      uint32_t thumbnailHeight;
+      uint64_t fileSize;
+    };
+
+    struct IndexEntry
+    {
+      char name[MaxNameLength+1]; // zero terminated
+      uint64_t stateOffset;
+      uint64_t lutOffset;
+      uint64_t thumbnailOffset;
+      uint32_t stateSize;
+      uint32_t pad;
+    };
+
+  } // preset
+
+  /*! collects presets and writes them to a library file */
+  class PresetLibraryWriter
+  {
+   public:
+    PresetLibraryWriter(unsigned lutSize = 256, unsigned thumbnailWidth = 64,
+                        unsigned thumbnailHeight = 32)
+      : lutSize(std::max(lutSize, 2u)),
+        thumbnailWidth(std::max(thumbnailWidth, 1u)),
+        thumbnailHeight(std::max(thumbnailHeight, 1u))
+    {}
+
+    /*! add the editor's current state; names longer than
+      preset::MaxNameLength are truncated. The LUT and thumbnail are
+      baked right away */
+    void add(const std::string &name, const TFEditor &editor)
+    {
+      Preset p;
+      p.name = name.substr(0, preset::MaxNameLength);
+      p.state = editor.serialize();
+      p.lut = editor.getRGBA8(lutSize);
+      Texture thumbnail = editor.rasterize(thumbnailWidth, thumbnailHeight);
+      thumbnail.setOrigin(Texture::TopLeft);
+      p.thumbnail.swap(thumbnail.data);
+      presets.push_back(p);
+    }
+
+    size_t size() const
+    {
+      return presets.size();
+    }
+
+    /*! returns false if the file couldn't be written */
+    bool write(const std::string &fileName) const
+    {
+      std::vector<const Preset *> sorted;
+      for (auto &p : presets) sorted.push_back(&p);
+      std::stable_sort(sorted.begin(), sorted.end(),
+        [](const Preset *a, const Preset *b) { return a->name < b->name; });
+
+      preset::LibraryHeader header = {};
+      header.magic = preset::Magic;
+      header.version = preset::Version;
+      header.numPresets = uint32_t(sorted.size());
+      header.lutSize = lutSize;
+      header.thumbnailWidth = thumbnailWidth;
+      header.thumbnailHeight = thumbnailHeight;
+
+      std::vector<preset::IndexEntry> index(sorted.size());
+      uint64_t offset = align(sizeof(header) + index.size()*sizeof(preset::IndexEntry));
+      for (size_t i=0; i<sorted.size(); ++i) {
+        preset::IndexEntry &e = index[i];
+        memset(&e, 0, sizeof(e));
+        memcpy(e.name, sorted[i]->name.data(), sorted[i]->name.size());
+        e.stateOffset = offset;
+        e.stateSize = uint32_t(sorted[i]->state.size());
+        offset = align(offset + e.stateSize);
+        e.lutOffset = offset;
+        offset = align(offset + lutSize*sizeof(uint32_t));
+        e.thumbnailOffset = offset;
+        offset = align(offset + size_t(thumbnailWidth)*thumbnailHeight*sizeof(uint32_t));
+      }
+      header.fileSize = offset;
+
+      FILE *file = fopen(fileName.c_str(), "wb");
+      if (!file)
+        return false;
+
+      bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+      if (!index.empty())
+        ok = ok && fwrite(index.data(), sizeof(preset::IndexEntry), index.size(), file) == index.size();
+      for (size_t i=0; i<sorted.size() && ok; ++i) {
+        ok = ok && writeAt(file, index[i].stateOffset, sorted[i]->state.data(), sorted[i]->state.size());
+        ok = ok && writeAt(file, index[i].lutOffset, sorted[i]->lut.data(),
+                           sorted[i]->lut.size()*sizeof(uint32_t));
+        ok = ok && writeAt(file, index[i].thumbnailOffset, sorted[i]->thumbnail.data(),
+                           sorted[i]->thumbnail.size()*sizeof(uint32_t));
+      }
+      // pad to the full size, so the last payload is properly aligned
+      ok = ok && writeAt(file, header.fileSize, nullptr, 0);
+      return fclose(file) == 0 && ok;
+    }
+
+   private:
+    struct Preset
+    {
+      std::string name;
+      std::vector<uint8_t> state;
+      std::vector<uint32_t> lut, thumbnail;
+    };
+
+    static uint64_t align(uint64_t offset)
+    {
+      return (offset+15) & ~uint64_t(15);
+    }
+
+    // the file is written front to back, so seeking only ever pads
+    static bool writeAt(FILE *file, uint64_t offset, const void *data, size_t size)
+    {
+      long pos = ftell(file);
+      if (pos < 0 || uint64_t(pos) > offset)
+        return false;
+      static const char zeros[16] = {};
+      for (uint64_t i=uint64_t(pos); i<offset; i+=sizeof(zeros)) {
+        size_t n = size_t(std::min(offset-i, uint64_t(sizeof(zeros))));
+        if (fwrite(zeros, 1, n, file) != n)
+          return false;
+      }
+      return size == 0 || fwrite(data, 1, size, file) == size;
+    }
+
+    unsigned lutSize, thumbnailWidth, thumbnailHeight;
+    std::vector<Preset> presets;
+  };
+
+  /*! read-only view of a library file */
+  class PresetLibrary
+  {
+   public:
+    PresetLibrary() = default;
+
+    ~PresetLibrary()
+    {
+      close();
+    }
+
+    PresetLibrary(const PresetLibrary &) = delete;
+    PresetLibrary &operator=(const PresetLibrary &) = delete;
+
+    /*! map the file; returns false if it can't be opened or is not a
+      valid library */
+    bool open(const std::string &fileName)
+    {
+      close();
+      if (!map(fileName))
+        return false;
+
+      if (size < sizeof(preset::LibraryHeader)) {
+        close();
+        return false;
+      }
+
+      const preset::LibraryHeader *h = header();
+      uint64_t indexEnd = sizeof(*h) + uint64_t(h->numPresets)*sizeof(preset::IndexEntry);
+      if (h->magic != preset::Magic || h->version != preset::Version
+        || h->fileSize > size || indexEnd > size) {
+        close();
+        return false;
+      }
+      return true;
+    }
+
+    void close()
+    {
+      unmap();
+      data = nullptr;
+      size = 0;
+    }
+
+    bool isOpen() const
+    {
+      return data != nullptr;
+    }
+
+    size_t numPresets() const
+    {
+      return isOpen() ? header()->numPresets : 0;
+    }
+
+    /*! presets are sorted by name. Names are returned in place, so
+      they are checked for their terminator here rather than when
+      opening; nullptr if the entry is corrupt */
+    const char *getName(size_t i) const
+    {
+      const char *name = entry(i).name;
+      return memchr(name, 0, preset::MaxNameLength+1) ? name : nullptr;
+    }
+
+    /*! index of the preset with the given name, or -1 */
+    ptrdiff_t find(const std::string &name) const
+    {
+      size_t lo = 0, hi = numPresets();
+      while (lo < hi) {
+        size_t mid = (lo+hi)/2;
+        // corrupt names never match
+        const char *midName = getName(mid);
+        int cmp = midName ? strncmp(midName, name.c_str(), preset::MaxNameLength) : -1;
+        if (cmp == 0) return ptrdiff_t(mid);
+        else if (cmp < 0) lo = mid+1;
+        else hi = mid;
+      }
+      return -1;
+    }
+
+    unsigned getLUTSize() const
+    {
+      return isOpen() ? header()->lutSize : 0;
+    }
+
+    /*! RGBA8 LUT with getLUTSize() entries (see cvt_uint32()), read in
+      place from the mapped file; nullptr if the entry is corrupt */
+    const uint32_t *getLUT(size_t i) const
+    {
+      return (const uint32_t *)payload(entry(i).lutOffset, getLUTSize()*sizeof(uint32_t));
+    }
+
+    vec2ui getThumbnailSize() const
+    {
+      return isOpen() ? vec2ui(header()->thumbnailWidth, header()->thumbnailHeight)
+                      : vec2ui(0u, 0u);
+    }
+
+    /*! RGBA8 thumbnail, rows top to bottom (like in image files) */
+    const uint32_t *getThumbnail(size_t i) const
+    {
+      vec2ui s = getThumbnailSize();
+      return (const uint32_t *)payload(entry(i).thumbnailOffset, size_t(s.x)*s.y*sizeof(uint32_t));
+    }
+
+    /*! decode preset i into the editor */
+    bool load(size_t i, TFEditor &editor) const
+    {
+      const preset::IndexEntry &e = entry(i);
+      const uint8_t *state = payload(e.stateOffset, e.stateSize);
+      return state && editor.deserialize(state, e.stateSize);
+    }
+
+   private:
+    const preset::LibraryHeader *header() const
+    {
+      return (const preset::LibraryHeader *)data;
+    }
+
+    const preset::IndexEntry &entry(size_t i) const
+    {
+      assert(i < numPresets());
+      return ((const preset::IndexEntry *)(header()+1))[i];
+    }
+
+    const uint8_t *payload(uint64_t offset, uint64_t numBytes) const
+    {
+      if (offset > size || numBytes > size-offset || offset % 4 != 0)
+        return nullptr;
+      return data+offset;
+    }
+
+#ifdef _WIN32
+    bool map(const std::string &fileName)
+    {
+      HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+      if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+      LARGE_INTEGER fileSize;
+      if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart <= 0
+        || uint64_t(fileSize.QuadPart) > SIZE_MAX) {
+        CloseHandle(file);
+        return false;
+      }
+
+      // the mapping keeps the file open, and the view the mapping
+      HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      CloseHandle(file);
+      if (!mapping)
+        return false;
+
+      void *ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+      if (!ptr)
+        return false;
+
+      data = (const uint8_t *)ptr;
+      size = size_t(fileSize.QuadPart);
+      return true;
+    }
+
+    void unmap()
+    {
+      if (data)
+        UnmapViewOfFile(data);
+    }
+#else
+    bool map(const std::string &fileName)
+    {
+      int fd = ::open(fileName.c_str(), O_RDONLY);
+      if (fd < 0)
+        return false;
+
+      struct stat st;
+      if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return false;
+      }
+
+      void *ptr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+      ::close(fd);
+      if (ptr == MAP_FAILED)
+        return false;
+
+      data = (const uint8_t *)ptr;
+      size = size_t(st.st_size);
+      return true;
+    }
+
+    void unmap()
+    {
+      if (data)
+        munmap((void *)data, size);
+    }
+#endif
+
+    const uint8_t *data{nullptr};
+    size_t size{0};
+  };
+
+} // tfe
@@ -0,0 +1,201 @@
+#pragma once
+
+/*! @file
+  @brief Flat, trivially copyable representation of a TF
+
+  TFEditor::compile() flattens the function stack into a contiguous
+  blob that can be memcpy'd to the device (e.g., into a uniform or
+  storage buffer, or into shared memory) and evaluated there with
+  tfe::program::eval(). The blob consists of a ProgramHeader,
+  followed by numPrimitives PrimitiveRecords, followed by the float
+  payload the records refer to. eval() takes normalized data values;
+  if the editor has a domain mapping, the header describes it, and
+  the values are mapped before the primitives are evaluated. This header has no dependencies
+  besides math.h and can be included in __host__ __device__ code.
+ */
+
+#include <stdint.h>
+#include "math.h"
+
+namespace tfe {
+
+  /*! how the alpha values of the individual functions are combined */
+  enum class CombineOp
+  {
+    Max,     // maximum over all functions
+    Sum,     // sum, clamped to [0:1]
+    Product, // product of all functions
+    Over,    // alpha over-compositing
+  };
+
+  namespace program {
+
+    enum : uint32_t
+    {
+      Magic = 0x50454654, // "TFEP"
+      Version = 2,
+    };
+
+    enum PrimitiveType : uint32_t
+    {
+      // count (x,y) pairs, linearly interpolated, 0 outside
+      Linear = 0,
+      // count knots, followed by 4*(count-1) coefficients (c0,c1,c2,c3)
+      // per segment; y = ((c3*t+c2)*t+c1)*t+c0, t = x-knot
+      Cubic = 1,
+      // count samples over [0:1], linearly interpolated
+      Table = 2,
+    };
+
+    /*! how normalized data values t map to the x axis the
+      primitives are defined over (see DomainMapping); p are the
+      header's domainParams */
+    enum DomainType : uint32_t
+    {
+      // x = t
+      DomainLinear = 0,
+      // v = p0+t*p1, x = (log2(v)-p2)*p3
+      DomainLog = 1,
+      // v = p0+t*p1, x = (sign(v)*log2(1+|v|*p2)-p3)*p4
+      DomainSymLog = 2,
+      // domainCount samples of x over t in [0:1] at domainOffset
+      // (in floats) in the payload, linearly interpolated
+      DomainTable = 3,
+    };
+
+    struct ProgramHeader
+    {
+      uint32_t magic;
+      uint32_t version;
+      uint32_t sizeInBytes;
+      uint32_t combineOp;
+      uint32_t numPrimitives;
+      uint32_t domainType;
+      uint32_t domainCount;
+      uint32_t domainOffset;
+      float domainParams[5];
+      uint32_t pad[3];
+    };
+
+    struct PrimitiveRecord
+    {
+      uint32_t type;
+      uint32_t count;
+      // offset into the payload, in floats
+      uint32_t offset;
+      float weight;
+      float lower, upper; // valueRange
+      uint32_t pad[2];
+    };
+
+    inline __host__ __device__
+    const PrimitiveRecord *records(const ProgramHeader *prog)
+    {
+      return (const PrimitiveRecord *)(prog+1);
+    }
+
+    inline __host__ __device__
+    const float *payload(const ProgramHeader *prog)
+    {
+      return (const float *)(records(prog)+prog->numPrimitives);
+    }
+
+    // index of the last element in [0,n-1) of the stride-separated
+    // sorted keys that is <= x
+    inline __host__ __device__
+    uint32_t findSegment(const float *keys, uint32_t stride, uint32_t n, float x)
+    {
+      uint32_t lo = 0, hi = n-1;
+      while (hi-lo > 1) {
+        uint32_t mid = (lo+hi)/2;
+        if (keys[mid*stride] <= x) lo = mid;
+        else hi = mid;
+      }
+      return lo;
+    }
+
+    inline __host__ __device__
+    float evalPrimitive(const PrimitiveRecord &rec, const float *data, float x)
+    {
+      if (x < rec.lower || x > rec.upper || rec.count < 2)
+        return 0.f;
+
+      data += rec.offset;
+      if (rec.type == Linear) {
+        if (x < data[0] || x > data[2*(rec.count-1)])
+          return 0.f;
+        uint32_t i = findSegment(data, 2, rec.count, x);
+        float x1 = data[2*i], y1 = data[2*i+1];
+        float x2 = data[2*i+2], y2 = data[2*i+3];
+        return x2 > x1 ? y1 + (y2-y1)/(x2-x1)*(x-x1) : y1;
+      } else if (rec.type == Cubic) {
+        if (x < data[0] || x > data[rec.count-1])
+          return 0.f;
+        uint32_t k = findSegment(data, 1, rec.count, x);
+        const float *c = data+rec.count+4*k;
+        float t = x-data[k];
+        float y = ((c[3]*t + c[2])*t + c[1])*t + c[0];
+        return fmaxf(0.f, fminf(y, 1.f));
+      } else if (rec.type == Table) {
+        float xf = fmaxf(0.f, fminf(x, 1.f)) * (rec.count-1);
+        uint32_t i = (uint32_t)xf;
+        if (i > rec.count-2) i = rec.count-2;
+        float t = xf-i;
+        return data[i] + t*(data[i+1]-data[i]);
+      }
+      return 0.f;
+    }
+
+    /*! x position of the normalized data value t, see DomainType */
+    inline __host__ __device__
+    float mapDomain(const ProgramHeader *prog, float t)
+    {
+      if (prog->domainType == DomainLinear)
+        return t;
+
+      const float *p = prog->domainParams;
+      t = fmaxf(0.f, fminf(t, 1.f));
+      float x = t;
+      if (prog->domainType == DomainLog) {
+        x = (log2f(p[0] + t*p[1])-p[2])*p[3];
+      } else if (prog->domainType == DomainSymLog) {
+        float v = p[0] + t*p[1];
+        x = (copysignf(log2f(1.f+fabsf(v)*p[2]), v)-p[3])*p[4];
+      } else if (prog->domainType == DomainTable && prog->domainCount >= 2) {
+        const float *table = payload(prog) + prog->domainOffset;
+        float tf = t * (prog->domainCount-1);
+        uint32_t i = (uint32_t)tf;
+        if (i > prog->domainCount-2) i = prog->domainCount-2;
+        x = table[i] + (tf-i)*(table[i+1]-table[i]);
+      }
+      return fmaxf(0.f, fminf(x, 1.f));
+    }
+
+    /*! the combined functions at the normalized data value t */
+    inline __host__ __device__
+    float eval(const ProgramHeader *prog, float t)
+    {
+      const PrimitiveRecord *recs = records(prog);
+      const float *data = payload(prog);
+      CombineOp op = (CombineOp)prog->combineOp;
+
+      if (prog->numPrimitives == 0)
+        return 0.f;
+
+      float x = mapDomain(prog, t);
+
+      float acc = op == CombineOp::Product ? 1.f : 0.f;
+      for (uint32_t i=0; i<prog->numPrimitives; ++i) {
+        float y = recs[i].weight * evalPrimitive(recs[i], data, x);
+        switch (op) {
+          case CombineOp::Max: acc = fmaxf(acc, y); break;
+          case CombineOp::Sum: acc = acc + y; break;
+          case CombineOp::Product: acc = acc * y; break;
+          case CombineOp::Over: acc = acc + y - acc*y; break;
+        }
+      }
+      return op == CombineOp::Sum ? fminf(acc, 1.f) : acc;
+    }
+
+  } // program
+} // tfe
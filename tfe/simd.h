@@ -0,0 +1,133 @@
+#pragma once
+
+/*! @file
+  @brief Minimal 4-wide float SIMD type used by the batch evaluators
+
+  Maps to SSE2 when available; otherwise (or when TFE_DISABLE_SIMD is
+  defined, and in CUDA device code) falls back to plain scalar code
+  with the same interface.
+ */
+
+#if defined(__SSE2__) && !defined(__CUDACC__) && !defined(TFE_DISABLE_SIMD)
+#define TFE_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+namespace tfe {
+namespace simd {
+
+#ifdef TFE_HAVE_SSE2
+struct float4
+{
+  float4() = default;
+  float4(__m128 v) : v(v) {}
+  __m128 v;
+};
+
+inline float4 splat(float f) { return _mm_set1_ps(f); }
+inline float4 load(const float *p) { return _mm_loadu_ps(p); }
+inline void store(float *p, float4 a) { _mm_storeu_ps(p, a.v); }
+
+inline float4 operator+(float4 a, float4 b) { return _mm_add_ps(a.v, b.v); }
+inline float4 operator-(float4 a, float4 b) { return _mm_sub_ps(a.v, b.v); }
+inline float4 operator*(float4 a, float4 b) { return _mm_mul_ps(a.v, b.v); }
+inline float4 operator/(float4 a, float4 b) { return _mm_div_ps(a.v, b.v); }
+inline float4 operator-(float4 a) { return _mm_xor_ps(a.v, _mm_set1_ps(-0.f)); }
+inline float4 min(float4 a, float4 b) { return _mm_min_ps(a.v, b.v); }
+inline float4 max(float4 a, float4 b) { return _mm_max_ps(a.v, b.v); }
+inline float4 sqrt(float4 a) { return _mm_sqrt_ps(a.v); }
+#else
+struct float4
+{
+  float v[4];
+};
+
+inline float4 splat(float f) { return {{f, f, f, f}}; }
+inline float4 load(const float *p) { return {{p[0], p[1], p[2], p[3]}}; }
+inline void store(float *p, float4 a) { for (int i=0; i<4; ++i) p[i] = a.v[i]; }
+
+#define TFE_SIMD_BINARY_OP(NAME, EXPR)                       \
+  inline float4 NAME(float4 a, float4 b) {                   \
+    float4 r;                                                \
+    for (int i=0; i<4; ++i) { float x=a.v[i], y=b.v[i]; r.v[i] = EXPR; } \
+    return r;                                                \
+  }
+TFE_SIMD_BINARY_OP(operator+, x+y)
+TFE_SIMD_BINARY_OP(operator-, x-y)
+TFE_SIMD_BINARY_OP(operator*, x*y)
+TFE_SIMD_BINARY_OP(operator/, x/y)
+TFE_SIMD_BINARY_OP(min, fminf(x,y))
+TFE_SIMD_BINARY_OP(max, fmaxf(x,y))
+#undef TFE_SIMD_BINARY_OP
+
+inline float4 operator-(float4 a)
+{
+  float4 r;
+  for (int i=0; i<4; ++i) r.v[i] = -a.v[i];
+  return r;
+}
+
+inline float4 sqrt(float4 a)
+{
+  float4 r;
+  for (int i=0; i<4; ++i) r.v[i] = sqrtf(a.v[i]);
+  return r;
+}
+#endif
+
+inline float4 clamp(float4 a, float lo, float hi)
+{
+  return max(splat(lo), min(a, splat(hi)));
+}
+
+/*! out[i] = unsigned(255*clamp(in[i],0,1) + 0.5), i.e., floats to
+  8-bit unorm, rounded to nearest */
+inline void packUnorm8(const float *in, uint8_t *out, size_t n)
+{
+  size_t i = 0;
+#ifdef TFE_HAVE_SSE2
+  const float4 scale = splat(255.f), half = splat(0.5f);
+  auto convert = [&](const float *p) {
+    return _mm_cvttps_epi32((clamp(load(p), 0.f, 1.f)*scale + half).v);
+  };
+  for (; i+16<=n; i+=16) {
+    __m128i lo = _mm_packs_epi32(convert(in+i), convert(in+i+4));
+    __m128i hi = _mm_packs_epi32(convert(in+i+8), convert(in+i+12));
+    _mm_storeu_si128((__m128i *)(out+i), _mm_packus_epi16(lo, hi));
+  }
+#endif
+  for (; i<n; ++i) {
+    out[i] = uint8_t(255.f*fmaxf(0.f, fminf(in[i], 1.f)) + 0.5f);
+  }
+}
+
+/*! out[i] = in[i]/255, i.e., 8-bit unorm to floats */
+inline void unpackUnorm8(const uint8_t *in, float *out, size_t n)
+{
+  size_t i = 0;
+#ifdef TFE_HAVE_SSE2
+  const __m128 scale = _mm_set1_ps(255.f);
+  const __m128i zero = _mm_setzero_si128();
+  for (; i+16<=n; i+=16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(in+i));
+    __m128i lo = _mm_unpacklo_epi8(bytes, zero), hi = _mm_unpackhi_epi8(bytes, zero);
+    __m128i words[4] = {
+      _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+      _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)
+    };
+    for (int j=0; j<4; ++j) {
+      _mm_storeu_ps(out+i+4*j, _mm_div_ps(_mm_cvtepi32_ps(words[j]), scale));
+    }
+  }
+#endif
+  for (; i<n; ++i) {
+    out[i] = in[i]/255.f;
+  }
+}
+
+} // simd
+} // tfe
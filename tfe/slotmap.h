@@ -0,0 +1,147 @@
+#pragma once
+
+/*! @file
+  @brief Slot map: densely stored elements addressed through handles
+
+  Elements live in one contiguous array (erasing moves the last
+  element into the gap, so the order is unspecified). They are
+  addressed through handles that consist of a slot index and the
+  slot's generation; erasing an element bumps its slot's generation,
+  so a handle never refers to a different element later, even after
+  the slot was reused. Handles are plain values, so copying them is
+  free, and they stay valid while elements are added, erased or moved.
+ */
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace tfe {
+
+  struct SlotHandle
+  {
+    uint32_t index{~0u};
+    uint32_t generation{0};
+
+    bool operator==(const SlotHandle &other) const
+    { return index == other.index && generation == other.generation; }
+
+    bool operator!=(const SlotHandle &other) const
+    { return !(*this == other); }
+  };
+
+  template <typename T>
+  class SlotMap
+  {
+   public:
+    SlotHandle insert(const T &value)
+    {
+      uint32_t slot;
+      if (freeSlots.empty()) {
+        slot = uint32_t(slots.size());
+        slots.push_back(Slot());
+      } else {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+      }
+
+      slots[slot].dense = uint32_t(values.size());
+      values.push_back(value);
+      denseToSlot.push_back(slot);
+
+      SlotHandle h;
+      h.index = slot;
+      h.generation = slots[slot].generation;
+      return h;
+    }
+
+    /*! returns false if the handle is stale */
+    bool erase(SlotHandle h)
+    {
+      if (!contains(h))
+        return false;
+
+      uint32_t dense = slots[h.index].dense;
+      uint32_t last = uint32_t(values.size()-1);
+      if (dense != last) {
+        values[dense] = std::move(values[last]);
+        denseToSlot[dense] = denseToSlot[last];
+        slots[denseToSlot[dense]].dense = dense;
+      }
+      values.pop_back();
+      denseToSlot.pop_back();
+
+      slots[h.index].dense = Unused;
+      ++slots[h.index].generation;
+      freeSlots.push_back(h.index);
+      return true;
+    }
+
+    /*! erase all elements; all handles become stale */
+    void clear()
+    {
+      for (uint32_t slot : denseToSlot) {
+        slots[slot].dense = Unused;
+        ++slots[slot].generation;
+        freeSlots.push_back(slot);
+      }
+      values.clear();
+      denseToSlot.clear();
+    }
+
+    bool contains(SlotHandle h) const
+    {
+      return h.index < slots.size() && slots[h.index].generation == h.generation
+          && slots[h.index].dense != Unused;
+    }
+
+    /*! nullptr if the handle is stale */
+    T *get(SlotHandle h)
+    {
+      return contains(h) ? &values[slots[h.index].dense] : nullptr;
+    }
+
+    const T *get(SlotHandle h) const
+    {
+      return contains(h) ? &values[slots[h.index].dense] : nullptr;
+    }
+
+    size_t size() const
+    {
+      return values.size();
+    }
+
+    /*! the elements, densely stored in unspecified order */
+    const std::vector<T> &getValues() const
+    {
+      return values;
+    }
+
+    /*! handle of getValues()[i] */
+    SlotHandle handleAt(size_t i) const
+    {
+      assert(i < values.size());
+      SlotHandle h;
+      h.index = denseToSlot[i];
+      h.generation = slots[h.index].generation;
+      return h;
+    }
+
+   private:
+    enum : uint32_t { Unused = ~0u };
+
+    struct Slot
+    {
+      uint32_t dense{Unused};
+      uint32_t generation{0};
+    };
+
+    std::vector<T> values;
+    std::vector<uint32_t> denseToSlot;
+    std::vector<Slot> slots;
+    std::vector<uint32_t> freeSlots;
+  };
+
+} // tfe
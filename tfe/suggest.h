@@ -0,0 +1,607 @@
+#pragma once
+
+/*! @file
+  @brief Automatic TF suggestions from histograms
+
+  TFSuggester detects features (materials) in a histogram and suggests
+  one function per feature (a Tent or a Gaussian), each in its own
+  hue. Three detectors:
+
+    Peaks   prominent peaks of the smoothed histogram (log scale);
+            sensitivity lowers the prominence threshold
+    Otsu    multi-level Otsu thresholds; sensitivity raises the
+            number of classes
+    KMeans  weighted k-means over the bins of the joint value x
+            gradient magnitude histogram; sensitivity raises k, and
+            clusters with a higher mean gradient (boundaries) are
+            more opaque
+
+  Everything that doesn't depend on sensitivity is cached, so moving
+  a sensitivity slider only re-selects features: the peaks (with
+  their prominences and widths) are computed once per histogram and
+  smoothing width, Otsu's dynamic programming tables are extended
+  level by level as more classes are requested, and k-means results
+  are kept per k. Smoothing, peak analysis, the Otsu levels and the
+  k-means iterations run in parallel and are deterministic.
+
+  Positions (centers, widths) are in [0:1] over the histogram's value
+  range, i.e., in the editor's domain.
+ */
+
+#include <map>
+#include "TFEditor.h"
+
+namespace tfe {
+
+  struct SuggestOptions
+  {
+    enum Method
+    {
+      Peaks,
+      Otsu,
+      KMeans, // uses the joint histogram, if set
+    };
+
+    enum Shape
+    {
+      TentShape,
+      GaussianShape,
+    };
+
+    Method method{Peaks};
+    Shape shape{GaussianShape};
+    // in [0:1]; higher values suggest more (and weaker) features
+    float sensitivity{0.5f};
+    // standard deviation of the smoothing kernel, in bins (Peaks only)
+    float smoothing{2.f};
+    unsigned maxFeatures{8};
+    // height of the strongest feature's function
+    float opacity{0.8f};
+  };
+
+  struct SuggestedFeature
+  {
+    float center;
+    float sigma;    // spread (standard deviation)
+    float strength; // in [0:1], relative to the strongest feature
+    vec3f color;    // sRGB
+  };
+
+  struct Suggestion
+  {
+    // sorted by center
+    std::vector<SuggestedFeature> features;
+    // one per feature, colored with the feature's color
+    std::vector<Function::SP> functions;
+    // the feature colors at the feature centers; nullptr if there
+    // are no features
+    ColorMap::SP colorMap;
+  };
+
+  class TFSuggester
+  {
+   public:
+    void setHistogram(const Histogram &hist)
+    {
+      const std::vector<uint64_t> &c = hist.getCounts();
+      counts.assign(c.begin(), c.end());
+      joint.clear();
+      jointBins = vec2ui(0);
+      invalidate();
+    }
+
+    /*! the weights are rescaled so that the smallest nonzero bin is 1,
+      as the peak detector looks at the counts on a log scale */
+    void setHistogram(const WeightedHistogram &hist)
+    {
+      const std::vector<double> &w = hist.getWeights();
+      double unit = DBL_MAX;
+      for (double x : w) {
+        if (x > 0.0) unit = std::min(unit, x);
+      }
+      counts.resize(w.size());
+      for (size_t i=0; i<w.size(); ++i) {
+        counts[i] = w[i] > 0.0 ? w[i]/unit : 0.0;
+      }
+      joint.clear();
+      jointBins = vec2ui(0);
+      invalidate();
+    }
+
+    /*! the 1D detectors use the marginal histogram of x (the value) */
+    void setHistogram(const Histogram2D &hist)
+    {
+      jointBins = hist.getNumBins();
+      const std::vector<uint64_t> &c = hist.getCounts();
+      joint.assign(c.begin(), c.end());
+      counts.assign(jointBins.x, 0.0);
+      for (size_t y=0; y<jointBins.y; ++y) {
+        for (size_t x=0; x<jointBins.x; ++x) {
+          counts[x] += joint[x+jointBins.x*y];
+        }
+      }
+      invalidate();
+    }
+
+    Suggestion suggest(const SuggestOptions &opts)
+    {
+      std::vector<SuggestedFeature> features;
+      if (!counts.empty() && opts.maxFeatures > 0) {
+        float sensitivity = clamp(opts.sensitivity, 0.f, 1.f);
+        // Otsu and k-means: two classes (e.g., background and one
+        // material) at the lowest sensitivity
+        unsigned numClasses = std::max(opts.maxFeatures, 2u);
+        numClasses = 2 + unsigned(sensitivity*(numClasses-2) + 0.5f);
+        if (opts.method == SuggestOptions::Peaks)
+          features = selectPeaks(opts.smoothing, sensitivity, opts.maxFeatures);
+        else if (opts.method == SuggestOptions::Otsu)
+          features = otsu(numClasses);
+        else
+          features = kMeans(numClasses);
+      }
+
+      if (features.size() > opts.maxFeatures) {
+        // keep the strongest ones
+        std::stable_sort(features.begin(), features.end(),
+          [](const SuggestedFeature &a, const SuggestedFeature &b) { return a.strength > b.strength; });
+        features.resize(opts.maxFeatures);
+      }
+      std::sort(features.begin(), features.end(),
+        [](const SuggestedFeature &a, const SuggestedFeature &b) { return a.center < b.center; });
+
+      Suggestion result;
+      result.features = features;
+      std::vector<float> positions;
+      std::vector<vec3f> colors;
+      for (size_t i=0; i<features.size(); ++i) {
+        SuggestedFeature &f = result.features[i];
+        f.color = featureColor(i, features.size());
+        float height = opts.opacity*f.strength;
+        Function::SP func;
+        if (opts.shape == SuggestOptions::TentShape)
+          func = std::make_shared<Tent>(vec2f(f.center, height), 0.f, 4.f*f.sigma);
+        else
+          func = std::make_shared<Gaussian>(f.center, f.sigma, height);
+        func->color = std::make_shared<ColorMap>(f.color);
+        result.functions.push_back(func);
+        positions.push_back(f.center);
+        colors.push_back(f.color);
+      }
+      if (!features.empty())
+        result.colorMap = std::make_shared<ColorMap>(positions.data(), colors.data(), unsigned(positions.size()));
+      return result;
+    }
+
+    /*! replace the editor's functions with the suggested ones, and set
+      the suggested color map */
+    static void apply(const Suggestion &suggestion, TFEditor &editor)
+    {
+      while (!editor.getFunctions().empty())
+        editor.removeFunction(editor.getHandle(editor.getFunctions().back()));
+      for (const Function::SP &f : suggestion.functions)
+        editor.addFunction(f);
+      if (suggestion.colorMap)
+        editor.setColorMap(suggestion.colorMap);
+    }
+
+   private:
+    struct Peak
+    {
+      float center;     // in bins
+      float sigma;      // in bins
+      float prominence; // on the smoothed log scale
+    };
+
+    void invalidate()
+    {
+      peakSmoothing = -1.f;
+      peaks.clear();
+      otsuCost.clear();
+      otsuSplit.clear();
+      kMeansResults.clear();
+    }
+
+    /*! histogram binned into at most maxBins coarser bins */
+    static std::vector<double> coarsen(const std::vector<double> &bins, size_t maxBins)
+    {
+      size_t factor = (bins.size()+maxBins-1)/maxBins;
+      std::vector<double> result((bins.size()+factor-1)/factor, 0.0);
+      for (size_t i=0; i<bins.size(); ++i) {
+        result[i/factor] += bins[i];
+      }
+      return result;
+    }
+
+    /*! Oklab hues, equally spaced, at constant lightness and chroma */
+    static vec3f featureColor(size_t i, size_t n)
+    {
+      float hue = 6.2831853f*(i+0.5f)/n;
+      vec3f lin = oklabToLinear(vec3f(0.72f, 0.13f*cosf(hue), 0.13f*sinf(hue)));
+      return vec3f(linearToSRGB(clamp(lin.x, 0.f, 1.f)),
+                   linearToSRGB(clamp(lin.y, 0.f, 1.f)),
+                   linearToSRGB(clamp(lin.z, 0.f, 1.f)));
+    }
+
+    // Peaks ---------------------------------------------------------
+
+    /*! find the peaks of the histogram, smoothed with a Gaussian of
+      the given width; peaks are sorted by prominence, the height
+      above the higher of the two lowest points that separate the peak
+      from higher terrain. Peaks on the boundary are ignored (they are
+      typically background, e.g., air) */
+    void findPeaks(float smoothing)
+    {
+      size_t n = counts.size();
+      std::vector<float> logCounts(n), s(n);
+      for (size_t i=0; i<n; ++i) {
+        logCounts[i] = logf(1.f+float(counts[i]));
+      }
+
+      int radius = smoothing > 0.f ? int(ceilf(3.f*smoothing)) : 0;
+      std::vector<float> kernel(2*radius+1, 1.f);
+      for (int k=-radius; k<=radius; ++k) {
+        kernel[k+radius] = expf(-0.5f*k*k/fmaxf(smoothing*smoothing, 1e-12f));
+      }
+      float norm = 0.f;
+      for (float k : kernel) norm += k;
+      parallel::forEachRange(n, 256, [&](size_t first, size_t last) {
+        for (size_t i=first; i<last; ++i) {
+          float sum = 0.f;
+          for (int k=-radius; k<=radius; ++k) {
+            // clamped at the boundary
+            int j = std::min(std::max(int(i)+k, 0), int(n)-1);
+            sum += kernel[k+radius]*logCounts[j];
+          }
+          s[i] = sum/norm;
+        }
+      });
+
+      // local maxima; plateaus count as one peak at their middle
+      std::vector<std::pair<size_t, size_t>> maxima;
+      for (size_t i=1; i+1<n; ++i) {
+        if (s[i] <= s[i-1])
+          continue;
+        size_t j = i+1;
+        while (j < n && s[j] == s[i]) ++j;
+        if (j < n && s[j] < s[i])
+          maxima.push_back({i, j-1});
+        i = j-1;
+      }
+
+      std::vector<Peak> found(maxima.size());
+      parallel::forEachRange(maxima.size(), 16, [&](size_t first, size_t last) {
+        for (size_t m=first; m<last; ++m) {
+          size_t lo = maxima[m].first, hi = maxima[m].second;
+          float top = s[lo];
+          float leftMin = top, rightMin = top;
+          for (size_t k=lo; k-- > 0 && s[k] <= top; ) leftMin = fminf(leftMin, s[k]);
+          for (size_t k=hi+1; k<n && s[k] <= top; ++k) rightMin = fminf(rightMin, s[k]);
+          float prominence = top-fmaxf(leftMin, rightMin);
+
+          // width at half prominence, linearly interpolated
+          float half = top-0.5f*prominence;
+          float left = float(lo), right = float(hi);
+          size_t k = lo;
+          while (k > 0 && s[k-1] > half) --k;
+          if (k > 0) left = k-(s[k]-half)/(s[k]-s[k-1]);
+          k = hi;
+          while (k+1 < n && s[k+1] > half) ++k;
+          if (k+1 < n) right = k+(s[k]-half)/(s[k]-s[k+1]);
+
+          Peak &p = found[m];
+          p.center = 0.5f*(lo+hi)+0.5f;
+          // FWHM to standard deviation; at least half a bin
+          p.sigma = fmaxf((right-left)/2.3548f, 0.5f);
+          p.prominence = prominence;
+        }
+      });
+
+      std::stable_sort(found.begin(), found.end(),
+        [](const Peak &a, const Peak &b) { return a.prominence > b.prominence; });
+      peaks = found;
+      peakSmoothing = smoothing;
+    }
+
+    std::vector<SuggestedFeature> selectPeaks(float smoothing, float sensitivity, unsigned maxFeatures)
+    {
+      if (smoothing != peakSmoothing)
+        findPeaks(smoothing);
+
+      std::vector<SuggestedFeature> result;
+      if (peaks.empty() || peaks[0].prominence <= 0.f)
+        return result;
+
+      float maxProminence = peaks[0].prominence;
+      float threshold = fmaxf((1.f-sensitivity)*maxProminence, 1e-6f*maxProminence);
+      float n = float(counts.size());
+      for (const Peak &p : peaks) {
+        if (p.prominence < threshold || result.size() >= maxFeatures)
+          break;
+        SuggestedFeature f;
+        f.center = p.center/n;
+        f.sigma = p.sigma/n;
+        f.strength = p.prominence/maxProminence;
+        result.push_back(f);
+      }
+      return result;
+    }
+
+    // Otsu ----------------------------------------------------------
+
+    /*! prefix sums of weight, weighted position, and weighted squared
+      position over the (coarsened) histogram */
+    struct Moments
+    {
+      std::vector<double> w, wx, wxx;
+
+      // sum of squared deviations from the mean in bins [i,j)
+      double cost(size_t i, size_t j) const
+      {
+        double sw = w[j]-w[i];
+        if (sw <= 0.0)
+          return 0.0;
+        double sx = wx[j]-wx[i];
+        return fmax(wxx[j]-wxx[i] - sx*sx/sw, 0.0);
+      }
+    };
+
+    /*! multi-level Otsu: minimize the within-class variance by dynamic
+      programming; otsuCost[k][j] is the minimum cost of splitting the
+      bins [0,j) into k+1 classes, otsuSplit[k][j] the start of the
+      last class. Levels are computed on demand and kept, each level
+      in parallel over j */
+    std::vector<SuggestedFeature> otsu(unsigned numClasses)
+    {
+      // O(k*n^2), so the histogram is coarsened to at most 256 bins
+      std::vector<double> bins = coarsen(counts, 256);
+      size_t n = bins.size();
+      Moments m;
+      m.w.assign(n+1, 0.0); m.wx.assign(n+1, 0.0); m.wxx.assign(n+1, 0.0);
+      for (size_t i=0; i<n; ++i) {
+        double x = (i+0.5)/n;
+        m.w[i+1] = m.w[i]+bins[i];
+        m.wx[i+1] = m.wx[i]+bins[i]*x;
+        m.wxx[i+1] = m.wxx[i]+bins[i]*x*x;
+      }
+
+      size_t nonEmpty = 0;
+      for (double b : bins) nonEmpty += b > 0.0;
+      numClasses = unsigned(std::min(size_t(numClasses), nonEmpty));
+      std::vector<SuggestedFeature> result;
+      if (numClasses == 0)
+        return result;
+
+      if (otsuCost.empty()) {
+        otsuCost.push_back(std::vector<double>(n+1));
+        otsuSplit.push_back(std::vector<uint32_t>(n+1, 0));
+        for (size_t j=0; j<=n; ++j) otsuCost[0][j] = m.cost(0, j);
+      }
+      while (otsuCost.size() < numClasses) {
+        const std::vector<double> &prev = otsuCost.back();
+        std::vector<double> cost(n+1, DBL_MAX);
+        std::vector<uint32_t> split(n+1, 0);
+        size_t k = otsuCost.size();
+        parallel::forEachRange(n+1, 16, [&](size_t first, size_t last) {
+          for (size_t j=std::max(first, k+1); j<last; ++j) {
+            for (size_t i=k; i<j; ++i) {
+              double c = prev[i]+m.cost(i, j);
+              if (c < cost[j]) {
+                cost[j] = c;
+                split[j] = uint32_t(i);
+              }
+            }
+          }
+        });
+        otsuCost.push_back(cost);
+        otsuSplit.push_back(split);
+      }
+
+      // backtrack the class boundaries
+      std::vector<size_t> bounds(numClasses+1);
+      bounds[numClasses] = n;
+      for (size_t k=numClasses-1; k>0; --k) {
+        bounds[k] = otsuSplit[k][bounds[k+1]];
+      }
+      bounds[0] = 0;
+
+      double total = m.w[n];
+      for (size_t k=0; k<numClasses; ++k) {
+        size_t i = bounds[k], j = bounds[k+1];
+        double w = m.w[j]-m.w[i];
+        if (w <= 0.0)
+          continue;
+        SuggestedFeature f;
+        f.center = float((m.wx[j]-m.wx[i])/w);
+        f.sigma = fmaxf(float(sqrt(m.cost(i, j)/w)), 0.5f/n);
+        // rare classes are more interesting than, e.g., the background
+        f.strength = float(1.0-w/total);
+        result.push_back(f);
+      }
+      normalizeStrengths(result);
+      return result;
+    }
+
+    // k-means -------------------------------------------------------
+
+    std::vector<SuggestedFeature> kMeans(unsigned requestedK)
+    {
+      auto it = kMeansResults.find(requestedK);
+      if (it != kMeansResults.end())
+        return it->second;
+
+      // the bins are the points; weights are on a log scale, so that
+      // the background doesn't attract all centers
+      struct Point { float x, y, w; };
+      std::vector<Point> points;
+      bool hasGradient = !joint.empty();
+      float halfBin;
+      if (hasGradient) {
+        // at most 128x128 bins
+        size_t fx = (jointBins.x+127)/128, fy = (jointBins.y+127)/128;
+        size_t nx = (jointBins.x+fx-1)/fx, ny = (jointBins.y+fy-1)/fy;
+        halfBin = 0.5f/nx;
+        std::vector<double> bins(nx*ny, 0.0);
+        for (size_t y=0; y<jointBins.y; ++y) {
+          for (size_t x=0; x<jointBins.x; ++x) {
+            bins[x/fx+nx*(y/fy)] += joint[x+jointBins.x*y];
+          }
+        }
+        for (size_t y=0; y<ny; ++y) {
+          for (size_t x=0; x<nx; ++x) {
+            double c = bins[x+nx*y];
+            if (c > 0.0)
+              points.push_back({(x+0.5f)/nx, (y+0.5f)/ny, float(log1p(c))});
+          }
+        }
+      } else {
+        std::vector<double> bins = coarsen(counts, 1024);
+        halfBin = 0.5f/bins.size();
+        for (size_t x=0; x<bins.size(); ++x) {
+          if (bins[x] > 0.0)
+            points.push_back({(x+0.5f)/bins.size(), 0.f, float(log1p(bins[x]))});
+        }
+      }
+
+      // cached under the requested k, which is what the next lookup
+      // uses, and under the clamped one it ran with
+      std::vector<SuggestedFeature> result;
+      unsigned k = unsigned(std::min(size_t(requestedK), points.size()));
+      if (k == 0) {
+        kMeansResults[requestedK] = result;
+        return result;
+      }
+
+      // deterministic seeding: the heaviest point, then repeatedly
+      // the point with the largest weighted distance to its closest
+      // center
+      std::vector<vec2f> centers;
+      size_t heaviest = 0;
+      for (size_t i=1; i<points.size(); ++i) {
+        if (points[i].w > points[heaviest].w) heaviest = i;
+      }
+      centers.push_back(vec2f(points[heaviest].x, points[heaviest].y));
+      std::vector<float> dist(points.size(), FLT_MAX);
+      while (centers.size() < k) {
+        vec2f c = centers.back();
+        size_t farthest = 0;
+        float farthestDist = -1.f;
+        for (size_t i=0; i<points.size(); ++i) {
+          float dx = points[i].x-c.x, dy = points[i].y-c.y;
+          dist[i] = fminf(dist[i], dx*dx+dy*dy);
+          if (points[i].w*dist[i] > farthestDist) {
+            farthestDist = points[i].w*dist[i];
+            farthest = i;
+          }
+        }
+        centers.push_back(vec2f(points[farthest].x, points[farthest].y));
+      }
+
+      // Lloyd iterations; per cluster: w, wx, wy, wxx; plus the
+      // number of points that changed their cluster
+      typedef std::vector<double> Sums;
+      std::vector<uint32_t> assignment(points.size(), ~0u);
+      Sums sums;
+      for (int iter=0; iter<50; ++iter) {
+        sums = parallel::mapReduce(points.size(), 4096, Sums(4*k+1, 0.0),
+          [&](Sums &partial, size_t first, size_t last) {
+            for (size_t i=first; i<last; ++i) {
+              const Point &p = points[i];
+              uint32_t best = 0;
+              float bestDist = FLT_MAX;
+              for (uint32_t c=0; c<k; ++c) {
+                float dx = p.x-centers[c].x, dy = p.y-centers[c].y;
+                float d = dx*dx+dy*dy;
+                if (d < bestDist) { bestDist = d; best = c; }
+              }
+              if (assignment[i] != best) {
+                assignment[i] = best;
+                partial[4*k] += 1.0;
+              }
+              partial[4*best+0] += p.w;
+              partial[4*best+1] += p.w*p.x;
+              partial[4*best+2] += p.w*p.y;
+              partial[4*best+3] += p.w*p.x*p.x;
+            }
+          },
+          [](Sums &result, const Sums &partial) {
+            for (size_t i=0; i<result.size(); ++i) result[i] += partial[i];
+          });
+
+        for (unsigned c=0; c<k; ++c) {
+          // empty clusters keep their center
+          if (sums[4*c] > 0.0)
+            centers[c] = vec2f(float(sums[4*c+1]/sums[4*c]), float(sums[4*c+2]/sums[4*c]));
+        }
+        if (sums[4*k] == 0.0)
+          break;
+      }
+
+      // clusters are sorted by value; as the TF only depends on the
+      // value, clusters that differ mainly in gradient are merged
+      struct Cluster { double w, wx, wxx; float strength; };
+      std::vector<unsigned> order;
+      for (unsigned c=0; c<k; ++c) {
+        if (sums[4*c] > 0.0) order.push_back(c);
+      }
+      std::sort(order.begin(), order.end(),
+        [&](unsigned a, unsigned b) { return centers[a].x < centers[b].x; });
+
+      double total = 0.0;
+      for (unsigned c : order) total += sums[4*c];
+      auto sigmaOf = [&](const Cluster &c) {
+        double mean = c.wx/c.w;
+        return fmaxf(float(sqrt(fmax(c.wxx/c.w - mean*mean, 0.0))), halfBin);
+      };
+      std::vector<Cluster> merged;
+      for (unsigned c : order) {
+        Cluster cl;
+        cl.w = sums[4*c]; cl.wx = sums[4*c+1]; cl.wxx = sums[4*c+3];
+        // boundaries (high gradient) are more interesting than the
+        // inside of materials; without gradients, rare values are
+        cl.strength = hasGradient ? centers[c].y : float(1.0-cl.w/total);
+        if (!merged.empty()) {
+          Cluster &last = merged.back();
+          float d = fabsf(float(cl.wx/cl.w - last.wx/last.w));
+          if (d < 0.5f*fmaxf(sigmaOf(cl), sigmaOf(last))) {
+            last.w += cl.w; last.wx += cl.wx; last.wxx += cl.wxx;
+            last.strength = fmaxf(last.strength, cl.strength);
+            continue;
+          }
+        }
+        merged.push_back(cl);
+      }
+
+      for (const Cluster &cl : merged) {
+        SuggestedFeature f;
+        f.center = float(cl.wx/cl.w);
+        f.sigma = sigmaOf(cl);
+        f.strength = cl.strength;
+        result.push_back(f);
+      }
+      normalizeStrengths(result);
+      kMeansResults[k] = result;
+      kMeansResults[requestedK] = result;
+      return result;
+    }
+
+    static void normalizeStrengths(std::vector<SuggestedFeature> &features)
+    {
+      float maxStrength = 0.f;
+      for (const SuggestedFeature &f : features) maxStrength = fmaxf(maxStrength, f.strength);
+      for (SuggestedFeature &f : features) {
+        f.strength = maxStrength > 0.f ? f.strength/maxStrength : 1.f;
+      }
+    }
+
+    std::vector<double> counts;
+    std::vector<double> joint;
+    vec2ui jointBins{0};
+
+    float peakSmoothing{-1.f};
+    std::vector<Peak> peaks;
+    std::vector<std::vector<double>> otsuCost;
+    std::vector<std::vector<uint32_t>> otsuSplit;
+    std::map<unsigned, std::vector<SuggestedFeature>> kMeansResults;
+  };
+
+} // tfe
@@ -0,0 +1,284 @@
+#pragma once
+
+/*! @file
+  @brief Headless replay of recorded editor interactions
+
+  TraceReplayer restores the trace's initial state into an editor and
+  drives it through the recorded events (as fast as possible, the
+  timestamps are only kept for reference). For each recorded frame it
+  times the stages that follow an edit:
+
+    input   applying the frame's coalesced pointer input
+    raster  bringing the editor texture up to date
+    bake    bringing a baked RGBA LUT up to date
+    upload  transferring the texture to where it's displayed
+
+  Each stage is either run incrementally (updateTexture(), re-baking
+  the changed range only, uploading the updated columns) or as a full
+  rebuild, so the two can be compared on the same session. Without a
+  GL context, upload copies the texels into a staging buffer; with
+  TFEditorOpenGL, pass an upload callback that does the actual
+  transfer.
+ */
+
+#include <functional>
+#include "TFEditor.h"
+
+namespace tfe {
+
+  /*! latency distribution of one stage, in milliseconds */
+  struct LatencyStats
+  {
+    size_t count{0};
+    double mean{0.0}, p50{0.0}, p90{0.0}, p99{0.0}, max{0.0};
+
+    static LatencyStats compute(std::vector<double> samples)
+    {
+      LatencyStats s;
+      if (samples.empty())
+        return s;
+
+      std::sort(samples.begin(), samples.end());
+      auto percentile = [&](double p) {
+        size_t i = size_t(p*(samples.size()-1) + 0.5);
+        return samples[std::min(i, samples.size()-1)];
+      };
+
+      s.count = samples.size();
+      for (double v : samples) s.mean += v;
+      s.mean /= samples.size();
+      s.p50 = percentile(0.5);
+      s.p90 = percentile(0.9);
+      s.p99 = percentile(0.99);
+      s.max = samples.back();
+      return s;
+    }
+  };
+
+  inline std::ostream &operator<<(std::ostream &out, const LatencyStats &s)
+  {
+    out << "n=" << s.count << " mean=" << s.mean << "ms p50=" << s.p50 << "ms p90="
+        << s.p90 << "ms p99=" << s.p99 << "ms max=" << s.max << "ms";
+    return out;
+  }
+
+  class TraceReplayer
+  {
+   public:
+    /*! uploads the texture; updatedColumns is the column range
+      [x,y) that changed since the last upload */
+    typedef std::function<void(const Texture &tex, vec2ui updatedColumns)> Upload;
+
+    struct Result
+    {
+      LatencyStats input, raster, bake, upload;
+      // number of edit events (pointer, add, remove, raise, setters)
+      // and frames
+      size_t numEvents{0}, numFrames{0};
+    };
+
+    /*! incremental: use the incremental raster/bake/upload paths,
+      otherwise rebuild everything every frame */
+    TraceReplayer(bool incremental = true, unsigned lutSize = 1024)
+      : incremental(incremental), lutSize(std::max(lutSize, 2u))
+    {}
+
+    void setUpload(const Upload &up)
+    {
+      upload = up;
+    }
+
+    /*! replay the trace on editor; returns false if the trace's
+      initial state can't be restored, or an event refers to a function
+      that doesn't exist */
+    bool replay(const InteractionTrace &trace, TFEditor &editor, Result &result)
+    {
+      result = Result();
+      if (!editor.deserialize(trace.initialState.data(), trace.initialState.size()))
+        return false;
+
+      std::vector<double> input, raster, bake, uploadTimes;
+      double pendingInput = 0.0;
+      std::vector<vec4f> lut;
+      uint64_t lutVersion = 0;
+      std::vector<uint32_t> staging;
+
+      for (auto &e : trace.events) {
+        const auto &funcs = editor.getFunctions();
+        switch (e.type) {
+          case TraceEvent::PointerDown: editor.pointerDown(e.pos); break;
+          case TraceEvent::PointerMove: editor.pointerMove(e.pos); break;
+          case TraceEvent::PointerUp: editor.pointerUp(); break;
+          case TraceEvent::ApplyInput:
+            pendingInput += time([&]() { editor.applyPointerInput(); });
+            break;
+          case TraceEvent::AddFunction: {
+            StateReader in(e.function.data(), e.function.size());
+            Function::SP f = deserializeFunction(in);
+            if (!f)
+              return false;
+            editor.addFunction(f);
+            break;
+          }
+          case TraceEvent::RemoveFunction:
+          case TraceEvent::MoveToTop: {
+            if (e.index >= funcs.size())
+              return false;
+            Function::SP f = funcs[e.index];
+            if (e.type == TraceEvent::RemoveFunction)
+              editor.removeFunction(f);
+            else
+              editor.moveToTop(f);
+            break;
+          }
+          case TraceEvent::SetDrawTarget: {
+            FreeHand::SP target;
+            if (e.index != TraceEvent::NoIndex) {
+              if (e.index >= funcs.size())
+                return false;
+              target = std::dynamic_pointer_cast<FreeHand>(funcs[e.index]);
+            } else if (!e.function.empty()) {
+              StateReader in(e.function.data(), e.function.size());
+              target = std::dynamic_pointer_cast<FreeHand>(deserializeFunction(in));
+            }
+            if (!target && (e.index != TraceEvent::NoIndex || !e.function.empty()))
+              return false;
+            editor.setDrawTarget(target);
+            break;
+          }
+          case TraceEvent::SetWeight:
+          case TraceEvent::SetColor: {
+            if (e.index >= funcs.size())
+              return false;
+            Function::SP f = funcs[e.index];
+            if (e.type == TraceEvent::SetWeight) {
+              editor.setWeight(f, e.pos.x);
+            } else {
+              ColorMap::SP color;
+              if (!readColorMap(e.function, color))
+                return false;
+              editor.setColor(f, color);
+            }
+            break;
+          }
+          case TraceEvent::SetCombineOp:
+            if (e.index > uint32_t(CombineOp::Over))
+              return false;
+            editor.setCombineOp(CombineOp(e.index));
+            break;
+          case TraceEvent::SetColorMap: {
+            ColorMap::SP cm;
+            if (!readColorMap(e.function, cm))
+              return false;
+            editor.setColorMap(cm);
+            break;
+          }
+          case TraceEvent::SetDomainMapping: {
+            DomainMapping::SP m;
+            if (!e.function.empty()) {
+              StateReader in(e.function.data(), e.function.size());
+              if (!deserializeDomainMapping(in, m))
+                return false;
+            }
+            if (!editor.setDomainMapping(m))
+              return false;
+            break;
+          }
+          case TraceEvent::SetPickRadius:
+            editor.setPickRadius(e.pos);
+            break;
+          case TraceEvent::Frame: {
+            input.push_back(pendingInput);
+            pendingInput = 0.0;
+
+            const Texture *tex = nullptr;
+            Texture full;
+            raster.push_back(time([&]() {
+              if (incremental) {
+                tex = &editor.updateTexture(e.size.x, e.size.y);
+              } else {
+                full = editor.rasterize(e.size.x, e.size.y);
+                tex = &full;
+              }
+            }));
+
+            bake.push_back(time([&]() {
+              bakeLUT(editor, lut, lutVersion);
+            }));
+
+            vec2ui cols = incremental ? editor.getUpdatedColumns() : vec2ui(0u, tex->width);
+            uploadTimes.push_back(time([&]() {
+              if (upload) upload(*tex, cols);
+              else stage(*tex, cols, staging);
+            }));
+            ++result.numFrames;
+            continue;
+          }
+        }
+        ++result.numEvents;
+      }
+
+      result.input = LatencyStats::compute(input);
+      result.raster = LatencyStats::compute(raster);
+      result.bake = LatencyStats::compute(bake);
+      result.upload = LatencyStats::compute(uploadTimes);
+      return true;
+    }
+
+   private:
+    // empty means none
+    static bool readColorMap(const std::vector<uint8_t> &bytes, ColorMap::SP &cm)
+    {
+      cm = nullptr;
+      if (bytes.empty())
+        return true;
+      StateReader in(bytes.data(), bytes.size());
+      cm = ColorMap::deserialize(in);
+      return cm != nullptr;
+    }
+
+    template <typename Func>
+    static double time(const Func &func)
+    {
+      auto start = std::chrono::steady_clock::now();
+      func();
+      return std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now()-start).count();
+    }
+
+    void bakeLUT(const TFEditor &editor, std::vector<vec4f> &lut, uint64_t &version) const
+    {
+      unsigned first = 0, last = lutSize;
+      if (incremental && lut.size() == lutSize) {
+        vec2ui changed = editor.changedLUTEntries(version, lutSize);
+        if (changed.x == changed.y)
+          return;
+        first = changed.x;
+        last = changed.y;
+      }
+
+      lut.resize(lutSize);
+      editor.bakeLUT(lutSize, first, last, lut.data()+first);
+      version = editor.getVersion();
+    }
+
+    // copy the columns [cols.x,cols.y) of all rows, like
+    // glTexSubImage2D() does with GL_UNPACK_ROW_LENGTH set
+    static void stage(const Texture &tex, vec2ui cols, std::vector<uint32_t> &staging)
+    {
+      staging.resize(tex.data.size());
+      if (cols.y <= cols.x)
+        return;
+      for (unsigned y=0; y<tex.height; ++y) {
+        const uint32_t *src = tex.data.data() + size_t(y)*tex.width;
+        uint32_t *dst = staging.data() + size_t(y)*tex.width;
+        std::copy(src+cols.x, src+cols.y, dst+cols.x);
+      }
+    }
+
+    bool incremental;
+    unsigned lutSize;
+    Upload upload;
+  };
+
+} // tfe